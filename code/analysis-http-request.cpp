@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
+#include "web/http_scan.h"
 #define BUFFER_SIZE 4096  // 读缓冲区大小
 
 // 主状态机
@@ -52,6 +53,11 @@ static const char* szret[] = {"I get a correct result\n", "Something wrong\n"};
 LINE_STATUS parse_line(char* buffer, int& checked_index, int& read_index) {
     char temp;
     for ( ; checked_index < read_index; ++checked_index) {
+        // 用SIMD一次检查多个字节，直接跳到下一个回车符或换行符；没有找到时停在数据末尾，下次从这里继续
+        checked_index = http_scan::find_crlf(buffer + checked_index, buffer + read_index) - buffer;
+        if (checked_index == read_index) {
+            break;
+        }
         //获取当前要分析的字节
         temp = buffer[checked_index];
         //若为回车符，则说明可能读取到一个完整的行
@@ -0,0 +1,390 @@
+/*
+ * web服务器并发模式的HTTP基准测试
+ * 依次以不同的命令行参数启动同一个服务器程序，用同一组静态文件（网站根目录下的所有普通文件）施加相同的负载，
+ * 默认比较半同步/半反应堆的线程池模式和预派生（processpool）模式。
+ * 每个客户线程用一个epoll驱动若干个keep-alive连接，每个连接收完一个响应后立即按顺序请求下一个文件（闭环负载）。
+ * 先预热WARMUP_MS毫秒（填充文件缓存和响应缓存），再统计之后若干秒内完成的请求数、字节数和每个请求的延迟分布。
+ * 每种模式使用不同的端口，避免上一个服务器遗留的连接影响bind
+ *
+ * 编译：g++ -O2 -pthread http-benchmark.cpp -o http-benchmark
+ * 运行：./http-benchmark [-c 连接数] [-t 线程数] [-d 秒数] [-r 网站根目录] [-m "服务器参数"]... 服务器程序 ip 起始端口
+ *      -m可以给出多次，每次是一种模式的服务器参数（如"-R 0"、"-F 4 -A balance"），不给出时比较""和"-F 0"
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#define MAX_MODES 16
+#define MAX_FILES 4096
+#define WARMUP_MS 1000
+#define MAX_HEADER 8192
+#define RECV_BUFFER 65536
+
+// 测试阶段：预热中的请求不计入结果
+enum PHASE { PHASE_WARMUP, PHASE_MEASURE, PHASE_STOP };
+
+static std::vector< std::string > files;        // 请求的路径，相对于网站根目录
+static const char* doc_root = "/var/www/html";
+static struct sockaddr_in server_address;
+static std::atomic< int > phase( PHASE_WARMUP );
+
+static int64_t now_us(){
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( int64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int collect( const char* path, const struct stat* st, int type, struct FTW* ftw ){
+    if( type == FTW_F && S_ISREG( st->st_mode ) ){
+        files.push_back( path + strlen( doc_root ) );
+    }
+    return files.size() < MAX_FILES ? 0 : 1;
+}
+
+// 一个keep-alive连接的状态：正在接收的响应头，或剩余的响应体字节数
+struct client{
+    int fd;
+    size_t next;                // 下一个请求的文件
+    int64_t start;              // 当前请求发出的时间
+    bool connecting;            // 非阻塞connect尚未完成，可写时才发出第一个请求
+    bool measured;              // 当前请求在统计阶段发出
+    char header[ MAX_HEADER ];
+    int header_len;
+    long body_left;             // -1表示还在接收响应头
+};
+
+struct worker{
+    pthread_t thread;
+    int connections;
+    size_t first;               // 各线程从不同的文件开始，避免所有连接同时请求同一个文件
+    long requests;
+    long errors;
+    long long bytes;
+    std::vector< uint32_t > latency;
+};
+
+// 请求很短，一次send即可写入空的发送缓冲区
+static bool send_request( client* c ){
+    char request[ 512 ];
+    int len = snprintf( request, sizeof( request ), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n",
+            files[ c->next % files.size() ].c_str() );
+    ++c->next;
+    c->header_len = 0;
+    c->body_left = -1;
+    c->start = now_us();
+    c->measured = ( phase.load( std::memory_order_relaxed ) == PHASE_MEASURE );
+    return send( c->fd, request, len, 0 ) == len;
+}
+
+// 非阻塞地发起连接：服务器的监听队列满时SYN会被丢弃，阻塞的connect要等重传，期间同一线程的其他连接都得不到处理
+static bool open_client( int epollfd, client* c ){
+    c->fd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+    if( c->fd < 0 ){
+        return false;
+    }
+    if( connect( c->fd, ( struct sockaddr* )&server_address, sizeof( server_address ) ) < 0 && errno != EINPROGRESS ){
+        close( c->fd );
+        c->fd = -1;
+        return false;
+    }
+    int one = 1;
+    setsockopt( c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    c->connecting = true;
+    epoll_event event;
+    event.data.ptr = c;
+    event.events = EPOLLOUT;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, c->fd, &event );
+    return true;
+}
+
+// 连接建立后改为等待响应，并发出第一个请求
+static bool connected( int epollfd, client* c ){
+    int error = 0;
+    socklen_t len = sizeof( error );
+    if( getsockopt( c->fd, SOL_SOCKET, SO_ERROR, &error, &len ) < 0 || error != 0 ){
+        return false;
+    }
+    c->connecting = false;
+    epoll_event event;
+    event.data.ptr = c;
+    event.events = EPOLLIN;
+    epoll_ctl( epollfd, EPOLL_CTL_MOD, c->fd, &event );
+    return send_request( c );
+}
+
+// 处理收到的数据，返回已完成的响应数，出错返回-1。服务器按顺序回应，每次只有一个请求在途
+static int on_data( client* c, const char* data, long len, worker* w ){
+    if( c->body_left < 0 ){
+        long n = std::min( len, ( long )( MAX_HEADER - 1 - c->header_len ) );
+        memcpy( c->header + c->header_len, data, n );
+        c->header_len += n;
+        c->header[ c->header_len ] = '\0';
+        char* end = strstr( c->header, "\r\n\r\n" );
+        if( !end ){
+            return ( c->header_len < MAX_HEADER - 1 ) ? 0 : -1;
+        }
+        int status = 0;
+        const char* length = strcasestr( c->header, "Content-Length:" );
+        if( sscanf( c->header, "HTTP/1.%*d %d", &status ) != 1 || status != 200 || !length || length > end ){
+            return -1;
+        }
+        // 本次数据中响应头之后的部分属于响应体
+        long header_bytes = end + 4 - c->header;
+        c->body_left = atol( length + 15 ) - ( len - ( header_bytes - ( c->header_len - n ) ) );
+    }
+    else{
+        c->body_left -= len;
+    }
+    if( c->body_left > 0 ){
+        return 0;
+    }
+    if( c->body_left < 0 ){
+        return -1;
+    }
+    if( c->measured ){
+        ++w->requests;
+        w->latency.push_back( ( uint32_t )( now_us() - c->start ) );
+    }
+    return 1;
+}
+
+static void* run_worker( void* arg ){
+    worker* w = ( worker* )arg;
+    int epollfd = epoll_create( 5 );
+    std::vector< client > clients( w->connections );
+    for( int i = 0; i < w->connections; ++i ){
+        client* c = &clients[i];
+        c->next = w->first + i;
+        if( !open_client( epollfd, c ) ){
+            ++w->errors;
+        }
+    }
+    static __thread char buf[ RECV_BUFFER ];
+    epoll_event events[ 1024 ];
+    while( phase.load( std::memory_order_relaxed ) != PHASE_STOP ){
+        int number = epoll_wait( epollfd, events, 1024, 100 );
+        for( int i = 0; i < number; ++i ){
+            client* c = ( client* )events[i].data.ptr;
+            bool ok = true;
+            if( c->connecting ){
+                ok = connected( epollfd, c );
+            }
+            while( ok && !c->connecting ){
+                long len = recv( c->fd, buf, sizeof( buf ), 0 );
+                if( len < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ){
+                    break;
+                }
+                if( len <= 0 ){
+                    ok = false;
+                    break;
+                }
+                if( c->measured ){
+                    w->bytes += len;
+                }
+                int done = on_data( c, buf, len, w );
+                if( done < 0 || ( done > 0 && !send_request( c ) ) ){
+                    ok = false;
+                }
+            }
+            // 出错或被服务器关闭的连接重新建立，统计为一次错误
+            if( !ok ){
+                ++w->errors;
+                close( c->fd );
+                open_client( epollfd, c );
+            }
+        }
+    }
+    for( size_t i = 0; i < clients.size(); ++i ){
+        if( clients[i].fd >= 0 ){
+            close( clients[i].fd );
+        }
+    }
+    close( epollfd );
+    return NULL;
+}
+
+// 以args为参数启动服务器，等待它开始监听
+static pid_t start_server( const char* program, const char* args, const char* ip, int port ){
+    std::vector< std::string > words;
+    words.push_back( program );
+    char* copy = strdup( args );
+    for( char* p = strtok( copy, " " ); p; p = strtok( NULL, " " ) ){
+        words.push_back( p );
+    }
+    free( copy );
+    char port_str[ 16 ];
+    snprintf( port_str, sizeof( port_str ), "%d", port );
+    words.push_back( ip );
+    words.push_back( port_str );
+
+    pid_t pid = fork();
+    if( pid == 0 ){
+        std::vector< char* > argv;
+        for( size_t i = 0; i < words.size(); ++i ){
+            argv.push_back( ( char* )words[i].c_str() );
+        }
+        argv.push_back( NULL );
+        int null = open( "/dev/null", O_WRONLY );
+        dup2( null, STDOUT_FILENO );
+        dup2( null, STDERR_FILENO );
+        execv( program, argv.data() );
+        _exit( 127 );
+    }
+    for( int i = 0; i < 100 && pid > 0; ++i ){
+        usleep( 50000 );
+        int fd = socket( PF_INET, SOCK_STREAM, 0 );
+        bool up = connect( fd, ( struct sockaddr* )&server_address, sizeof( server_address ) ) == 0;
+        close( fd );
+        if( up ){
+            // 预派生模式的子进程可能还没有进入事件循环，连接会在监听队列中等待，不影响结果
+            return pid;
+        }
+        if( waitpid( pid, NULL, WNOHANG ) == pid ){
+            return -1;
+        }
+    }
+    if( pid > 0 ){
+        kill( pid, SIGKILL );
+        waitpid( pid, NULL, 0 );
+    }
+    return -1;
+}
+
+static double percentile( std::vector< uint32_t >& v, double p ){
+    if( v.empty() ){
+        return 0;
+    }
+    size_t i = ( size_t )( p * ( v.size() - 1 ) );
+    std::nth_element( v.begin(), v.begin() + i, v.end() );
+    return v[i] / 1000.0;
+}
+
+static void usage( const char* prog ){
+    printf( "usage: %s [-c connections] [-t threads] [-d seconds] [-r doc_root] [-m \"server args\"]... server ip port\n", prog );
+}
+
+int main( int argc, char* argv[] ){
+    int connections = 256;
+    int threads = 4;
+    int seconds = 10;
+    const char* modes[ MAX_MODES ];
+    int mode_number = 0;
+    int opt;
+    while( ( opt = getopt( argc, argv, "c:t:d:r:m:" ) ) != -1 ){
+        switch( opt ){
+            case 'c':{
+                connections = atoi( optarg );
+                break;
+            }
+            case 't':{
+                threads = atoi( optarg );
+                break;
+            }
+            case 'd':{
+                seconds = atoi( optarg );
+                break;
+            }
+            case 'r':{
+                doc_root = optarg;
+                break;
+            }
+            case 'm':{
+                if( mode_number < MAX_MODES ){
+                    modes[ mode_number++ ] = optarg;
+                }
+                break;
+            }
+            default:{
+                usage( argv[0] );
+                return 1;
+            }
+        }
+    }
+    if( argc - optind < 3 || threads < 1 || connections < threads ){
+        usage( argv[0] );
+        return 1;
+    }
+    const char* program = argv[optind];
+    const char* ip = argv[optind + 1];
+    int port = atoi( argv[optind + 2] );
+    if( mode_number == 0 ){
+        modes[ mode_number++ ] = "";
+        modes[ mode_number++ ] = "-F 0";
+    }
+
+    nftw( doc_root, collect, 16, FTW_PHYS );
+    if( files.empty() ){
+        printf( "no files under %s\n", doc_root );
+        return 1;
+    }
+    std::sort( files.begin(), files.end() );
+    signal( SIGPIPE, SIG_IGN );
+    printf( "%zu files under %s, %d connections, %d threads, %d s per mode\n", files.size(), doc_root, connections, threads, seconds );
+    printf( "%-20s %10s %10s %8s %8s %8s %8s %7s\n", "server args", "req/s", "MB/s", "p50 ms", "p99 ms", "p99.9 ms", "max ms", "errors" );
+
+    for( int m = 0; m < mode_number; ++m, ++port ){
+        bzero( &server_address, sizeof( server_address ) );
+        server_address.sin_family = AF_INET;
+        inet_pton( AF_INET, ip, &server_address.sin_addr );
+        server_address.sin_port = htons( port );
+        pid_t pid = start_server( program, modes[m], ip, port );
+        if( pid < 0 ){
+            printf( "%-20s cannot start server\n", modes[m][0] ? modes[m] : "(threadpool)" );
+            continue;
+        }
+
+        phase.store( PHASE_WARMUP );
+        std::vector< worker > workers( threads );
+        for( int i = 0; i < threads; ++i ){
+            workers[i].connections = connections / threads + ( i < connections % threads ? 1 : 0 );
+            workers[i].first = i * files.size() / threads;
+            workers[i].requests = workers[i].errors = 0;
+            workers[i].bytes = 0;
+            pthread_create( &workers[i].thread, NULL, run_worker, &workers[i] );
+        }
+        usleep( WARMUP_MS * 1000 );
+        phase.store( PHASE_MEASURE );
+        int64_t start = now_us();
+        sleep( seconds );
+        phase.store( PHASE_STOP );
+        double elapsed = ( now_us() - start ) / 1e6;
+
+        long requests = 0;
+        long errors = 0;
+        long long bytes = 0;
+        std::vector< uint32_t > latency;
+        for( int i = 0; i < threads; ++i ){
+            pthread_join( workers[i].thread, NULL );
+            requests += workers[i].requests;
+            errors += workers[i].errors;
+            bytes += workers[i].bytes;
+            latency.insert( latency.end(), workers[i].latency.begin(), workers[i].latency.end() );
+        }
+        kill( pid, SIGTERM );
+        waitpid( pid, NULL, 0 );
+
+        printf( "%-20s %10.0f %10.1f %8.2f %8.2f %8.2f %8.2f %7ld\n", modes[m][0] ? modes[m] : "(threadpool)", requests / elapsed,
+                bytes / elapsed / 1048576, percentile( latency, 0.5 ), percentile( latency, 0.99 ),
+                percentile( latency, 0.999 ), percentile( latency, 1.0 ), errors );
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * 二进制日志的离线解码器
+ * web服务器以-B运行时，日志以格式编号加二进制参数的形式写出（见web/log.h），本程序将其还原为文本
+ *
+ * 编译：g++ -O2 -pthread log-decoder.cpp -o log-decoder
+ * 运行：./log-decoder log_file
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include "web/log.h"
+
+struct definition{
+    logger::format_def def;
+    std::string file;
+    std::string format;
+};
+
+int main( int argc, char* argv[] ){
+    if( argc < 2 ){
+        printf( "usage: %s log_file\n", basename( argv[0] ) );
+        return 1;
+    }
+    FILE* fp = fopen( argv[1], "rb" );
+    if( ! fp ){
+        printf( "cannot open %s\n", argv[1] );
+        return 1;
+    }
+
+    // 服务器每次以-B启动都会在文件中写一次文件头，之后重新开始编号
+    const char* magic = logger::binary_magic();
+    size_t magic_len = strlen( magic );
+    std::map< uint32_t, definition > defs;
+    char record[ 64 * 1024 ];
+    char line[ 4096 ];
+    while( true ){
+        logger::record_header* h = ( logger::record_header* )record;
+        size_t n = fread( record, 1, sizeof( *h ), fp );
+        if( n == 0 ){
+            break;
+        }
+        if( n < sizeof( *h ) ){
+            printf( "truncated record\n" );
+            break;
+        }
+        if( memcmp( record, magic, magic_len ) == 0 ){
+            defs.clear();
+            // 文件头与记录头一样长
+            continue;
+        }
+        if( ( h->size < sizeof( *h ) ) || ( h->size > sizeof( record ) ) ){
+            printf( "corrupted record\n" );
+            break;
+        }
+        if( fread( record + sizeof( *h ), 1, h->size - sizeof( *h ), fp ) != h->size - sizeof( *h ) ){
+            printf( "truncated record\n" );
+            break;
+        }
+
+        if( h->id == logger::DEFINITION_ID ){
+            int32_t fields[3];
+            memcpy( fields, record + sizeof( *h ), sizeof( fields ) );
+            definition& d = defs[ fields[0] ];
+            d.file = record + sizeof( *h ) + sizeof( fields );
+            d.format = record + sizeof( *h ) + sizeof( fields ) + d.file.size() + 1;
+            d.def.level = fields[1];
+            d.def.line = fields[2];
+            d.def.file = d.file.c_str();
+            d.def.format = d.format.c_str();
+            continue;
+        }
+        std::map< uint32_t, definition >::iterator it = defs.find( h->id );
+        if( it == defs.end() ){
+            printf( "unknown format id %u\n", h->id );
+            continue;
+        }
+        size_t len = logger::format_line( line, sizeof( line ), it->second.def, h );
+        fwrite( line, 1, len, stdout );
+    }
+    fclose( fp );
+    return 0;
+}
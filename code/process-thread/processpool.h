@@ -1,5 +1,8 @@
 /**
  * @brief 半同步/半异步并发模式的进程池。为了避免父子进程之间传递文件描述符，将新连接放到子进程中。因此，一个客户连接上的所有任务始终由一个子进程处理
+ * 默认由父进程监听并通知子进程accept；直接接受模式下子进程自己监听并成批accept，父进程只负责管理子进程，不在连接的路径上；
+ * 均衡模式下由父进程accept，根据子进程在共享内存负载表上发布的负载选择一个，用SCM_RIGHTS把连接传给它。
+ * 父进程重新创建异常退出的子进程；收到SIGUSR2时exec新的程序并把监听socket传给它，新的子进程就绪后旧的子进程处理完已有的连接再退出
 */
 #ifndef PROCESSPOOL_H
 #define PROCESSPOOL_H
@@ -16,17 +19,49 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <poll.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <atomic>
+#include <new>
+#include "../web/log.h"
 
-// m_pid是目标子进程的PID，m_pipefd是父子进程通信用的管道
+// 新连接的接受方式
+enum ACCEPT_MODE{
+    ACCEPT_DISPATCH,        //父进程监听，通过管道通知一个子进程accept
+    ACCEPT_REUSEPORT,       //每个子进程有自己的SO_REUSEPORT监听socket，由内核按四元组哈希分配新连接
+    ACCEPT_EXCLUSIVE,       //子进程以EPOLLEXCLUSIVE监听共享的socket，新连接只唤醒其中一个
+    ACCEPT_BALANCE          //父进程accept，把连接交给负载最轻的子进程
+};
+
+/**
+ * @brief 负载表中一个子进程的负载，位于父子进程共享的匿名内存中，读写都是原子操作，父进程选择子进程时不需要系统调用。
+ * 每个子进程独占一个缓存行，避免子进程之间互相使对方的缓存失效
+*/
+struct alignas(64) process_load{
+    std::atomic<int> connections;       //活跃连接数：父进程交出连接时加1，子进程关闭连接时减1
+    std::atomic<int> pending;           //子进程本轮epoll_wait返回、尚未处理的事件数
+    std::atomic<int> latency;           //子进程处理一个事件耗时的指数加权移动平均（微秒）
+};
+
+// 热升级时旧的主进程通过这两个环境变量把监听socket和自己的PID传给新的程序
+#define LISTEN_FD_ENV "PROCESSPOOL_LISTEN_FD"
+#define UPGRADE_FROM_ENV "PROCESSPOOL_UPGRADE_FROM"
+
+// m_pid是目标子进程的PID，m_pipefd是父子进程通信用的管道，m_listenfd是ACCEPT_REUSEPORT模式下子进程自己的监听socket，
+// m_start是子进程创建的时间（毫秒），m_respawn表示子进程异常退出、等待重新创建
 class process{
 public:
-    process(): m_pid(-1){}
+    process(): m_pid(-1), m_listenfd(-1), m_start(0), m_respawn(false){}
 
     pid_t m_pid;
     int m_pipefd[2];
+    int m_listenfd;
+    int64_t m_start;
+    bool m_respawn;
 };
 
 /**
@@ -36,19 +71,27 @@ template <typename T>
 class processpool{
 private:
     // 将构造函数定义为私有，因此只能通过后面的create静态函数来创建processpool实例
-    processpool(int listenfd, int process_number = 8);
+    processpool(int listenfd, int process_number = 8, ACCEPT_MODE mode = ACCEPT_DISPATCH);
 
 public:
-    //单体模式，保证程序最多创建一个processpool实例，这是程序正确处理信号的必要条件
-    static processpool<T>* create (int listenfd, int process_number = 8){
+    static const int MAX_PROCESS_NUMBER = 16;       //进程池允许的最大子进程数目
+
+    /**
+     * 单体模式，保证程序最多创建一个processpool实例，这是程序正确处理信号的必要条件
+     * mode为ACCEPT_REUSEPORT时listenfd须在bind之前设置SO_REUSEPORT，否则退回ACCEPT_EXCLUSIVE
+    */
+    static processpool<T>* create (int listenfd, int process_number = 8, ACCEPT_MODE mode = ACCEPT_DISPATCH){
         if(!m_instance){
-            m_instance = new processpool<T>(listenfd, process_number);
+            m_instance = new processpool<T>(listenfd, process_number, mode);
         }
         return m_instance;
     }
 
     ~processpool(){
         delete [] m_sub_process;
+        if(m_load){
+            munmap(m_load, sizeof(process_load) * m_process_number);
+        }
     }
 
     //启动进程池
@@ -58,18 +101,53 @@ private:
     void setup_sig_pipe();
     void run_parent();
     void run_child();
+    // 创建第i个子进程，返回值同fork：子进程中返回0，失败返回-1
+    pid_t spawn(int i);
+    // 重新创建到期的异常退出的子进程，在新的子进程中返回true
+    bool respawn();
+    // 距离最早一个待重新创建的子进程到期的毫秒数，没有时返回-1
+    int respawn_timeout();
+    // 父进程平滑退出：停止接受新连接，通知子进程处理完已有的连接后退出
+    void drain();
+    // 所有子进程都已退出且不再重新创建
+    bool all_exited();
+    // 热升级：以原来的命令行exec新的程序，监听socket由它继承
+    void upgrade();
+    // 热升级启动的新程序等待子进程在管道上报告就绪，最多等待READY_TIMEOUT毫秒，返回就绪的子进程数
+    int wait_ready();
+    // 为每个子进程创建绑定在listenfd同一地址上的SO_REUSEPORT监听socket，失败返回false
+    bool create_listeners();
+    // 接受监听socket上等待的连接，直至取完或达到ACCEPT_BATCH，返回值小于ACCEPT_BATCH时已经取完
+    int accept_batch(T* users);
+    // 均衡模式：父进程接受等待的连接并交给子进程
+    void dispatch_batch();
+    // 均衡模式：选择负载最轻的子进程，没有存活的子进程时返回-1
+    int least_loaded();
+    // 均衡模式：子进程从管道中取出父进程交来的连接
+    void receive_conns(int pipefd, T* users);
 
 
 private:
-    static const int MAX_PROCESS_NUMBER = 16;       //进程池允许的最大子进程数目
     static const int USER_PER_PROCESS = 65536;      //每个子进程最多能处理的客户数量
     static const int MAX_EVENT_NUMBER = 10000;      //epoll最多能处理的事件数
+    static const int ACCEPT_BATCH = 64;             //子进程一次唤醒最多accept的连接数
+    static const int RESPAWN_INTERVAL = 1000;       //同一位置的子进程至少间隔这么多毫秒才重新创建，避免启动即崩溃时不停地fork
+    static const int DRAIN_TIMEOUT = 30000;         //平滑退出时最多等待已有的连接这么多毫秒
+    static const int READY_TIMEOUT = 10000;         //热升级时最多等待新的子进程就绪这么多毫秒
     int m_process_number;                           //进程池中的进程总数
     int m_idx;                                      //进程在池中的序号，0开始
     int m_epollfd;                                  //epoll内核事件表
-    int m_listenfd;                                 //监听socket
+    int m_listenfd;                                 //监听socket，ACCEPT_REUSEPORT模式的子进程中是它自己的监听socket
+    ACCEPT_MODE m_mode;                             //新连接的接受方式
     int m_stop;                                     //进程通过m_stop决定是否停止运行
     process* m_sub_process;                         //保存所有子进程的描述信息
+    process_load* m_load;                           //均衡模式下的负载表，每个子进程一项，其他模式下为NULL
+    int m_next;                                     //均衡模式下从这个子进程开始比较负载，使负载相同的子进程轮流得到连接
+    bool m_terminating;                             //父进程已收到终止信号，不再重新创建子进程
+    bool m_draining;                                //正在平滑退出，不再接受新连接
+    int64_t m_drain_deadline;                       //子进程平滑退出的最后期限
+    pid_t m_upgrade_from;                           //热升级时exec本程序的旧主进程，子进程就绪后通知它平滑退出
+    pid_t m_upgrade_pid;                            //正在启动的新程序
     static processpool<T>* m_instance;              //进程池静态实例
     
 };
@@ -79,7 +157,11 @@ template <typename T>
 processpool<T>* processpool<T>::m_instance = NULL;
 
 // 用于处理信号的管道，以实现统一事件源，后面称之为信号管道
-static int sig_pipefd[2];
+static int sig_pipefd[2] = {-1, -1};
+// 均衡模式下子进程自己在负载表中的一项，其他情况下为NULL
+static process_load* local_load = NULL;
+// 子进程中的活跃连接数，平滑退出时降到0即可退出
+static int local_connections = 0;
 
 static int setnonblocking(int fd){
     int old_option = fcntl(fd, F_GETFL);
@@ -88,22 +170,112 @@ static int setnonblocking(int fd){
     return old_option;
 }
 
-static void addfd(int epollfd, int fd){
+static void addfd(int epollfd, int fd, bool nonblocking = false){
     epoll_event event;
     event.data.fd = fd;
     event.events = EPOLLIN | EPOLLET;
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    setnonblocking(fd);
+    // accept4已设置了SOCK_NONBLOCK的socket不用再设置
+    if(!nonblocking){
+        setnonblocking(fd);
+    }
+}
+
+// 子进程中的一个连接已关闭，更新活跃连接数和负载表。T自己关闭连接（不经过removefd）时须调用它
+static void conn_closed(){
+    --local_connections;
+    if(local_load){
+        local_load->connections.fetch_sub(1, std::memory_order_relaxed);
+    }
 }
 
 /**
- * @brief 删除注册事件
+ * @brief 删除注册事件。均衡模式下T须用它关闭连接，负载表才能统计子进程的活跃连接数
  * @param epollfd 内核时间表
  * @param fd 待删除的文件描述符
 */
-static void removefd(int epollfd, int fd){
+[[maybe_unused]] static void removefd(int epollfd, int fd){
     epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
     close(fd);
+    conn_closed();
+}
+
+static int64_t now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief 热升级启动的新程序取得旧主进程传下来的监听socket，应在创建进程池之前调用
+ * @return 不是由热升级启动或者描述符不是监听socket时返回-1，调用者应自己创建监听socket
+*/
+[[maybe_unused]] static int inherited_listenfd(){
+    const char* value = getenv(LISTEN_FD_ENV);
+    if(!value){
+        return -1;
+    }
+    int fd = atoi(value);
+    unsetenv(LISTEN_FD_ENV);
+    int listening = 0;
+    socklen_t len = sizeof(listening);
+    if(fd < 0 || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening){
+        LOG_WARN("ignoring inherited listen socket %d", fd);
+        return -1;
+    }
+    LOG_INFO("inherited listen socket %d", fd);
+    return fd;
+}
+
+// 以/proc/self/cmdline中原来的命令行exec，同一路径上的程序文件已被替换时执行的是新程序。只在失败时返回
+static void exec_self(){
+    static char cmdline[4096];
+    int fd = open("/proc/self/cmdline", O_RDONLY);
+    if(fd < 0){
+        return;
+    }
+    ssize_t len = read(fd, cmdline, sizeof(cmdline) - 1);
+    close(fd);
+    if(len <= 0){
+        return;
+    }
+    cmdline[len] = '\0';
+    char* argv[64];
+    int argc = 0;
+    for(char* p = cmdline; p < cmdline + len && argc < 63; p += strlen(p) + 1){
+        argv[argc++] = p;
+    }
+    argv[argc] = NULL;
+    execvp(argv[0], argv);
+}
+
+/**
+ * 以下函数模板是子进程事件循环留给T的扩展点，默认只要求T实现init(epollfd, sockfd, addr)和process()。
+ * T所在的翻译单元可以为具体的类型声明参数相同的非模板重载，在实例化processpool<T>之前声明即可替换默认的行为
+*/
+// 子进程开始事件循环之前调用，可以在epollfd上注册T自己需要监听的描述符，它们的事件同样交给process_event
+template <typename T>
+void child_init(T*, int){}
+
+// 每次epoll_wait之前调用，处理T自己的定时事件，返回最多等待的毫秒数，-1表示无限期等待
+template <typename T>
+int child_tick(T*){
+    return -1;
+}
+
+// 初始化新连接，connfd已经以边沿触发的EPOLLIN注册到epollfd
+template <typename T>
+void init_conn(T* users, int epollfd, int connfd, const sockaddr_in& client_address){
+    // 模板类T必须实现init方法，以初始化一个客户连接，我们直接使用connfd来索引逻辑处理对象
+    users[connfd].init(epollfd, connfd, client_address);
+}
+
+// 连接或child_init注册的描述符上的事件
+template <typename T>
+void process_event(T* users, int sockfd, uint32_t events){
+    if(events & EPOLLIN){
+        users[sockfd].process();
+    }
 }
 
 static void sig_handler(int sig){
@@ -125,33 +297,150 @@ static void addsig(int sig, void (handler)(int), bool restart = true){
 }
 
 template<typename T>
-processpool<T>::processpool(int listenfd, int process_number):m_listenfd(listenfd), m_process_number(process_number), m_idx(-1), m_stop(false){
+processpool<T>::processpool(int listenfd, int process_number, ACCEPT_MODE mode):m_process_number(process_number), m_idx(-1), m_epollfd(-1),
+        m_listenfd(listenfd), m_mode(mode), m_stop(false), m_terminating(false), m_draining(false), m_drain_deadline(0), m_upgrade_from(-1), m_upgrade_pid(-1){
     assert(process_number >0 && process_number <= MAX_PROCESS_NUMBER);
 
+    const char* from = getenv(UPGRADE_FROM_ENV);
+    if(from){
+        m_upgrade_from = atoi(from);
+        unsetenv(UPGRADE_FROM_ENV);
+    }
+
     m_sub_process = new process[process_number];
     assert(m_sub_process);
 
+    // 负载表在fork之前映射，父子进程看到的是同一块内存
+    m_load = NULL;
+    m_next = 0;
+    if(m_mode == ACCEPT_BALANCE){
+        void* board = mmap(NULL, sizeof(process_load) * process_number, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        assert(board != MAP_FAILED);
+        m_load = (process_load*)board;
+        for(int i = 0; i < process_number; i++){
+            new (m_load + i) process_load;
+            m_load[i].connections.store(0, std::memory_order_relaxed);
+            m_load[i].pending.store(0, std::memory_order_relaxed);
+            m_load[i].latency.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // 监听socket在fork之前创建，每个子进程继承自己的那个
+    if(m_mode == ACCEPT_REUSEPORT && !create_listeners()){
+        LOG_WARN("cannot create SO_REUSEPORT listeners, falling back to EPOLLEXCLUSIVE");
+        m_mode = ACCEPT_EXCLUSIVE;
+    }
+
     // 创建process_number个子进程，并建立他们和父进程之间的管道
     for(int i = 0; i < process_number; i++){
-        int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, m_sub_process[i].m_pipefd);
-        assert(ret == 0);
-        m_sub_process[i].m_pid = fork();
+        pid_t pid = spawn(i);
         // 这里尤其注意，不然很可能子进程也会执行fork
-        // 主进程
-        if(m_sub_process[i].m_pid > 0){
-            close(m_sub_process[i].m_pipefd[1]);
-            continue;
-        }
-        // 子进程
-        else{
-            close(m_sub_process[i].m_pipefd[0]);
-            m_idx = i;
+        if(pid == 0){
             // 注意这是break
             break;
         }
+        // 创建失败的稍后再试
+        if(pid < 0){
+            m_sub_process[i].m_respawn = true;
+        }
     }
 }
 
+template<typename T>
+pid_t processpool<T>::spawn(int i){
+    process& sub = m_sub_process[i];
+    if(socketpair(PF_UNIX, SOCK_STREAM, 0, sub.m_pipefd) < 0){
+        LOG_ERROR("socketpair failure: %s", strerror(errno));
+        return -1;
+    }
+    if(m_load){
+        m_load[i].connections.store(0, std::memory_order_relaxed);
+        m_load[i].pending.store(0, std::memory_order_relaxed);
+        m_load[i].latency.store(0, std::memory_order_relaxed);
+    }
+    sub.m_start = now_us() / 1000;
+    pid_t pid = fork();
+    if(pid < 0){
+        LOG_ERROR("fork failure: %s", strerror(errno));
+        close(sub.m_pipefd[0]);
+        close(sub.m_pipefd[1]);
+        return -1;
+    }
+    // 主进程
+    if(pid > 0){
+        sub.m_pid = pid;
+        close(sub.m_pipefd[1]);
+        // 均衡模式下父进程不能因为一个子进程的管道满了而阻塞
+        if(m_mode == ACCEPT_BALANCE){
+            setnonblocking(sub.m_pipefd[0]);
+        }
+        return pid;
+    }
+
+    // 子进程：关闭父进程与其他子进程通信的管道，以及（重新创建时）父进程的epoll和信号管道
+    close(sub.m_pipefd[0]);
+    for(int j = 0; j < m_process_number; j++){
+        if(j != i && m_sub_process[j].m_pid != -1){
+            close(m_sub_process[j].m_pipefd[0]);
+        }
+    }
+    if(m_epollfd != -1){
+        close(m_epollfd);
+        close(sig_pipefd[0]);
+        close(sig_pipefd[1]);
+        m_epollfd = -1;
+    }
+    m_idx = i;
+    // 只保留自己的监听socket。父进程保留所有监听socket但不监听它们，子进程退出后排队的连接留给重新创建的子进程
+    if(m_mode == ACCEPT_REUSEPORT){
+        for(int j = 0; j < m_process_number; j++){
+            if(j != i && m_sub_process[j].m_listenfd != sub.m_listenfd){
+                close(m_sub_process[j].m_listenfd);
+            }
+        }
+        m_listenfd = sub.m_listenfd;
+    }
+    if(m_mode == ACCEPT_BALANCE){
+        local_load = m_load + i;
+    }
+    return 0;
+}
+
+template<typename T>
+bool processpool<T>::create_listeners(){
+    int reuse = 0;
+    socklen_t len = sizeof(reuse);
+    if(getsockopt(m_listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, &len) < 0 || !reuse){
+        return false;
+    }
+    struct sockaddr_storage address;
+    socklen_t addrlength = sizeof(address);
+    if(getsockname(m_listenfd, (struct sockaddr*)&address, &addrlength) < 0){
+        return false;
+    }
+
+    // 第0个子进程使用listenfd本身
+    m_sub_process[0].m_listenfd = m_listenfd;
+    for(int i = 1; i < m_process_number; i++){
+        int fd = socket(address.ss_family, SOCK_STREAM, 0);
+        if(fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0
+                || bind(fd, (struct sockaddr*)&address, addrlength) < 0 || listen(fd, SOMAXCONN) < 0){
+            LOG_WARN("cannot create listener %d: %s", i, strerror(errno));
+            if(fd >= 0){
+                close(fd);
+            }
+            for(int j = 1; j < i; j++){
+                close(m_sub_process[j].m_listenfd);
+                m_sub_process[j].m_listenfd = -1;
+            }
+            m_sub_process[0].m_listenfd = -1;
+            return false;
+        }
+        m_sub_process[i].m_listenfd = fd;
+    }
+    return true;
+}
+
 
 // 统一事件源
 template< typename T>
@@ -169,17 +458,21 @@ void processpool<T>::setup_sig_pipe(){
     addsig(SIGCHLD, sig_handler);
     addsig(SIGTERM, sig_handler);
     addsig(SIGINT, sig_handler);
+    addsig(SIGQUIT, sig_handler);
+    addsig(SIGUSR2, sig_handler);
     addsig(SIGPIPE, SIG_IGN);
 }
 
 // 父进程中m_idx值为-1， 子进程中m_idx值大于等于0
 template <typename T>
 void processpool<T>::run(){
+    if(m_idx == -1){
+        run_parent();
+    }
+    // 父进程重新创建的子进程从run_parent返回
     if(m_idx != -1){
         run_child();
-        return;
     }
-    run_parent();
 }
 
 template <typename T>
@@ -192,22 +485,67 @@ void processpool<T>::run_child(){
     // 子进程需要监听文件描述符pipefd，父进程将通过它来通知子进程accept新连接
     addfd(m_epollfd, pipefd);
 
+    // 直接接受模式下子进程自己监听。监听socket是水平触发的，一次没有accept完的连接会使下一次epoll_wait立即返回
+    if(m_mode == ACCEPT_REUSEPORT || m_mode == ACCEPT_EXCLUSIVE){
+        uint32_t flags = EPOLLIN;
+        if(m_mode == ACCEPT_EXCLUSIVE){
+            flags |= EPOLLEXCLUSIVE;
+        }
+        epoll_event event;
+        event.data.fd = m_listenfd;
+        event.events = flags;
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_listenfd, &event);
+        setnonblocking(m_listenfd);
+    }
+    else if(m_mode == ACCEPT_DISPATCH){
+        setnonblocking(m_listenfd);
+    }
+
     epoll_event events[MAX_EVENT_NUMBER];
     T* users = new T[USER_PER_PROCESS];
     assert(users);
     int number = 0;
     int ret = -1;
+    child_init(users, m_epollfd);
+
+    // 热升级启动的子进程在管道上写一个字节，告诉父进程已经可以接受连接
+    if(m_upgrade_from > 1){
+        char ready = 1;
+        send(pipefd, &ready, 1, MSG_NOSIGNAL);
+    }
 
     while(!m_stop){
-        number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, -1);
+        int timeout = child_tick(users);
+        if(m_draining){
+            int64_t left = m_drain_deadline - now_us() / 1000;
+            if(left < 0){
+                left = 0;
+            }
+            if(timeout < 0 || left < timeout){
+                timeout = (int)left;
+            }
+        }
+        number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, timeout);
         if(number < 0 && errno != EINTR){
-            printf("epoll failure\n");
+            LOG_ERROR("epoll failure: %s", strerror(errno));
             break;
         }
+        if(local_load){
+            local_load->pending.store(number > 0 ? number : 0, std::memory_order_relaxed);
+        }
 
         for(int i = 0; i < number; i++){
+            if(local_load){
+                local_load->pending.fetch_sub(1, std::memory_order_relaxed);
+            }
             int sockfd = events[i].data.fd;
-            if(sockfd == pipefd && events[i].events & EPOLLIN){
+            if(sockfd == m_listenfd && (m_mode == ACCEPT_REUSEPORT || m_mode == ACCEPT_EXCLUSIVE)){
+                accept_batch(users);
+            }
+            else if(sockfd == pipefd && m_mode == ACCEPT_BALANCE){
+                receive_conns(pipefd, users);
+            }
+            else if(sockfd == pipefd && events[i].events & EPOLLIN){
                 int client = 0;
                 // 从父子进程之间的管道中读取数据，并将结果保存在client中
                 ret = recv(sockfd, (char*)&client, sizeof(client), 0);
@@ -215,22 +553,12 @@ void processpool<T>::run_child(){
                     continue;
                 }
                 else{
-                    struct sockaddr_in client_address;
-                    socklen_t client_addrlength = sizeof(client_address);
-                    int connfd = accept(m_listenfd, (struct sockaddr*)&client_address, &client_addrlength);
-                    if(connfd < 0){
-                        printf("errno is:%d\n", errno);
-                        continue;
-                    }
-                    addfd(m_epollfd, connfd);
-                    
-                    // 模板类T必须实现init方法，以初始化一个客户连接，我们直接使用connfd来索引逻辑处理对象
-                    users[connfd].init(m_epollfd, connfd, client_address);
+                    // 父进程的监听socket是边沿触发的，一次通知可能对应多个待接受的连接，只accept一个的话其余的要等到下一个连接到来
+                    accept_batch(users);
                 }
             }
             // 处理子进程接受到的信号
             else if(sockfd == sig_pipefd[0] && (events[i].events & EPOLLIN)){
-                int sig;
                 char signals[1024];
                 ret = recv(sig_pipefd[0], signals, sizeof(signals), 0);
                 if(ret <= 0){
@@ -252,6 +580,18 @@ void processpool<T>::run_child(){
                                 m_stop = true;
                                 break;
                             }
+                            case SIGQUIT:{
+                                // 平滑退出：不再接受新连接，已有的连接都关闭或者超过DRAIN_TIMEOUT后退出
+                                if(!m_draining){
+                                    m_draining = true;
+                                    m_drain_deadline = now_us() / 1000 + DRAIN_TIMEOUT;
+                                    if(m_mode == ACCEPT_REUSEPORT || m_mode == ACCEPT_EXCLUSIVE){
+                                        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, 0);
+                                    }
+                                    LOG_INFO("child %d draining %d connections", m_idx, local_connections);
+                                }
+                                break;
+                            }
                             default:{
                                 break;
                             }
@@ -259,12 +599,30 @@ void processpool<T>::run_child(){
                     }
                 }
             }
-            else if(events[i].events & EPOLLIN){
-                users[sockfd].process();
+            else if(local_load){
+                // 处理耗时的移动平均，新样本的权重为1/8
+                int64_t start = now_us();
+                process_event(users, sockfd, events[i].events);
+                int sample = (int)(now_us() - start);
+                int latency = local_load->latency.load(std::memory_order_relaxed);
+                local_load->latency.store(latency + (sample - latency) / 8, std::memory_order_relaxed);
             }
             else{
-                continue;
+                process_event(users, sockfd, events[i].events);
+            }
+        }
+        // 平滑退出时在处理完本轮事件后关闭监听socket。REUSEPORT模式下这是它的最后一个引用（父进程已先关闭自己的那一份），
+        // 关闭后它才离开重用组，内核不再把新连接分给它；关闭前取完队列中已经完成握手的连接，否则这些连接会被重置
+        if(m_draining && m_listenfd != -1 && (m_mode == ACCEPT_REUSEPORT || m_mode == ACCEPT_EXCLUSIVE)){
+            if(m_mode == ACCEPT_REUSEPORT){
+                while(accept_batch(users) == ACCEPT_BATCH){
+                }
             }
+            close(m_listenfd);
+            m_listenfd = -1;
+        }
+        if(m_draining && (local_connections <= 0 || now_us() / 1000 >= m_drain_deadline)){
+            m_stop = true;
         }
     }
     delete []users;
@@ -273,13 +631,115 @@ void processpool<T>::run_child(){
     close(m_epollfd);
 }
 
+template <typename T>
+int processpool<T>::accept_batch(T* users){
+    int n = 0;
+    for(; n < ACCEPT_BATCH; n++){
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+        int connfd = accept4(m_listenfd, (struct sockaddr*)&client_address, &client_addrlength, SOCK_NONBLOCK);
+        if(connfd < 0){
+            // 连接在accept之前被客户重置时继续接受下一个
+            if(errno == ECONNABORTED || errno == EINTR){
+                continue;
+            }
+            // EAGAIN：已经取完，共享监听socket的模式下也可能被别的子进程先取走了
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                LOG_WARN("accept failed, errno is:%d", errno);
+            }
+            break;
+        }
+        if(connfd >= USER_PER_PROCESS){
+            LOG_WARN("too many connections in child %d", m_idx);
+            close(connfd);
+            continue;
+        }
+        addfd(m_epollfd, connfd, true);
+        ++local_connections;
+        init_conn(users, m_epollfd, connfd, client_address);
+    }
+    return n;
+}
+
+// 每个连接是一条消息：数据是客户的地址，连接的描述符在SCM_RIGHTS控制消息中。
+// UNIX流socket的一次recvmsg取到带描述符的数据后即返回，不会跨过消息的边界
+template <typename T>
+void processpool<T>::receive_conns(int pipefd, T* users){
+    while(true){
+        struct sockaddr_in client_address;
+        struct iovec iov;
+        iov.iov_base = &client_address;
+        iov.iov_len = sizeof(client_address);
+        union{
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        int ret = recvmsg(pipefd, &msg, MSG_CMSG_CLOEXEC);
+        if(ret <= 0){
+            if(ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+                LOG_WARN("child %d lost the pipe to the parent", m_idx);
+            }
+            if(ret < 0 && errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS){
+            continue;
+        }
+        int connfd;
+        memcpy(&connfd, CMSG_DATA(cmsg), sizeof(connfd));
+        if(connfd >= USER_PER_PROCESS || ret != sizeof(client_address)){
+            LOG_WARN("child %d drops connection %d", m_idx, connfd);
+            close(connfd);
+            local_load->connections.fetch_sub(1, std::memory_order_relaxed);
+            continue;
+        }
+        addfd(m_epollfd, connfd);
+        ++local_connections;
+        init_conn(users, m_epollfd, connfd, client_address);
+    }
+}
+
 
 template <typename T>
 void processpool<T>::run_parent(){
     setup_sig_pipe();
 
-    // 父进程监听
-    addfd(m_epollfd, m_listenfd);
+    // 由旧的主进程exec启动时，等子进程报告就绪后再通知旧的主进程平滑退出；没有子进程就绪时旧的主进程继续服务。
+    // 之后重新创建的子进程不再报告
+    if(m_upgrade_from > 1){
+        int ready = wait_ready();
+        if(ready > 0){
+            LOG_INFO("upgraded from process %d, %d children ready, draining it", m_upgrade_from, ready);
+            kill(m_upgrade_from, SIGQUIT);
+        }
+        else{
+            LOG_ERROR("no child is ready, process %d keeps serving", m_upgrade_from);
+        }
+        m_upgrade_from = -1;
+    }
+
+    // 父进程监听。直接接受模式下父进程不监听，只处理信号和管理子进程
+    if(m_mode == ACCEPT_DISPATCH){
+        addfd(m_epollfd, m_listenfd);
+    }
+    // 均衡模式下监听socket是水平触发的，一次没有接受完的连接会使下一次epoll_wait立即返回
+    else if(m_mode == ACCEPT_BALANCE){
+        epoll_event event;
+        event.data.fd = m_listenfd;
+        event.events = EPOLLIN;
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_listenfd, &event);
+        setnonblocking(m_listenfd);
+    }
 
     epoll_event events[MAX_EVENT_NUMBER];
     int sub_process_counter = 0;
@@ -289,15 +749,18 @@ void processpool<T>::run_parent(){
 
     while (!m_stop)
     {
-        number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, -1);
+        number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, respawn_timeout());
         if(number < 0 && errno != EINTR){
-            printf("epoll failure\n");
+            LOG_ERROR("epoll failure: %s", strerror(errno));
             break;
         }
         
         for(int i = 0; i < number; i++){
             int sockfd = events[i].data.fd;
-            if(sockfd == m_listenfd){
+            if(sockfd == m_listenfd && m_mode == ACCEPT_BALANCE){
+                dispatch_batch();
+            }
+            else if(sockfd == m_listenfd){
                 // 如果有新连接，就采用Round Robin方式将其分配给一个子进程处理
                 int i = sub_process_counter;
                 do{
@@ -308,17 +771,16 @@ void processpool<T>::run_parent(){
                 }
                 while(i != sub_process_counter);
 
+                // 子进程都在等待重新创建时，连接留在监听队列中
                 if(m_sub_process[i].m_pid == -1){
-                    m_stop = true;
-                    break;
+                    continue;
                 }
                 sub_process_counter = (i+1)%m_process_number;
                 send(m_sub_process[i].m_pipefd[0], (char*)&new_conn, sizeof(new_conn), 0);
-                printf("send request to child %d\n", i);
+                LOG_DEBUG("send request to child %d", i);
             }
             // 父进程接受到的信号
             else if(sockfd == sig_pipefd[0] && (events[i].events & EPOLLIN)){
-                int sig;
                 char signals[1024];
                 ret = recv(sig_pipefd[0], signals, sizeof(signals), 0);
                 if(ret <= 0){
@@ -331,29 +793,47 @@ void processpool<T>::run_parent(){
                                 pid_t pid;
                                 int stat;
                                 while((pid = waitpid(-1, &stat, WNOHANG)) > 0){
+                                    if(pid == m_upgrade_pid){
+                                        LOG_ERROR("new binary exited with status %d, upgrade failed", stat);
+                                        m_upgrade_pid = -1;
+                                        continue;
+                                    }
                                     for(int i = 0; i < m_process_number; i++){
                                         // 如果进程池中第i个子进程退出了，则主进程关闭响应的通信信道
                                         if(m_sub_process[i].m_pid == pid){
-                                            printf("child %d join\n", i);
                                             close(m_sub_process[i].m_pipefd[0]);
                                             m_sub_process[i].m_pid = -1;
+                                            // 被信号杀死或以非0状态退出的子进程重新创建，正常退出的不再创建
+                                            bool crashed = !WIFEXITED(stat) || WEXITSTATUS(stat) != 0;
+                                            if(crashed && !m_terminating && !m_draining){
+                                                LOG_WARN("child %d exited abnormally (status %d), respawning", i, stat);
+                                                m_sub_process[i].m_respawn = true;
+                                            }
+                                            else{
+                                                LOG_INFO("child %d join", i);
+                                            }
                                         }
                                     }
                                 }
                                 // 如果所有子进程都已退出，则父进程退出
-                                m_stop = true;
-                                for(int i = 0; i < m_process_number; i++){
-                                    if(m_sub_process[i].m_pid != -1){
-                                        m_stop = false;
-                                    }
-                                }
+                                m_stop = all_exited();
+                                break;
+                            }
+                            case SIGQUIT:{
+                                drain();
+                                break;
+                            }
+                            case SIGUSR2:{
+                                upgrade();
                                 break;
                             }
                             case SIGTERM:
                             case SIGINT:{
                                 // 父进程收到终止信号，那么杀死所有子进程，并等待他们全部结束
-                                printf("kill all the child now\n");
+                                LOG_INFO("kill all the child now");
+                                m_terminating = true;
                                 for(int i = 0; i < m_process_number; i++){
+                                    m_sub_process[i].m_respawn = false;
                                     int pid = m_sub_process[i].m_pid;
                                     if(pid != -1){
                                         kill(pid, SIGTERM);
@@ -372,13 +852,260 @@ void processpool<T>::run_parent(){
                 continue;
             }
         }
+        // 在新的子进程中返回，由run转去运行run_child
+        if(respawn()){
+            return;
+        }
     }
     close(m_epollfd);
 
 }
 
+template <typename T>
+bool processpool<T>::respawn(){
+    int64_t now = now_us() / 1000;
+    for(int i = 0; i < m_process_number; i++){
+        process& sub = m_sub_process[i];
+        if(!sub.m_respawn || now < sub.m_start + RESPAWN_INTERVAL){
+            continue;
+        }
+        // 新的子进程从父进程复制已完成的初始化和仍打开的监听socket，不需要重新加载
+        pid_t pid = spawn(i);
+        if(pid == 0){
+            return true;
+        }
+        sub.m_respawn = pid < 0;
+        if(pid > 0){
+            LOG_INFO("child %d respawned as process %d", i, pid);
+        }
+    }
+    return false;
+}
 
+template <typename T>
+int processpool<T>::respawn_timeout(){
+    int64_t now = now_us() / 1000;
+    int timeout = -1;
+    for(int i = 0; i < m_process_number; i++){
+        if(!m_sub_process[i].m_respawn){
+            continue;
+        }
+        int64_t left = m_sub_process[i].m_start + RESPAWN_INTERVAL - now;
+        int wait = left > 0 ? (int)left : 0;
+        if(timeout == -1 || wait < timeout){
+            timeout = wait;
+        }
+    }
+    return timeout;
+}
 
+template <typename T>
+bool processpool<T>::all_exited(){
+    for(int i = 0; i < m_process_number; i++){
+        if(m_sub_process[i].m_pid != -1 || m_sub_process[i].m_respawn){
+            return false;
+        }
+    }
+    return true;
+}
 
+// 热升级时新的主进程在其子进程就绪后发来SIGQUIT。旧的子进程不再接受新连接，新连接都由新的子进程接受
+template <typename T>
+void processpool<T>::drain(){
+    if(m_draining){
+        return;
+    }
+    LOG_INFO("drain all the child now");
+    m_draining = true;
+    if(m_mode == ACCEPT_DISPATCH || m_mode == ACCEPT_BALANCE){
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, 0);
+    }
+    // 先关闭父进程持有的所有监听socket，再通知子进程。REUSEPORT模式下子进程的监听socket只有所有引用都关闭后才离开重用组，
+    // 父进程留着的话，内核仍会把新连接分给这个没有人accept的socket，父进程退出时这些连接被重置
+    for(int i = 0; i < m_process_number; i++){
+        if(m_sub_process[i].m_listenfd != -1 && m_sub_process[i].m_listenfd != m_listenfd){
+            close(m_sub_process[i].m_listenfd);
+        }
+        m_sub_process[i].m_listenfd = -1;
+    }
+    close(m_listenfd);
+    m_listenfd = -1;
+    for(int i = 0; i < m_process_number; i++){
+        m_sub_process[i].m_respawn = false;
+        if(m_sub_process[i].m_pid != -1){
+            kill(m_sub_process[i].m_pid, SIGQUIT);
+        }
+    }
+    m_stop = all_exited();
+}
+
+template <typename T>
+int processpool<T>::wait_ready(){
+    struct pollfd fds[MAX_PROCESS_NUMBER];
+    int waiting = 0;
+    for(int i = 0; i < m_process_number; i++){
+        if(m_sub_process[i].m_pid != -1){
+            fds[waiting].fd = m_sub_process[i].m_pipefd[0];
+            fds[waiting].events = POLLIN;
+            waiting++;
+        }
+    }
+    int ready = 0;
+    int64_t deadline = now_us() / 1000 + READY_TIMEOUT;
+    while(waiting > 0){
+        int64_t left = deadline - now_us() / 1000;
+        if(left <= 0){
+            LOG_WARN("%d children are not ready in %d ms", waiting, READY_TIMEOUT);
+            break;
+        }
+        int ret = poll(fds, waiting, (int)left);
+        if(ret < 0 && errno != EINTR){
+            LOG_ERROR("poll failure: %s", strerror(errno));
+            break;
+        }
+        // 从后往前检查，报告过的（或者已经退出、管道关闭的）子进程用最后一项替换
+        for(int i = waiting - 1; i >= 0 && ret > 0; i--){
+            if(!fds[i].revents){
+                continue;
+            }
+            char byte;
+            int n = recv(fds[i].fd, &byte, 1, MSG_DONTWAIT);
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+                continue;
+            }
+            if(n == 1){
+                ready++;
+            }
+            fds[i] = fds[--waiting];
+        }
+    }
+    return ready;
+}
+
+template <typename T>
+void processpool<T>::upgrade(){
+    if(m_upgrade_pid != -1 || m_draining || m_terminating){
+        LOG_WARN("cannot upgrade now");
+        return;
+    }
+    pid_t pid = fork();
+    if(pid < 0){
+        LOG_ERROR("fork failure: %s", strerror(errno));
+        return;
+    }
+    if(pid > 0){
+        LOG_INFO("starting the new binary as process %d", pid);
+        m_upgrade_pid = pid;
+        return;
+    }
+
+    // 新的程序只继承监听socket，其余描述符在exec之前关闭
+    close(m_epollfd);
+    close(sig_pipefd[0]);
+    close(sig_pipefd[1]);
+    for(int i = 0; i < m_process_number; i++){
+        if(m_sub_process[i].m_pid != -1){
+            close(m_sub_process[i].m_pipefd[0]);
+        }
+        if(m_sub_process[i].m_listenfd != -1 && m_sub_process[i].m_listenfd != m_listenfd){
+            close(m_sub_process[i].m_listenfd);
+        }
+    }
+    char value[16];
+    snprintf(value, sizeof(value), "%d", m_listenfd);
+    setenv(LISTEN_FD_ENV, value, 1);
+    snprintf(value, sizeof(value), "%d", (int)getppid());
+    setenv(UPGRADE_FROM_ENV, value, 1);
+    exec_self();
+    LOG_ERROR("exec failure: %s", strerror(errno));
+    _exit(1);
+}
+
+// 比较活跃连接数与尚未处理的事件数之和，相同时选处理耗时的移动平均明显（一半以下）较小的，
+// 否则从m_next开始轮流选择，避免微秒级的抖动使连接集中到一个子进程
+template <typename T>
+int processpool<T>::least_loaded(){
+    int best = -1;
+    int best_load = 0;
+    int best_latency = 0;
+    for(int n = 0; n < m_process_number; n++){
+        int i = (m_next + n) % m_process_number;
+        if(m_sub_process[i].m_pid == -1){
+            continue;
+        }
+        int load = m_load[i].connections.load(std::memory_order_relaxed) + m_load[i].pending.load(std::memory_order_relaxed);
+        int latency = m_load[i].latency.load(std::memory_order_relaxed);
+        if(best == -1 || load < best_load || (load == best_load && latency * 2 < best_latency)){
+            best = i;
+            best_load = load;
+            best_latency = latency;
+        }
+    }
+    if(best != -1){
+        m_next = (best + 1) % m_process_number;
+    }
+    return best;
+}
+
+template <typename T>
+void processpool<T>::dispatch_batch(){
+    for(int n = 0; n < ACCEPT_BATCH; n++){
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+        int connfd = accept4(m_listenfd, (struct sockaddr*)&client_address, &client_addrlength, SOCK_NONBLOCK);
+        if(connfd < 0){
+            if(errno == ECONNABORTED || errno == EINTR){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                LOG_WARN("accept failed, errno is:%d", errno);
+            }
+            break;
+        }
+
+        struct iovec iov;
+        iov.iov_base = &client_address;
+        iov.iov_len = sizeof(client_address);
+        union{
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        memset(&control, 0, sizeof(control));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &connfd, sizeof(connfd));
+
+        // 子进程的管道满了（它处理不过来）时换下一个负载最轻的
+        bool sent = false;
+        for(int tries = 0; tries < m_process_number && !sent; tries++){
+            int i = least_loaded();
+            if(i == -1){
+                break;
+            }
+            // 先计入连接数，同一批中后面的连接才会看到这个子进程的负载已经增加
+            m_load[i].connections.fetch_add(1, std::memory_order_relaxed);
+            if(sendmsg(m_sub_process[i].m_pipefd[0], &msg, MSG_NOSIGNAL) == sizeof(client_address)){
+                sent = true;
+                LOG_DEBUG("send connection to child %d", i);
+            }
+            else{
+                m_load[i].connections.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+        if(!sent){
+            LOG_WARN("no child can take connection %d", connfd);
+        }
+        // 描述符已复制到子进程中，父进程的这一份可以关闭
+        close(connfd);
+    }
+}
 
-#endif
\ No newline at end of file
+#endif
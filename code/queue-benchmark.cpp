@@ -0,0 +1,222 @@
+/*
+ * 线程池请求队列的微基准测试
+ * 比较原来的std::list + 互斥锁 + 信号量队列、mpmc_queue + eventcount队列和work_stealing调度，
+ * 生产者和消费者数量从1到64，消费者在队列为空时都会阻塞，与threadpool中工作线程的行为一致
+ *
+ * 编译：g++ -O2 -pthread queue-benchmark.cpp -o queue-benchmark
+ * 运行：./queue-benchmark [每轮传递的任务总数]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <list>
+#include <atomic>
+#include "web/locker.h"
+#include "web/mpmc_queue.h"
+#include "web/scheduler.h"
+
+#define QUEUE_CAPACITY 10000
+#define MAX_THREADS 64
+
+// 原threadpool中的请求队列：每个元素一次堆分配，所有线程竞争同一把锁
+class list_queue{
+public:
+    static const char* name(){ return "list+mutex+sem"; }
+    void put( void* item, size_t affinity ){
+        while( true ){
+            m_lock.lock();
+            if( m_list.size() < QUEUE_CAPACITY ){
+                break;
+            }
+            m_lock.unlock();
+            sched_yield();
+        }
+        m_list.push_back( item );
+        m_lock.unlock();
+        m_stat.post();
+    }
+    void* take( int index ){
+        while( true ){
+            m_stat.wait();
+            m_lock.lock();
+            if( m_list.empty() ){
+                m_lock.unlock();
+                continue;
+            }
+            void* item = m_list.front();
+            m_list.pop_front();
+            m_lock.unlock();
+            return item;
+        }
+    }
+
+private:
+    std::list< void* > m_list;
+    locker m_lock;
+    sem m_stat;
+};
+
+// 现threadpool中的请求队列
+class ring_queue{
+public:
+    ring_queue() : m_queue( QUEUE_CAPACITY ){}
+    static const char* name(){ return "mpmc_queue+eventcount"; }
+    void put( void* item, size_t affinity ){
+        while( ! m_queue.push( item ) ){
+            sched_yield();
+        }
+        m_event.notify_one();
+    }
+    void* take( int index ){
+        void* item = NULL;
+        while( true ){
+            for( int i = 0; i < 64; ++i ){
+                if( m_queue.pop( item ) ){
+                    return item;
+                }
+            }
+            uint32_t key = m_event.prepare_wait();
+            if( m_queue.pop( item ) ){
+                m_event.cancel_wait();
+                return item;
+            }
+            m_event.wait( key );
+        }
+    }
+
+private:
+    mpmc_queue< void* > m_queue;
+    eventcount m_event;
+};
+
+// threadpool< T, work_stealing >的调度，生产者按编号作为affinity放入各自对应的消费者
+class stealing_queue{
+public:
+    stealing_queue() : m_scheduler( MAX_THREADS, QUEUE_CAPACITY ), m_stop( false ){}
+    static const char* name(){ return "work_stealing"; }
+    void put( void* item, size_t affinity ){
+        while( ! m_scheduler.push( ( char* )item, affinity ) ){
+            sched_yield();
+        }
+    }
+    void* take( int index ){
+        return m_scheduler.take( index, m_stop );
+    }
+
+private:
+    work_stealing< char > m_scheduler;
+    std::atomic< bool > m_stop;
+};
+
+// 每个消费者已取出的任务数，各占一个缓存行
+struct alignas( 64 ) counter{
+    std::atomic< long > value;
+};
+
+template< typename Q >
+struct context{
+    Q* queue;
+    long per_producer;
+    counter consumed[ MAX_THREADS ];
+    std::atomic< int > next_producer;
+    std::atomic< int > next_consumer;
+};
+
+template< typename Q >
+void* producer( void* arg ){
+    context< Q >* ctx = ( context< Q >* )arg;
+    int index = ctx->next_producer++;
+    for( long i = 1; i <= ctx->per_producer; ++i ){
+        ctx->queue->put( ( void* )i, index );
+    }
+    return NULL;
+}
+
+// 取到NULL表示结束
+template< typename Q >
+void* consumer( void* arg ){
+    context< Q >* ctx = ( context< Q >* )arg;
+    int index = ctx->next_consumer++;
+    long count = 0;
+    while( ctx->queue->take( index ) ){
+        ctx->consumed[ index ].value.store( ++count, std::memory_order_relaxed );
+    }
+    return NULL;
+}
+
+template< typename Q >
+long consumed( context< Q >& ctx, int threads ){
+    long sum = 0;
+    for( int i = 0; i < threads; ++i ){
+        sum += ctx.consumed[i].value.load( std::memory_order_relaxed );
+    }
+    return sum;
+}
+
+static double now(){
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 返回每秒传递的任务数（百万）
+template< typename Q >
+double run( int threads, long total ){
+    Q queue;
+    context< Q > ctx;
+    ctx.queue = &queue;
+    ctx.per_producer = total / threads;
+    for( int i = 0; i < MAX_THREADS; ++i ){
+        ctx.consumed[i].value = 0;
+    }
+    ctx.next_producer = 0;
+    ctx.next_consumer = 0;
+
+    pthread_t producers[ threads ];
+    pthread_t consumers[ threads ];
+    double start = now();
+    for( int i = 0; i < threads; ++i ){
+        pthread_create( consumers + i, NULL, consumer< Q >, &ctx );
+    }
+    for( int i = 0; i < threads; ++i ){
+        pthread_create( producers + i, NULL, producer< Q >, &ctx );
+    }
+    for( int i = 0; i < threads; ++i ){
+        pthread_join( producers[i], NULL );
+    }
+    // 等所有任务都被取出后再计时，然后给每个消费者放一个结束标记。
+    // 工作窃取下没有全局的先后顺序，结束标记若与任务同时在队列中，消费者可能先取到标记而提前退出
+    long total_items = ctx.per_producer * threads;
+    double deadline = now() + 60;
+    while( ( consumed( ctx, threads ) < total_items ) && ( now() < deadline ) ){
+        usleep( 100 );
+    }
+    double elapsed = now() - start;
+    long lost = total_items - consumed( ctx, threads );
+    for( int i = 0; i < threads; ++i ){
+        queue.put( NULL, i );
+    }
+    for( int i = 0; i < threads; ++i ){
+        pthread_join( consumers[i], NULL );
+    }
+    if( lost != 0 ){
+        printf( "lost items: %ld of %ld\n", lost, total_items );
+    }
+    return total_items / elapsed / 1e6;
+}
+
+int main( int argc, char* argv[] ){
+    long total = ( argc > 1 ) ? atol( argv[1] ) : 2000000;
+    printf( "%-8s %22s %22s %22s\n", "threads", list_queue::name(), ring_queue::name(), stealing_queue::name() );
+    for( int threads = 1; threads <= MAX_THREADS; threads *= 2 ){
+        double list_rate = run< list_queue >( threads, total );
+        double ring_rate = run< ring_queue >( threads, total );
+        double stealing_rate = run< stealing_queue >( threads, total );
+        printf( "%-8d %17.2f Mops %17.2f Mops %17.2f Mops\n", threads, list_rate, ring_rate, stealing_rate );
+    }
+    return 0;
+}
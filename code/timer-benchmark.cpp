@@ -0,0 +1,198 @@
+/*
+ * 定时器容器的基准测试
+ * 按服务器中连接定时器的典型用法回放同一负载，比较sort_timer_lst、skip_list_timer、time_heap和time_wheel：
+ *   定时器分批（每轮一批）创建，同一批的超时时间几乎相同，到期也成批发生；
+ *   每个定时器在到期之前有45%被删除（连接关闭），45%被重新设置（keep-alive连接上来了新请求），只有10%按原期限到期。
+ * 定时器从各容器的timer_pool中分配，回调是捕获了连接指针的lambda。
+ * 报告每次添加、删除和调整的平均耗时，tick一次调用的耗时分布，以及容器（含定时器）占用的内存峰值。
+ * 有序链表的插入是O(n)，只用不超过LIST_MAX个定时器测试
+ *
+ * 编译：g++ -O2 timer-benchmark.cpp -o timer-benchmark
+ * 运行：./timer-benchmark [定时器总数]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <vector>
+#include <algorithm>
+#include "timer/lst_timer.h"
+#include "timer/skip-list-timer.h"
+#include "timer/min-heap-timer.h"
+#include "timer/time-wheel.h"
+
+#define ROUNDS 200
+#define ROUND_MS 2
+// 一批定时器的超时时间为TIMEOUT_MS加上不超过JITTER_MS的随机值
+#define TIMEOUT_MS 100
+#define JITTER_MS 2
+// 重新设置的定时器的超时时间为TIMEOUT_MS加上不超过RESCHEDULE_MS的随机值
+#define RESCHEDULE_MS 200
+// 创建后第几轮决定定时器的命运，须远早于超时
+#define ACTION_DELAY 5
+#define LIST_MAX 20000
+
+struct result{
+    long timers;
+    double add_ns;
+    double cancel_ns;
+    double adjust_ns;
+    std::vector< double > ticks;        // 每次tick的耗时（微秒）
+    long expired;
+    size_t peak_bytes;
+    size_t peak_timers;
+};
+
+static long expired_count = 0;
+
+// 一个连接，只记录它的定时器
+struct connection{
+    timer_base* timer;
+};
+
+static int64_t now_ns(){
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( int64_t )ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t heap_in_use(){
+    return mallinfo2().uordblks;
+}
+
+template< typename C >
+void run( C& container, long n, result& res ){
+    typedef typename C::timer_type timer_type;
+    std::vector< connection > users( n );
+    long per_round = n / ROUNDS;
+    res.timers = per_round * ROUNDS;
+    res.ticks.clear();
+    res.peak_bytes = 0;
+    res.peak_timers = 0;
+    expired_count = 0;
+    int64_t add_time = 0, cancel_time = 0, adjust_time = 0;
+    long cancels = 0, adjusts = 0;
+    size_t baseline = heap_in_use();
+    srand( 1 );
+
+    int64_t start = now_ns();
+    for( int round = 0; ; ++round ){
+        if( round < ROUNDS ){
+            int64_t t = now_ns();
+            for( long i = round * per_round; i < ( round + 1 ) * per_round; ++i ){
+                timer_type* timer = container.add_timer( TIMEOUT_MS + rand() % JITTER_MS );
+                connection* conn = &users[i];
+                timer->set_callback( [conn]{
+                    conn->timer = NULL;
+                    ++expired_count;
+                } );
+                conn->timer = timer;
+            }
+            add_time += now_ns() - t;
+        }
+        if( ( round >= ACTION_DELAY ) && ( round - ACTION_DELAY < ROUNDS ) ){
+            long first = ( round - ACTION_DELAY ) * per_round;
+            long last = first + per_round;
+            int64_t t = now_ns();
+            for( long i = first; i < last; ++i ){
+                if( ( i % 20 < 9 ) && users[i].timer ){
+                    container.del_timer( ( timer_type* )users[i].timer );
+                    users[i].timer = NULL;
+                    ++cancels;
+                }
+            }
+            int64_t t2 = now_ns();
+            for( long i = first; i < last; ++i ){
+                if( ( i % 20 >= 9 ) && ( i % 20 < 18 ) && users[i].timer ){
+                    container.adjust_timer( ( timer_type* )users[i].timer, TIMEOUT_MS + rand() % RESCHEDULE_MS );
+                    ++adjusts;
+                }
+            }
+            int64_t t3 = now_ns();
+            cancel_time += t2 - t;
+            adjust_time += t3 - t2;
+        }
+
+        size_t bytes = heap_in_use() - baseline;
+        res.peak_bytes = std::max( res.peak_bytes, bytes );
+        res.peak_timers = std::max( res.peak_timers, container.timer_count() );
+
+        int64_t t = now_ns();
+        container.tick();
+        res.ticks.push_back( ( now_ns() - t ) / 1000.0 );
+
+        if( ( round >= ROUNDS + ACTION_DELAY ) && ( container.timer_count() == 0 ) ){
+            break;
+        }
+        // 按固定的节奏推进，创建完毕后按next_timeout睡眠
+        int64_t next = start + ( int64_t )( round + 1 ) * ROUND_MS * 1000000;
+        int64_t wait = next - now_ns();
+        if( round >= ROUNDS + ACTION_DELAY ){
+            int timeout = container.next_timeout();
+            wait = ( int64_t )( timeout < 0 ? 0 : timeout ) * 1000000;
+        }
+        if( wait > 0 ){
+            usleep( wait / 1000 );
+        }
+    }
+    res.add_ns = ( double )add_time / res.timers;
+    res.cancel_ns = cancels ? ( double )cancel_time / cancels : 0;
+    res.adjust_ns = adjusts ? ( double )adjust_time / adjusts : 0;
+    res.expired = expired_count;
+}
+
+static double percentile( std::vector< double >& v, double p ){
+    if( v.empty() ){
+        return 0;
+    }
+    std::sort( v.begin(), v.end() );
+    size_t i = ( size_t )( p * ( v.size() - 1 ) );
+    return v[i];
+}
+
+static void report( const char* name, result& res ){
+    printf( "%-14s %8ld %8.1f %8.1f %8.1f %9.1f %9.1f %9.1f %9.1f %8.2f %7.1f %8ld\n", name, res.timers,
+            res.add_ns, res.cancel_ns, res.adjust_ns,
+            percentile( res.ticks, 0.5 ), percentile( res.ticks, 0.99 ), percentile( res.ticks, 0.999 ),
+            percentile( res.ticks, 1.0 ), res.peak_bytes / 1048576.0,
+            res.peak_timers ? ( double )res.peak_bytes / res.peak_timers : 0, res.expired );
+}
+
+int main( int argc, char* argv[] ){
+    long n = ( argc > 1 ) ? atol( argv[1] ) : 1000000;
+    if( n < ROUNDS ){
+        n = ROUNDS;
+    }
+    printf( "%-14s %8s %8s %8s %8s %9s %9s %9s %9s %8s %7s %8s\n", "container", "timers", "add ns", "del ns",
+            "adj ns", "tick p50", "p99 us", "p99.9 us", "max us", "peak MB", "B/timer", "expired" );
+    result res;
+    {
+        sort_timer_lst list;
+        run( list, std::min( n, ( long )LIST_MAX ), res );
+        report( "sorted list", res );
+    }
+    {
+        skip_list_timer list;
+        run( list, n, res );
+        report( "skip list", res );
+    }
+    {
+        time_heap heap( 1024 );
+        run( heap, n, res );
+        report( "4-ary heap", res );
+    }
+    {
+        time_heap heap( 1024, true );
+        run( heap, n, res );
+        report( "heap (lazy)", res );
+    }
+    {
+        time_wheel* wheel = new time_wheel;
+        run( *wheel, n, res );
+        report( "time wheel", res );
+        delete wheel;
+    }
+    return 0;
+}
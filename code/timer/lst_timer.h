@@ -1,82 +1,176 @@
-#ifdef LST_TIMER
+#ifndef LST_TIMER
 #define LST_TIMER
 
 #include <time.h>
-#define BUFFER_SIZE 64
-class util_timer;   //前向声明
+#include "timer-common.h"
 
-/**
- * @brief 用户数据结构
-*/
-struct client_data
-{
-    sockaddr_in address;
-    int sockfd;
-    char buf[BUFFER_SIZE];
-    util_timer* timer;
-};
-
-class util_timer{
+class util_timer : public timer_base{
 public:
     util_timer():prev(NULL), next(NULL){}
 
-    time_t expire;  //任务超时事件（绝对时间）
-    void (*cb_func)(client_data*);  //任务回调函数
-    client_data* user_data; //回调函数处理的客户数据
     util_timer* prev;   //指向前一个定时器
     util_timer* next;   //指向下一个定时器
+};
 
-}
-
-
-
-
+/**
+ * @brief 按到期时间升序排列的双向链表
+ * 到期处理只需从头部开始，O(1)；插入和调整需要找到位置，O(n)。
+ * 服务器中新的定时器大多比已有的更晚到期（超时时间相同），所以从尾部向前查找插入位置，这种情况下插入是O(1)
+*/
 class sort_timer_lst{
 public:
-    sort_timer_lst():head(NULL), tail(NULL) {}
+    typedef util_timer timer_type;
+
+    sort_timer_lst():head(NULL), tail(NULL), size(0) {}
     ~sort_timer_lst(){
-        util_timer* tmp = head;
-        while(tmp){
-            head=tmp->next;
-            delete tmp;
-            tmp = head;
+        while(head){
+            util_timer* tmp = head;
+            unlink(tmp);
+            release(tmp);
         }
     }
 
+    // 从池中取一个timeout毫秒后到期的定时器并插入链表
+    util_timer* add_timer(int timeout){
+        if(timeout < 0){
+            return NULL;
+        }
+        util_timer* timer = pool.alloc();
+        add_timer(timer, timeout);
+        return timer;
+    }
 
-    //插入定时器，需保证顺序正确
-    void add_timer(util_timer* timer){
+    //插入定时器，需保证顺序正确。已在链表中的定时器重新设置期限
+    void add_timer(util_timer* timer, int timeout){
         if(!timer){
             return;
         }
-        if(!head){
-            head = tail = timer;
+        if(timer->armed){
+            adjust_timer(timer, timeout);
             return;
         }
-        if(timer->expire < head->expire){
-            timer->next = head;
-            head->prev = timer;
-            head = timer;
-        }
-        add_timer(timer, head);
+        timer->expire = timer_now_ms() + (timeout < 0 ? 0 : timeout);
+        timer->armed = true;
+        ++size;
+        insert(timer);
     }
 
-    //当某个定时任务发生变化时，调整其在链表中的位置
-    //这个函数只考虑被调整的定时器超时时间延长的情况
+    //当某个定时任务发生变化时，调整其在链表中的位置。调用者已修改了timer->expire，延长或提前都可以
     void adjust_timer(util_timer* timer){
-        if(!timer)
+        if(!timer || !timer->armed)
+            return;
+        // 调整后仍不早于前一个、不晚于后一个，位置不变
+        if((!timer->prev || timer->prev->expire <= timer->expire)
+                && (!timer->next || timer->expire <= timer->next->expire))
+            return;
+        unlink(timer);
+        insert(timer);
+    }
+
+    // 把定时器改为从现在起timeout毫秒后到期
+    void adjust_timer(util_timer* timer, int timeout){
+        if(!timer || !timer->armed)
             return;
-        util_timer* temp = timer->next;
-        // 在链表尾部，或加时后，排序不变
-        if(!temp || (timer->expire < temp->expire))
+        timer->expire = timer_now_ms() + (timeout < 0 ? 0 : timeout);
+        adjust_timer(timer);
+    }
+
+    //将目标定时器从链表中删除
+    void del_timer(util_timer* timer){
+        if(!timer || !timer->armed)
             return;
-        // 
+        unlink(timer);
+        release(timer);
+    }
+
+    //处理链表上到期的任务
+    void tick(){
+        tick(timer_now_ms());
+    }
+
+    void tick(int64_t now){
+        while(head && head->expire <= now){
+            // 先摘下再执行回调，回调中可以添加、调整或删除其他定时器，也可以重新加入本定时器
+            util_timer* tmp = head;
+            unlink(tmp);
+            tmp->armed = false;
+            --size;
+            if(tmp->callback){
+                tmp->callback();
+            }
+            if(tmp->pooled && !tmp->armed){
+                pool.free(tmp);
+            }
+        }
+    }
+
+    int next_timeout() const{
+        if(!head){
+            return -1;
+        }
+        int64_t left = head->expire - timer_now_ms();
+        return left < 0 ? 0 : (int)left;
+    }
+
+    size_t timer_count() const{
+        return size;
+    }
+
+private:
+    // 从尾部向前找到第一个不晚于timer的定时器，插在它后面；到期时间相同的定时器保持插入顺序
+    void insert(util_timer* timer){
+        util_timer* tmp = tail;
+        while(tmp && tmp->expire > timer->expire){
+            tmp = tmp->prev;
+        }
+        timer->prev = tmp;
+        if(tmp){
+            timer->next = tmp->next;
+            tmp->next = timer;
+        }
+        else{
+            timer->next = head;
+            head = timer;
+        }
+        if(timer->next){
+            timer->next->prev = timer;
+        }
+        else{
+            tail = timer;
+        }
+    }
+
+    void unlink(util_timer* timer){
+        if(timer->prev){
+            timer->prev->next = timer->next;
+        }
+        else{
+            head = timer->next;
+        }
+        if(timer->next){
+            timer->next->prev = timer->prev;
+        }
+        else{
+            tail = timer->prev;
+        }
+        timer->prev = timer->next = NULL;
+    }
+
+    // 已摘下的定时器离开链表：池中的归还给池
+    void release(util_timer* timer){
+        timer->armed = false;
+        --size;
+        if(timer->pooled){
+            pool.free(timer);
+        }
     }
 
 private:
     util_timer* head;
     util_timer* tail;
-}
+    size_t size;
+    timer_pool< util_timer > pool;
+};
 
 
-#endif
\ No newline at end of file
+#endif
@@ -3,109 +3,142 @@
 
 #include <iostream>
 #include <netinet/in.h>
+#include <stdint.h>
 #include <time.h>
+#include "timer-common.h"
 
 using std::exception;
 
-#define BUFFER_SIZE 64
-
-class heap_timer;
-
-struct client_data
-{
-    sockaddr_in address;
-    int sockfd;
-    char buf[BUFFER_SIZE];
-    heap_timer* timer;
-};
-
-class heap_timer{
+class heap_timer : public timer_base{
 public:
-    heap_timer(int delay){
-        expire = time(NULL) + delay;
-    }
+    heap_timer() : index(-1), deleted(false){}
 
 public:
-    time_t expire;                      //定时器生效的绝对事件
-    void (*cb_func) (client_data*);     //定时器的回调函数
-    client_data* user_data;             //用户数据
+    int index;                          //在堆数组中的下标，不在堆中时为-1
+    bool deleted;                       //延迟删除模式下已被删除，等待归还给池
 };
 
+/**
+ * @brief 带索引的4叉最小堆
+ * 每个定时器记录自己在堆数组中的下标，删除和调整都是真正的O(log n)操作，不会在堆中留下失效的定时器；
+ * 4叉堆的层数是2叉堆的一半，下滤时4个孩子位于相邻的缓存行中，比2叉堆少一半的缓存缺失。
+ * 延迟删除（只做标记，等它到达堆顶时再丢弃）作为可选模式保留，失效的定时器超过一半时整体重建一次堆；
+ * 延迟删除只用于池中的定时器，调用者的定时器总是立即摘下，删除后可以马上重用或销毁。
+ * 元素数降到容量的1/4以下时容量减半，但不小于初始容量
+*/
 class time_heap{
 public:
+    typedef heap_timer timer_type;
+
     /**
      * @brief 构造函数
      * @param cap 堆容量
+     * @param lazy 是否延迟删除
     */
-    time_heap(int cap) throw(std::exception): capacity(cap), cur_size(0){
-        array = new heap_timer* [capacity];
-        if(!array){
+    time_heap(int cap = 64, bool lazy = false): array(NULL), capacity(cap), min_capacity(cap), cur_size(0),
+            lazy_delete(lazy), dead(0){
+        if(cap <= 0){
             throw std::exception();
         }
+        array = new heap_timer* [capacity];
         for(int i = 0; i < capacity; i++){
-            array[i] == NULL;
+            array[i] = NULL;
         }
     }
     /**
-     * 
+     * @brief 用调用者已设置好expire的定时器建堆
+     * @param init_array 定时器数组
+     * @param size 定时器数目
+     * @param capacity 堆容量，不小于size
     */
-    time_heap(heap_timer** init_array, int size, int capacity) throw(std::exception):cur_size(size), capacity(capacity){
-        if(capacity < size){
-            throw std::exception();
-        }
-        if(!array){
+    time_heap(heap_timer** init_array, int size, int capacity, bool lazy = false): array(NULL), capacity(capacity),
+            min_capacity(capacity), cur_size(size), lazy_delete(lazy), dead(0){
+        if(capacity < size || capacity <= 0){
             throw std::exception();
         }
+        array = new heap_timer* [capacity];
         for(int i = 0; i < capacity; i++){
             array[i] = NULL;
         }
-        if(size != 0){
-            for(int i = 0; i < size; i++){
-                array[i] = init_array[i];
-            }
-            // 下滤
-            for(int i = (cur_size-1)/2; i >= 0; --i){
-                percolate_down(i);
-            }
+        for(int i = 0; i < size; i++){
+            array[i] = init_array[i];
+            array[i]->index = i;
+            array[i]->armed = true;
         }
+        heapify();
     }
 
     ~time_heap(){
         for(int i = 0; i < cur_size; i++){
-            delete array[i];
+            array[i]->index = -1;
+            release(array[i]);
         }
         delete [] array;
     }
 
+    // 从池中取一个timeout毫秒后到期的定时器并加入堆
+    heap_timer* add_timer(int timeout){
+        if(timeout < 0){
+            return NULL;
+        }
+        heap_timer* timer = pool.alloc();
+        add_timer(timer, timeout);
+        return timer;
+    }
+
     /**
-     * 添加定时器，若容量不够，会自动扩容
+     * 添加定时器，若容量不够，会自动扩容。已在堆中的定时器重新设置期限
     */
-    void add_time(heap_timer* timer) throw(std::exception){
+    void add_timer(heap_timer* timer, int timeout){
         if(!timer){
             return;
         }
+        if(timer->armed){
+            adjust_timer(timer, timeout);
+            return;
+        }
+        timer->expire = timer_now_ms() + (timeout < 0 ? 0 : timeout);
+        timer->armed = true;
         if(cur_size >= capacity){
-            resize();
+            resize(2 * capacity);
         }
         int hole = cur_size++;
-        int parent = 0;
-        for( ; hole > 0; hole=parent){
-            parent = (hole-1)/2;
-            if(array[parent]->expire <= timer->expire){
-                break;
-            }
-            array[hole] = array[parent];
-        }
         array[hole] = timer;
+        timer->index = hole;
+        percolate_up(hole);
     }
 
+    // 从堆中删除定时器，池中的定时器归还给池。延迟删除模式下池中的定时器只做标记，由tick或重建堆时归还
     void del_timer(heap_timer* timer){
-        if(!timer){
+        if(!timer || !timer->armed || timer->deleted){
+            return;
+        }
+        if(lazy_delete && timer->pooled){
+            timer->deleted = true;
+            timer->callback.reset();
+            ++dead;
+            if(dead > cur_size / 2){
+                purge();
+            }
             return;
         }
-        // 仅仅将目标定时器的回调函数设为空，即所谓的延迟销毁
-        // 节省真正删除定时器造成的开销，但容易使堆数组膨胀
-        timer->cb_func = NULL;
+        remove(timer->index);
+        release(timer);
+    }
+
+    // 把定时器的到期时间改为从现在起delay毫秒之后，延长或提前都可以
+    void adjust_timer(heap_timer* timer, int delay){
+        if(!timer || !timer->armed || timer->deleted){
+            return;
+        }
+        int64_t old = timer->expire;
+        timer->expire = timer_now_ms() + (delay < 0 ? 0 : delay);
+        if(timer->expire < old){
+            percolate_up(timer->index);
+        }
+        else{
+            percolate_down(timer->index);
+        }
     }
 
     // 获取堆顶计时器
@@ -121,12 +154,12 @@ public:
         if(empty()){
             return;
         }
-        if(array[0]){
-            delete array[0];
-            array[0] = array[--cur_size];
-            // 从堆顶向下调整
-            percolate_down(0);
+        heap_timer* timer = array[0];
+        if(timer->deleted){
+            --dead;
         }
+        remove(0);
+        release(timer);
     }
 
     //判空
@@ -134,60 +167,170 @@ public:
         return cur_size == 0;
     }
 
+    // 堆中定时器的数目，延迟删除模式下包括尚未归还的失效定时器
+    int size() const{
+        return cur_size;
+    }
+
+    // 有效定时器的数目
+    size_t timer_count() const{
+        return cur_size - dead;
+    }
+
+    int next_timeout() const{
+        if(empty()){
+            return -1;
+        }
+        int64_t left = array[0]->expire - timer_now_ms();
+        return left < 0 ? 0 : (int)left;
+    }
+
     // 心搏函数
     void tick(){
-        heap_timer* tmp = array[0];
-        time_t cur = time(NULL);
-        while (!empty())
-        {
-            if(!tmp){
-                break;
-            }
+        tick(timer_now_ms());
+    }
+
+    void tick(int64_t cur){
+        while(!empty()){
+            heap_timer* tmp = array[0];
             // 未到期
             if(tmp->expire > cur){
                 break;
             }
-            // 到期，执行回调函数
-            if(array[0]->cb_func){
-                array[0]->cb_func(array[0]->user_data);
+            // 先出堆再执行回调，回调中可以添加、调整或删除其他定时器，也可以重新加入本定时器
+            if(tmp->deleted){
+                --dead;
+                remove(0);
+                release(tmp);
+                continue;
+            }
+            remove(0);
+            tmp->armed = false;
+            if(tmp->callback){
+                tmp->callback();
+            }
+            if(tmp->pooled && !tmp->armed){
+                pool.free(tmp);
             }
-            pop_timer();
-            tmp = array[0];
         }
     }
 
 private:
+    // 移除下标为hole的定时器，用最后一个定时器填补空位
+    void remove(int hole){
+        array[hole]->index = -1;
+        heap_timer* last = array[--cur_size];
+        array[cur_size] = NULL;
+        if(hole < cur_size){
+            array[hole] = last;
+            last->index = hole;
+            // 填补的定时器可能比原位置的父节点更早到期，也可能比孩子更晚
+            if(hole > 0 && last->expire < array[(hole - 1) / 4]->expire){
+                percolate_up(hole);
+            }
+            else{
+                percolate_down(hole);
+            }
+        }
+        if(cur_size < capacity / 4 && capacity / 2 >= min_capacity){
+            resize(capacity / 2);
+        }
+    }
+
+    // 上滤
+    void percolate_up(int hole){
+        heap_timer* temp = array[hole];
+        while(hole > 0){
+            int parent = (hole - 1) / 4;
+            if(array[parent]->expire <= temp->expire){
+                break;
+            }
+            array[hole] = array[parent];
+            array[hole]->index = hole;
+            hole = parent;
+        }
+        array[hole] = temp;
+        temp->index = hole;
+    }
+
     // 最小堆下滤，确保以第hole个节点为根节点的子树为最小堆
     void percolate_down(int hole){
         heap_timer* temp = array[hole];
-        int child = 0;
-        for(; (hole*2+1) <= cur_size-1; hole = child){
-            child = hole * 2 + 1;
-            // 找到最小孩子
-            if(child < cur_size-1 && array[child+1]->expire < array[child]->expire){
-                ++child;
+        while(true){
+            int first = hole * 4 + 1;
+            if(first >= cur_size){
+                break;
             }
-            // 交换
-            if(array[child]->expire < temp->expire){
-                array[hole] = array[child];
+            // 找到最小孩子
+            int last = first + 4 < cur_size ? first + 4 : cur_size;
+            int child = first;
+            for(int i = first + 1; i < last; i++){
+                if(array[i]->expire < array[child]->expire){
+                    child = i;
+                }
             }
-            else{
+            if(array[child]->expire >= temp->expire){
                 break;
             }
+            array[hole] = array[child];
+            array[hole]->index = hole;
+            hole = child;
         }
         array[hole] = temp;
+        temp->index = hole;
     }
 
-    // 将对数组容量翻倍
-    void resize() throw(std::exception){
-        heap_timer** temp = new heap_timer* [2*capacity];
-        for(int i  = 0; i < 2*capacity; i++){
-            temp[i] = NULL;
+    // 自底向上建堆，O(n)
+    void heapify(){
+        if(cur_size < 2){
+            return;
         }
-        if(!temp){
-            throw std::exception();
+        for(int i = (cur_size - 2) / 4; i >= 0; --i){
+            percolate_down(i);
+        }
+    }
+
+    // 归还所有失效的定时器并重建堆
+    void purge(){
+        int n = 0;
+        for(int i = 0; i < cur_size; i++){
+            if(!array[i]->deleted){
+                array[n] = array[i];
+                array[n]->index = n;
+                ++n;
+            }
+            else{
+                array[i]->index = -1;
+                release(array[i]);
+            }
+        }
+        for(int i = n; i < cur_size; i++){
+            array[i] = NULL;
+        }
+        cur_size = n;
+        dead = 0;
+        heapify();
+        while(cur_size < capacity / 4 && capacity / 2 >= min_capacity){
+            resize(capacity / 2);
+        }
+    }
+
+    // 已出堆的定时器：池中的归还给池
+    void release(heap_timer* timer){
+        timer->armed = false;
+        timer->deleted = false;
+        if(timer->pooled){
+            pool.free(timer);
+        }
+    }
+
+    // 将数组容量改为cap
+    void resize(int cap){
+        heap_timer** temp = new heap_timer* [cap];
+        for(int i = 0; i < cap; i++){
+            temp[i] = NULL;
         }
-        capacity *= 2;
+        capacity = cap;
         for(int i = 0; i < cur_size; i++){
             temp[i] = array[i];
         }
@@ -200,8 +343,12 @@ private:
 private:
     heap_timer** array;     //堆数组
     int capacity;           //堆数组容量
+    int min_capacity;       //缩容时不低于初始容量
     int cur_size;           //堆数组当前包含元素个数
+    bool lazy_delete;       //是否延迟删除
+    int dead;               //延迟删除模式下堆中失效定时器的数目
+    timer_pool< heap_timer > pool;
 };
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,303 @@
+#ifndef SKIP_LIST_TIMER_H
+#define SKIP_LIST_TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+#include "timer-common.h"
+
+// 跳表的最大层数。每升一层的概率为1/4，12层足够容纳上千万个定时器
+#define SL_MAX_LEVEL 12
+
+// 跳表中的链接：每层一个后继，第0层另有前驱，可以O(1)地判断位置和摘下。表头的哨兵只有链接部分
+struct sl_link{
+    sl_link() : prev( NULL ){
+        for( int i = 0; i < SL_MAX_LEVEL; ++i ){
+            next[i] = NULL;
+        }
+    }
+    sl_link* prev;
+    sl_link* next[ SL_MAX_LEVEL ];
+};
+
+class sl_timer : public timer_base, public sl_link{
+public:
+    sl_timer() : seq( 0 ), level( 0 ), expiring( false ){}
+
+    uint64_t seq;                       //加入的序号，到期时间相同的定时器按加入的顺序排列
+    int level;                          //所在的层数
+    bool expiring;                      //已从跳表中摘下，在本次tick的待执行链表中
+};
+
+/**
+ * @brief 按到期时间升序排列的跳表，保持sort_timer_lst有序容器的用法，插入、删除和调整的期望复杂度为O(log n)
+ * 定时器按(到期时间, 序号)排序，键各不相同，删除时可以直接找到它在每一层的前驱，不用在到期时间相同的一批定时器中逐个查找。
+ * 最早到期的定时器总在第0层的头部，取出是O(1)的；
+ * expire_until一次查找就找到每一层中最后一个已到期的定时器，把整段已到期的定时器从跳表中切下，不必逐个摘下。
+ * 调整后仍在前后两个定时器之间时只修改到期时间，不移动位置
+*/
+class skip_list_timer{
+public:
+    typedef sl_timer timer_type;
+
+    skip_list_timer() : level( 1 ), size( 0 ), seq( 0 ), seed( 0x9e3779b97f4a7c15ULL ){}
+
+    ~skip_list_timer(){
+        while( head.next[0] ){
+            sl_timer* timer = static_cast< sl_timer* >( head.next[0] );
+            head.next[0] = timer->next[0];
+            release( timer );
+        }
+    }
+
+    // 从池中取一个timeout毫秒后到期的定时器并插入跳表
+    sl_timer* add_timer( int timeout ){
+        if( timeout < 0 ){
+            return NULL;
+        }
+        sl_timer* timer = pool.alloc();
+        add_timer( timer, timeout );
+        return timer;
+    }
+
+    // 插入调用者的定时器，已在跳表中的重新设置期限
+    void add_timer( sl_timer* timer, int timeout ){
+        if( !timer ){
+            return;
+        }
+        if( timer->armed ){
+            adjust_timer( timer, timeout );
+            return;
+        }
+        timer->expire = timer_now_ms() + ( timeout < 0 ? 0 : timeout );
+        timer->armed = true;
+        ++size;
+        insert( timer );
+    }
+
+    // 把定时器改为从现在起timeout毫秒后到期，延长或提前都可以
+    void adjust_timer( sl_timer* timer, int timeout ){
+        if( !timer || !timer->armed ){
+            return;
+        }
+        int64_t expire = timer_now_ms() + ( timeout < 0 ? 0 : timeout );
+        if( timer->expiring ){
+            unlink_expiring( timer );
+        }
+        else{
+            // 仍不早于前一个、不晚于后一个时位置不变，各层的顺序都不受影响
+            sl_timer* prev = ( timer->prev == &head ) ? NULL : static_cast< sl_timer* >( timer->prev );
+            sl_timer* next = static_cast< sl_timer* >( timer->next[0] );
+            if( ( !prev || before( prev, expire, timer->seq ) ) && ( !next || !before( next, expire, timer->seq ) ) ){
+                timer->expire = expire;
+                return;
+            }
+            // 按原来的到期时间找到各层的前驱后再摘下
+            unlink( timer );
+        }
+        timer->expire = expire;
+        insert( timer );
+    }
+
+    void del_timer( sl_timer* timer ){
+        if( !timer || !timer->armed ){
+            return;
+        }
+        if( timer->expiring ){
+            unlink_expiring( timer );
+        }
+        else{
+            unlink( timer );
+        }
+        release( timer );
+    }
+
+    // 最早到期的定时器
+    sl_timer* top() const{
+        return static_cast< sl_timer* >( head.next[0] );
+    }
+
+    // 删除最早到期的定时器，O(1)：它在所在的每一层都是第一个
+    void pop_timer(){
+        sl_timer* timer = top();
+        if( !timer ){
+            return;
+        }
+        for( int l = 0; l < timer->level; ++l ){
+            head.next[l] = timer->next[l];
+        }
+        if( timer->next[0] ){
+            timer->next[0]->prev = &head;
+        }
+        release( timer );
+    }
+
+    void tick(){
+        tick( timer_now_ms() );
+    }
+
+    void tick( int64_t now ){
+        expire_until( now );
+    }
+
+    /**
+     * 把到期时间不晚于now的定时器整段切下，再依次执行回调，返回执行的定时器数。
+     * 回调中可以添加、调整或删除其他定时器（包括同一批中尚未执行的），也可以重新加入正在执行的定时器
+    */
+    size_t expire_until( int64_t now ){
+        sl_timer* first = top();
+        if( !first || first->expire > now ){
+            return 0;
+        }
+        // 每一层中最后一个已到期的定时器之后的部分接到表头上
+        sl_link* x = &head;
+        for( int l = level - 1; l >= 0; --l ){
+            while( x->next[l] && static_cast< sl_timer* >( x->next[l] )->expire <= now ){
+                x = x->next[l];
+            }
+            head.next[l] = x->next[l];
+        }
+        if( head.next[0] ){
+            head.next[0]->prev = &head;
+        }
+        // 切下的一段以第0层的双向链表挂在pending上
+        sl_link pending;
+        pending.next[0] = first;
+        first->prev = &pending;
+        x->next[0] = NULL;
+        for( sl_link* t = first; t; t = t->next[0] ){
+            static_cast< sl_timer* >( t )->expiring = true;
+        }
+        shrink();
+
+        size_t fired = 0;
+        while( pending.next[0] ){
+            sl_timer* timer = static_cast< sl_timer* >( pending.next[0] );
+            unlink_expiring( timer );
+            timer->armed = false;
+            --size;
+            ++fired;
+            if( timer->callback ){
+                timer->callback();
+            }
+            if( timer->pooled && !timer->armed ){
+                pool.free( timer );
+            }
+        }
+        return fired;
+    }
+
+    int next_timeout() const{
+        if( !head.next[0] ){
+            return -1;
+        }
+        int64_t left = top()->expire - timer_now_ms();
+        return left < 0 ? 0 : ( int )left;
+    }
+
+    size_t timer_count() const{
+        return size;
+    }
+
+private:
+    // a是否排在b之前
+    static bool before( const sl_timer* a, int64_t expire, uint64_t seq ){
+        return ( a->expire < expire ) || ( ( a->expire == expire ) && ( a->seq < seq ) );
+    }
+    static bool before( const sl_timer* a, const sl_timer* b ){
+        return before( a, b->expire, b->seq );
+    }
+
+    // 每升一层的概率为1/4，层数最多比当前的最高层多1
+    int random_level(){
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        uint64_t bits = seed;
+        int l = 1;
+        while( ( l < SL_MAX_LEVEL ) && ( l <= level ) && ( ( bits & 3 ) == 0 ) ){
+            ++l;
+            bits >>= 2;
+        }
+        return l;
+    }
+
+    // 查找timer在每一层的前驱，结果放在update中
+    void find( const sl_timer* timer, sl_link** update ){
+        sl_link* x = &head;
+        for( int l = level - 1; l >= 0; --l ){
+            while( x->next[l] && before( static_cast< sl_timer* >( x->next[l] ), timer ) ){
+                x = x->next[l];
+            }
+            update[l] = x;
+        }
+    }
+
+    void insert( sl_timer* timer ){
+        timer->seq = seq++;
+        timer->expiring = false;
+        timer->level = random_level();
+        if( timer->level > level ){
+            level = timer->level;
+        }
+        sl_link* update[ SL_MAX_LEVEL ];
+        find( timer, update );
+        for( int l = 0; l < timer->level; ++l ){
+            timer->next[l] = update[l]->next[l];
+            update[l]->next[l] = timer;
+        }
+        timer->prev = update[0];
+        if( timer->next[0] ){
+            timer->next[0]->prev = timer;
+        }
+    }
+
+    void unlink( sl_timer* timer ){
+        sl_link* update[ SL_MAX_LEVEL ];
+        find( timer, update );
+        for( int l = 0; l < timer->level; ++l ){
+            update[l]->next[l] = timer->next[l];
+        }
+        if( timer->next[0] ){
+            timer->next[0]->prev = timer->prev;
+        }
+        timer->prev = NULL;
+        shrink();
+    }
+
+    // 从tick的待执行链表中摘下，只有第0层
+    static void unlink_expiring( sl_timer* timer ){
+        timer->prev->next[0] = timer->next[0];
+        if( timer->next[0] ){
+            timer->next[0]->prev = timer->prev;
+        }
+        timer->prev = timer->next[0] = NULL;
+        timer->expiring = false;
+    }
+
+    // 最高层变空时降低层数
+    void shrink(){
+        while( ( level > 1 ) && !head.next[ level - 1 ] ){
+            --level;
+        }
+    }
+
+    // 已摘下的定时器离开跳表：池中的归还给池
+    void release( sl_timer* timer ){
+        timer->armed = false;
+        timer->expiring = false;
+        --size;
+        if( timer->pooled ){
+            pool.free( timer );
+        }
+    }
+
+private:
+    sl_link head;               //表头哨兵
+    int level;                  //当前的最高层数
+    size_t size;                //定时器的数目，包括tick中待执行的
+    uint64_t seq;               //下一个加入的序号
+    uint64_t seed;              //随机层数的xorshift状态
+    timer_pool< sl_timer > pool;
+};
+
+#endif
@@ -2,149 +2,329 @@
 #define TIME_WHEEL_TIMER
 
 #include <time.h>
+#include <stdint.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include "timer-common.h"
 
-#define BUFFER_SIZE 64
-class tw_timer;
-struct client_data{
-    sockaddr_in address;
-    int sockfd;
-    char buf[BUFFER_SIZE];
-    tw_timer* timer;
+// 时间轮槽中循环链表的链接，槽的哨兵只有链接部分
+struct tw_link{
+    tw_link() : next( NULL ), prev( NULL ){}
+    tw_link* next;
+    tw_link* prev;
 };
 
-class tw_timer{
-public:
-    tw_timer( int rot, int ts ) 
-    : next( NULL ), prev( NULL ), rotation( rot ), time_slot( ts ){}
-
-public:
-    int rotation;   //记录定时器在时间轮旋转多少圈后生效
-    int time_slot;  //记录定时器属于时间轮上的哪个槽
-    void (*cb_func)( client_data* );    //定时器回调函数
-    client_data* user_data; //客户数据
-    tw_timer* next;
-    tw_timer* prev;
+class tw_timer : public timer_base, public tw_link{
 };
 
+/**
+ * @brief 分层时间轮（与Linux内核的定时器轮相同的结构），精度1ms
+ * 第0层256个槽，每槽1ms；第1~4层各64个槽，每槽是下一层转一圈的时间，五层共覆盖2^32ms（约49.7天），更远的期限放在最高层最远的槽中。
+ * 定时器按距离到期的时间放入相应的层，插入和删除都是O(1)；
+ * 第0层每转完一圈，把上一层当前槽中的定时器重新分配（级联）到下层，每个定时器在到期前最多被级联4次，到期处理均摊O(1)。
+ * 每层用位图记录非空的槽，tick一次推进很多毫秒时直接跳过空槽，长时间阻塞在epoll_wait之后也不必逐毫秒推进
+*/
 class time_wheel{
 public:
-    time_wheel() : cur_slot( 0 ){
-        for( int i = 0; i < N; ++i ){
-            slots[i] = NULL;    //初始化每个槽的头节点
+    typedef tw_timer timer_type;
+
+    time_wheel() : size( 0 ){
+        for( int i = 0; i < TVR_SIZE; ++i ){
+            init_slot( &tv1[i] );
+        }
+        for( int l = 0; l < LEVELS; ++l ){
+            for( int i = 0; i < TVN_SIZE; ++i ){
+                init_slot( &tvn[l][i] );
+            }
+            tvn_bitmap[l] = 0;
+        }
+        for( int i = 0; i < TVR_SIZE / 64; ++i ){
+            tv1_bitmap[i] = 0;
         }
+        current = timer_now_ms();
     }
 
     ~time_wheel(){
-        for( int i = 0; i < N; ++i ){
-            tw_timer* tmp = slots[i];
-            while( tmp ){
-                slots[i] = tmp->next;
-                delete tmp;
-                tmp = slots[i];
+        // 调用者的定时器只是摘下，池中的定时器归还给池
+        for( int i = 0; i < TVR_SIZE; ++i ){
+            clear_slot( &tv1[i] );
+        }
+        for( int l = 0; l < LEVELS; ++l ){
+            for( int i = 0; i < TVN_SIZE; ++i ){
+                clear_slot( &tvn[l][i] );
             }
         }
     }
 
-    // 根据定时值创建一个定时器，并将他插入合适的槽中
+    // 从池中取一个定时值（毫秒）后到期的定时器，并将它插入合适的槽中
     tw_timer* add_timer( int timeout ){
         if( timeout < 0 ){
             return NULL;
         }
-        int ticks = 0;
-        // 根据超时值计算在时间轮旋转多少个滴答之后被触发
-        if( timeout < TI ){
-            ticks = 1;
+        tw_timer* timer = pool.alloc();
+        add_timer( timer, timeout );
+        return timer;
+    }
+
+    // 插入调用者的定时器，已在时间轮中的重新设置期限
+    void add_timer( tw_timer* timer, int timeout ){
+        if( !timer ){
+            return;
+        }
+        if( timer->armed ){
+            adjust_timer( timer, timeout );
+            return;
+        }
+        timer->expire = timer_now_ms() + ( timeout < 0 ? 0 : timeout );
+        timer->armed = true;
+        insert( timer );
+        ++size;
+    }
+
+    // 定时任务发生变化时，把定时器改为从现在起timeout毫秒后到期
+    void adjust_timer( tw_timer* timer, int timeout ){
+        if( !timer || !timer->armed ){
+            return;
         }
-        else{
-            ticks = timeout / TI;
+        unlink( timer );
+        timer->expire = timer_now_ms() + ( timeout < 0 ? 0 : timeout );
+        insert( timer );
+    }
+
+    void del_timer( tw_timer* timer ){
+        if( !timer || !timer->armed ){
+            return;
         }
-        // 计算时间轮旋转多少圈后触发
-        int rotation = ticks / N;
-        // 计算待插入的定时器应该被插入到哪个槽中
-        int ts = ( cur_slot + ( ticks % N ) ) % N;
-        tw_timer* timer = new tw_timer( rotation, ts );
-        if( !slots[ts] ){
-            printf( "add timer, rotation is %d, ts is %d, cur_slot is %d\n", rotation, ts, cur_slot );
-            slots[ts] = timer;
+        unlink( timer );
+        release( timer );
+    }
+
+    // 处理到现在为止到期的所有定时器
+    void tick(){
+        tick( timer_now_ms() );
+    }
+
+    // 推进到now（毫秒），一次可以推进任意多个滴答
+    void tick( int64_t now ){
+        while( current <= now ){
+            int index = current & TVR_MASK;
+            // 第0层转完一圈，从上层级联
+            if( index == 0 ){
+                cascade();
+            }
+            // 在第0层本圈剩余的、不晚于now的槽中找下一个非空槽，中间的空槽直接跳过
+            int64_t last = now - current;
+            int limit = ( last < TVR_SIZE - 1 - index ) ? index + ( int )last : TVR_SIZE - 1;
+            int next = find_slot( index, limit );
+            if( next < 0 ){
+                current += limit - index + 1;
+                continue;
+            }
+            // 先推进current，回调中新加入的已到期定时器放在下一个槽，不会因为当前槽已处理而等上一整圈
+            current += next - index + 1;
+            expire_slot( &tv1[ next ], next );
         }
-        else{
-            timer->next = slots[ts];
-            slots[ts]->prev = timer;
-            slots[ts] = timer;
+    }
+
+    // 距离下一次需要调用tick的毫秒数，供epoll_wait作为超时值；没有定时器时返回-1。
+    // 第0层本圈内没有定时器时返回到本圈结束（下一次级联）的时间，结果不会晚于最早的定时器
+    int next_timeout() const{
+        if( size == 0 ){
+            return -1;
         }
-        return timer;
+        int index = current & TVR_MASK;
+        int next = find_slot( index, TVR_SIZE - 1 );
+        int64_t when = current + ( ( next < 0 ) ? TVR_SIZE - index : next - index );
+        int64_t left = when - timer_now_ms();
+        return ( left < 0 ) ? 0 : ( int )left;
     }
 
-    void del_timer( tw_timer* timer ){   
-        if( !timer ){
+    // 时间轮中定时器的数目
+    size_t timer_count() const{
+        return size;
+    }
+
+private:
+    // 第0层的槽数及其位数
+    static const int TVR_BITS = 8;
+    static const int TVR_SIZE = 1 << TVR_BITS;
+    static const int TVR_MASK = TVR_SIZE - 1;
+    // 第1~4层的槽数及其位数
+    static const int TVN_BITS = 6;
+    static const int TVN_SIZE = 1 << TVN_BITS;
+    static const int TVN_MASK = TVN_SIZE - 1;
+    static const int LEVELS = 4;
+
+    // 第level层（1~4）第index个槽在current时间下覆盖的最低位
+    static int shift( int level ){
+        return TVR_BITS + ( level - 1 ) * TVN_BITS;
+    }
+
+    static void init_slot( tw_link* head ){
+        head->next = head->prev = head;
+    }
+    void clear_slot( tw_link* head ){
+        while( head->next != head ){
+            tw_timer* tmp = static_cast< tw_timer* >( head->next );
+            head->next = tmp->next;
+            tmp->next = tmp->prev = NULL;
+            release( tmp );
+        }
+        head->prev = head;
+    }
+
+    // 已摘下的定时器离开时间轮：池中的归还给池
+    void release( tw_timer* timer ){
+        timer->armed = false;
+        --size;
+        if( timer->pooled ){
+            pool.free( timer );
+        }
+    }
+
+    void link( tw_link* head, tw_timer* timer ){
+        timer->prev = head->prev;
+        timer->next = head;
+        head->prev->next = timer;
+        head->prev = timer;
+    }
+
+    // 从所在的槽中摘下，槽变空时清除位图中对应的位
+    void unlink( tw_timer* timer ){
+        tw_link* next = timer->next;
+        timer->prev->next = next;
+        next->prev = timer->prev;
+        timer->next = timer->prev = NULL;
+        // 槽中只剩哨兵时，哨兵的next指向自己
+        if( next->next == next ){
+            clear_bit( next );
+        }
+    }
+
+    // 哨兵对应的位图位置
+    void clear_bit( tw_link* head ){
+        if( ( head >= tv1 ) && ( head < tv1 + TVR_SIZE ) ){
+            int index = head - tv1;
+            tv1_bitmap[ index >> 6 ] &= ~( 1ULL << ( index & 63 ) );
             return;
         }
-        int ts = timer->time_slot;
-        if( timer == slots[ts] ){
-            slots[ts] = slots[ts]->next;
-            if( slots[ts] ){
-                slots[ts]->prev = NULL;
+        for( int l = 0; l < LEVELS; ++l ){
+            if( ( head >= tvn[l] ) && ( head < tvn[l] + TVN_SIZE ) ){
+                tvn_bitmap[l] &= ~( 1ULL << ( head - tvn[l] ) );
+                return;
             }
-            delete timer;
         }
-        else{
-            timer->prev->next = timer->next;
-            if( timer->next ){
-                timer->next->prev = timer->prev;
+    }
+
+    // 按距离到期的时间放入相应的层。已经过期的放入第0层的当前槽，在下一次tick时处理
+    void insert( tw_timer* timer ){
+        int64_t expire = timer->expire;
+        int64_t idx = expire - current;
+        if( idx < 0 ){
+            expire = current;
+            idx = 0;
+        }
+        if( idx < TVR_SIZE ){
+            int i = expire & TVR_MASK;
+            link( &tv1[i], timer );
+            tv1_bitmap[ i >> 6 ] |= 1ULL << ( i & 63 );
+            return;
+        }
+        int level = 1;
+        while( ( level < LEVELS ) && ( idx >= ( 1LL << shift( level + 1 ) ) ) ){
+            ++level;
+        }
+        // 超出最高层范围的期限放在最高层最远的槽中，级联时再重新放置
+        if( idx >= ( 1LL << ( shift( LEVELS ) + TVN_BITS ) ) ){
+            expire = current + ( 1LL << ( shift( LEVELS ) + TVN_BITS ) ) - 1;
+        }
+        int i = ( expire >> shift( level ) ) & TVN_MASK;
+        link( &tvn[ level - 1 ][i], timer );
+        tvn_bitmap[ level - 1 ] |= 1ULL << i;
+    }
+
+    // 第0层从头开始新的一圈：把第1层当前槽中的定时器重新分配到第0层，第1层也转完一圈时再从第2层级联，依此类推
+    void cascade(){
+        for( int l = 1; l <= LEVELS; ++l ){
+            int index = ( current >> shift( l ) ) & TVN_MASK;
+            tw_link* head = &tvn[ l - 1 ][ index ];
+            if( head->next != head ){
+                tw_link pending;
+                splice( head, &pending );
+                tvn_bitmap[ l - 1 ] &= ~( 1ULL << index );
+                while( pending.next != &pending ){
+                    tw_timer* timer = static_cast< tw_timer* >( pending.next );
+                    pending.next = timer->next;
+                    timer->next->prev = &pending;
+                    insert( timer );
+                }
+            }
+            if( index != 0 ){
+                break;
             }
-            delete timer;
         }
     }
 
-    //SI时间到后，调用该函数，时间轮向前滚动一个槽的间隔
-    void tick(){
-        tw_timer* tmp = slots[cur_slot];
-        printf( "current slot is %d\n", cur_slot );
-        while( tmp ){
-            printf( "tick the timer once\n" );
-            // 定时器在这一轮不起作用
-            if( tmp->rotation > 0 ){
-                tmp->rotation--;
-                tmp = tmp->next;
+    // 执行第0层第index个槽中的定时器。先把整个槽移到临时链表中，回调中可以添加、调整或删除其他定时器，
+    // 也可以重新加入正在执行的定时器；没有重新加入的池中定时器在回调返回后归还给池
+    void expire_slot( tw_link* head, int index ){
+        tw_link pending;
+        splice( head, &pending );
+        tv1_bitmap[ index >> 6 ] &= ~( 1ULL << ( index & 63 ) );
+        while( pending.next != &pending ){
+            tw_timer* timer = static_cast< tw_timer* >( pending.next );
+            pending.next = timer->next;
+            timer->next->prev = &pending;
+            timer->next = timer->prev = NULL;
+            timer->armed = false;
+            --size;
+            if( timer->callback ){
+                timer->callback();
             }
-            //定时器到期，执行任务，并删除该定时器
-            else{
-                tmp->cb_func( tmp->user_data );
-                if( tmp == slots[cur_slot] ){
-                    printf( "delete header in cur_slot\n" );
-                    slots[cur_slot] = tmp->next;
-                    delete tmp;
-                    if( slots[cur_slot] ){
-                        slots[cur_slot]->prev = NULL;
-                    }
-                    tmp = slots[cur_slot];
-                }
-                else{
-                    tmp->prev->next = tmp->next;
-                    if( tmp->next ){
-                        tmp->next->prev = tmp->prev;
-                    }
-                    tw_timer* tmp2 = tmp->next;
-                    delete tmp;
-                    tmp = tmp2;
-                }
+            if( timer->pooled && !timer->armed ){
+                pool.free( timer );
+            }
+        }
+    }
+
+    // 把head槽中的所有定时器移到空的to链表中
+    static void splice( tw_link* head, tw_link* to ){
+        if( head->next == head ){
+            init_slot( to );
+            return;
+        }
+        to->next = head->next;
+        to->prev = head->prev;
+        to->next->prev = to;
+        to->prev->next = to;
+        init_slot( head );
+    }
+
+    // 在第0层[from, to]范围内查找第一个非空槽，没有则返回-1
+    int find_slot( int from, int to ) const{
+        for( int word = from >> 6; word <= ( to >> 6 ); ++word ){
+            uint64_t bits = tv1_bitmap[ word ];
+            if( word == ( from >> 6 ) ){
+                bits &= ~0ULL << ( from & 63 );
+            }
+            if( word == ( to >> 6 ) && ( ( to & 63 ) != 63 ) ){
+                bits &= ( 1ULL << ( ( to & 63 ) + 1 ) ) - 1;
+            }
+            if( bits ){
+                return ( word << 6 ) + __builtin_ctzll( bits );
             }
         }
-        // 更新时间轮的当前槽，以反映时间轮的转动
-        cur_slot = ++cur_slot % N;
+        return -1;
     }
 
 private:
-    //槽的数目
-    static const int N = 60;
-    //没1s时间轮转动一次，即槽间隔为1s
-    static const int TI = 1; 
-    //时间轮的槽，指向定时器链表
-    tw_timer* slots[N];
-    //时间轮的当前槽
-    int cur_slot;
+    tw_link tv1[ TVR_SIZE ];                    //第0层的槽，每个槽是带哨兵的循环链表
+    tw_link tvn[ LEVELS ][ TVN_SIZE ];          //第1~4层的槽
+    uint64_t tv1_bitmap[ TVR_SIZE / 64 ];       //第0层非空槽的位图
+    uint64_t tvn_bitmap[ LEVELS ];              //第1~4层非空槽的位图
+    int64_t current;                            //下一个要处理的毫秒
+    size_t size;                                //定时器的数目
+    timer_pool< tw_timer > pool;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,173 @@
+#ifndef TIMER_COMMON_H
+#define TIMER_COMMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+/**
+ * 定时器容器的公共接口，sort_timer_lst（升序链表）、skip_list_timer（跳表）、time_heap（最小堆）和time_wheel（分层时间轮）都提供：
+ *   typedef ... timer_type                             定时器类型，派生自timer_base
+ *   timer_type* add_timer( int timeout )               从容器的timer_pool中取一个定时器，timeout毫秒后到期，由调用者用set_callback设置回调
+ *   void add_timer( timer_type* timer, int timeout )   加入调用者自己的定时器（通常嵌入在连接对象中），已在容器中的则重新设置期限
+ *   void adjust_timer( timer_type* timer, int timeout )  把定时器改为从现在起timeout毫秒后到期，延长或提前都可以
+ *   void del_timer( timer_type* timer )                从容器中删除定时器，池中的定时器归还给池，调用者的定时器只是摘下
+ *   void tick()                                        执行所有已到期的定时器，执行后池中的定时器归还给池
+ *   int next_timeout() const                           距离下一次需要调用tick的毫秒数，可作为epoll_wait的超时值，没有定时器时返回-1
+ *   size_t timer_count() const                         容器中定时器的数目
+ * 所有时间都是CLOCK_MONOTONIC毫秒，不受系统时间调整的影响。
+ * 两种定时器都不需要为每个定时器分配内存：嵌入式的由调用者提供，池中的按块分配后反复使用。
+ * 回调中可以添加、调整和删除其他定时器，也可以重新加入正在执行的定时器，但不能在回调中替换它的回调
+*/
+
+// 定时器回调对象的最大大小：足够存放一个捕获了两三个指针或整数的lambda
+#define TIMER_CALLBACK_SIZE ( 3 * sizeof( void* ) )
+
+/**
+ * @brief 小缓冲区可调用对象：把不超过SIZE字节的函数对象（函数指针、lambda、仿函数）原地存放在对象内，从不分配内存。
+ * 放不下的函数对象在编译时报错
+*/
+template< size_t SIZE >
+class small_callback{
+public:
+    small_callback() : m_invoke( NULL ), m_destroy( NULL ){}
+    ~small_callback(){
+        reset();
+    }
+    small_callback( const small_callback& ) = delete;
+    small_callback& operator=( const small_callback& ) = delete;
+
+    template< typename F >
+    void assign( F f ){
+        static_assert( sizeof( F ) <= SIZE, "callable is too large for the timer callback buffer" );
+        static_assert( alignof( F ) <= alignof( void* ), "callable is over-aligned for the timer callback buffer" );
+        reset();
+        new ( m_buffer ) F( std::move( f ) );
+        m_invoke = &invoke< F >;
+        m_destroy = std::is_trivially_destructible< F >::value ? NULL : &destroy< F >;
+    }
+
+    void reset(){
+        if( m_destroy ){
+            m_destroy( m_buffer );
+        }
+        m_invoke = NULL;
+        m_destroy = NULL;
+    }
+
+    void operator()(){
+        m_invoke( m_buffer );
+    }
+
+    explicit operator bool() const{
+        return m_invoke != NULL;
+    }
+
+private:
+    template< typename F >
+    static void invoke( void* f ){
+        ( *( F* )f )();
+    }
+    template< typename F >
+    static void destroy( void* f ){
+        ( ( F* )f )->~F();
+    }
+
+private:
+    alignas( void* ) unsigned char m_buffer[ SIZE ];
+    void ( *m_invoke )( void* );
+    void ( *m_destroy )( void* );
+};
+
+typedef small_callback< TIMER_CALLBACK_SIZE > timer_callback;
+
+/**
+ * @brief 各种定时器的公共部分
+*/
+struct timer_base{
+    timer_base() : expire( 0 ), armed( false ), pooled( false ){}
+
+    // 设置到期时执行的函数对象，签名为void()
+    template< typename F >
+    void set_callback( F f ){
+        callback.assign( std::move( f ) );
+    }
+
+    int64_t expire;                     //定时器到期的绝对时间，CLOCK_MONOTONIC毫秒
+    timer_callback callback;            //定时器回调
+    bool armed;                         //是否在容器中
+    bool pooled;                        //是否从容器的timer_pool中分配
+};
+
+/**
+ * @brief 定时器的块分配器
+ * 一次分配SLAB_SIZE个定时器的内存，释放的定时器串在空闲链表上供下次使用，内存直到池销毁才归还。
+ * 只由拥有它的容器使用，不是线程安全的
+*/
+template< typename T >
+class timer_pool{
+public:
+    static const size_t SLAB_SIZE = 256;
+
+    timer_pool() : m_free( NULL ), m_slabs( NULL ), m_used( SLAB_SIZE ){}
+    ~timer_pool(){
+        while( m_slabs ){
+            slab* next = m_slabs->next;
+            delete m_slabs;
+            m_slabs = next;
+        }
+    }
+    timer_pool( const timer_pool& ) = delete;
+    timer_pool& operator=( const timer_pool& ) = delete;
+
+    T* alloc(){
+        void* p = NULL;
+        if( m_free ){
+            p = m_free;
+            m_free = m_free->next;
+        }
+        else{
+            if( m_used == SLAB_SIZE ){
+                slab* s = new slab;
+                s->next = m_slabs;
+                m_slabs = s;
+                m_used = 0;
+            }
+            p = m_slabs->timers + m_used++ * sizeof( T );
+        }
+        T* timer = new ( p ) T;
+        timer->pooled = true;
+        return timer;
+    }
+
+    void free( T* timer ){
+        timer->~T();
+        free_node* node = ( free_node* )( void* )timer;
+        node->next = m_free;
+        m_free = node;
+    }
+
+private:
+    struct free_node{
+        free_node* next;
+    };
+    struct slab{
+        slab* next;
+        alignas( T ) unsigned char timers[ SLAB_SIZE * sizeof( T ) ];
+    };
+
+    free_node* m_free;          //空闲链表
+    slab* m_slabs;              //已分配的块，最新的在前
+    size_t m_used;              //最新的块中已经切分出去的定时器数目
+};
+
+inline int64_t timer_now_ms(){
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( int64_t )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#endif
@@ -0,0 +1,77 @@
+#include "buffer_pool.h"
+
+#include <stdlib.h>
+
+buffer_pool* buffer_pool::instance(){
+    static buffer_pool pool;
+    return &pool;
+}
+
+buffer_pool::buffer_pool(){
+    for( int i = 0; i < CLASS_NUMBER; ++i ){
+        m_classes[i].head = NULL;
+        m_classes[i].cached = 0;
+    }
+}
+
+buffer_pool::~buffer_pool(){
+    for( int i = 0; i < CLASS_NUMBER; ++i ){
+        free_block* block = m_classes[i].head;
+        while( block ){
+            free_block* next = block->next;
+            ::free( block );
+            block = next;
+        }
+    }
+}
+
+// 返回能容纳size字节的最小一级，超过最大一级时返回-1
+int buffer_pool::class_of( size_t size ){
+    size_t block_size = MIN_BLOCK_SIZE;
+    for( int i = 0; i < CLASS_NUMBER; ++i, block_size <<= 1 ){
+        if( size <= block_size ){
+            return i;
+        }
+    }
+    return -1;
+}
+
+char* buffer_pool::alloc( size_t size, size_t* real_size ){
+    int idx = class_of( size );
+    if( idx < 0 ){
+        return NULL;
+    }
+    *real_size = MIN_BLOCK_SIZE << idx;
+
+    size_class& sc = m_classes[idx];
+    sc.lock.lock();
+    free_block* block = sc.head;
+    if( block ){
+        sc.head = block->next;
+        --sc.cached;
+    }
+    sc.lock.unlock();
+    if( block ){
+        return ( char* )block;
+    }
+    return ( char* )malloc( *real_size );
+}
+
+void buffer_pool::free( char* block, size_t size ){
+    if( ! block ){
+        return;
+    }
+    size_class& sc = m_classes[ class_of( size ) ];
+    sc.lock.lock();
+    if( sc.cached < MAX_CACHED_BLOCKS ){
+        free_block* node = ( free_block* )block;
+        node->next = sc.head;
+        sc.head = node;
+        ++sc.cached;
+        block = NULL;
+    }
+    sc.lock.unlock();
+    if( block ){
+        ::free( block );
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include "locker.h"
+
+/**
+ * @brief 按大小分级的缓冲区池
+ * 连接只在有请求处理或响应发送时才借用读写缓冲区，空闲时归还，因此空闲的keep-alive连接不占用缓冲区内存。
+ * 每一级维护一个空闲链表，归还的缓冲区留在链表中供下次借用，超过上限的部分才真正释放
+*/
+class buffer_pool{
+public:
+    // 最小一级缓冲区的大小，之后每一级翻倍
+    static const size_t MIN_BLOCK_SIZE = 1024;
+    // 级数，最大一级为MIN_BLOCK_SIZE << ( CLASS_NUMBER - 1 )，即64KB
+    static const int CLASS_NUMBER = 7;
+    // 每一级最多缓存的空闲缓冲区数量
+    static const size_t MAX_CACHED_BLOCKS = 4096;
+
+public:
+    static buffer_pool* instance();
+
+    /**
+     * @brief 借用一个至少size字节的缓冲区
+     * @param real_size 返回缓冲区的实际大小（所在级的大小），归还时需传回
+     * @return 缓冲区地址，size超过最大一级或内存不足时返回NULL
+    */
+    char* alloc( size_t size, size_t* real_size );
+    // 归还alloc得到的缓冲区，size为alloc返回的实际大小
+    void free( char* block, size_t size );
+    // 可以借用的最大缓冲区大小
+    static size_t max_size(){ return MIN_BLOCK_SIZE << ( CLASS_NUMBER - 1 ); }
+
+private:
+    buffer_pool();
+    ~buffer_pool();
+    static int class_of( size_t size );
+
+private:
+    struct free_block{
+        free_block* next;
+    };
+    struct size_class{
+        locker lock;
+        free_block* head;
+        size_t cached;
+    };
+    size_class m_classes[ CLASS_NUMBER ];
+};
+
+#endif
@@ -0,0 +1,316 @@
+#ifndef CONN_TIMER_H
+#define CONN_TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <atomic>
+
+/**
+ * @brief 反应堆线程的连接定时器：单层时间轮，由事件循环的epoll_wait超时驱动
+ * 定时器节点嵌入在连接对象中（侵入式双向链表），插入和删除都是O(1)，不分配内存；到期时只处理当前槽，不扫描所有连接。
+ * 每个反应堆线程拥有自己的时间轮，只有拥有者线程操作它，没有全局的定时器锁。
+ * 超过时间轮一圈的期限先放在最远的槽中，到时再重新放置。
+ * 其他线程（线程池的工作线程）通过arm和cancel把请求投递到无锁的MPSC邮箱中：请求记录在节点上，同一节点的多次请求合并为最后一次，
+ * 节点只入队一次；邮箱由空变为非空时写eventfd唤醒拥有者，拥有者在下一个tick中取走整个邮箱并执行请求。
+ *
+ * 每个定时器可以带一个容忍窗口（slack），在[expire, expire + slack]内任何时刻处理都可以。
+ * next_timeout把窗口相交的一批定时器合并为一次唤醒，事件循环被I/O事件唤醒时也会顺便处理已到期的定时器。
+ * 没有定时器时epoll_wait无限期等待，空闲的服务器不会被周期性唤醒
+*/
+class conn_timer{
+public:
+    // 每个槽的时间跨度（毫秒）
+    static const int TICK_MS = 100;
+    // 槽的数目，一圈约51秒
+    static const int SLOT_NUMBER = 512;
+
+    // 其他线程投递的请求
+    enum REQUEST { REQ_NONE = 0, REQ_ARM, REQ_CANCEL };
+
+    struct node{
+        node* prev;
+        node* next;
+        int64_t expire;                 // 到期时间，CLOCK_MONOTONIC毫秒
+        int slack;                      // 可以推迟处理的毫秒数
+        void* data;
+        node* mail_next;                // 邮箱中的下一个节点
+        std::atomic< bool > queued;     // 是否已在邮箱中
+        std::atomic< int > request;     // 最后一次投递的请求
+        std::atomic< int64_t > req_expire;  // REQ_ARM请求的期限和容忍窗口
+        std::atomic< int > req_slack;
+        node() : prev( NULL ), next( NULL ), expire( 0 ), slack( 0 ), data( NULL ), mail_next( NULL ), queued( false ),
+                request( REQ_NONE ), req_expire( 0 ), req_slack( 0 ){}
+    };
+    // 到期时的回调，回调中可以重新add该节点
+    typedef void ( *callback )( node* timer, void* arg );
+
+    // 合并唤醒的统计
+    struct stats{
+        uint64_t wakeups;               // 处理了到期定时器的tick次数
+        uint64_t expired;               // 到期的定时器数
+        uint64_t wakeups_saved;         // 每次tick中多处理的非空槽数之和，不合并时每个槽都需要单独唤醒一次
+    };
+
+public:
+    conn_timer() : m_callback( NULL ), m_arg( NULL ), m_count( 0 ), m_wakeupfd( -1 ), m_mailbox( NULL ){
+        for( int i = 0; i < SLOT_NUMBER; ++i ){
+            m_slots[i].prev = m_slots[i].next = &m_slots[i];
+        }
+        memset( m_bitmap, 0, sizeof( m_bitmap ) );
+        memset( m_latest, 0, sizeof( m_latest ) );
+        memset( &m_stats, 0, sizeof( m_stats ) );
+        m_tick = now_ms() / TICK_MS;
+        m_owner = pthread_self();
+    }
+
+    ~conn_timer(){
+        if( m_wakeupfd != -1 ){
+            close( m_wakeupfd );
+        }
+    }
+
+    /**
+     * @return 唤醒拥有者的eventfd，由反应堆注册到epoll中，可读时调用clear_wakeup；失败返回-1
+    */
+    int init( callback cb, void* arg ){
+        m_callback = cb;
+        m_arg = arg;
+        m_wakeupfd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        return m_wakeupfd;
+    }
+    // 将调用线程设为拥有者，反应堆线程启动时调用
+    void set_owner(){ m_owner = pthread_self(); }
+    bool owned() const { return pthread_equal( m_owner, pthread_self() ); }
+
+    static int64_t now_ms(){
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+        return ( int64_t )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    static bool linked( const node* timer ){ return timer->next != NULL; }
+
+    int wakeup_fd() const { return m_wakeupfd; }
+    // 读走eventfd的计数，邮箱中的请求由随后的tick处理
+    void clear_wakeup(){
+        uint64_t count;
+        while( read( m_wakeupfd, &count, sizeof( count ) ) > 0 ){}
+    }
+
+    // 任意线程调用：让节点在expire到期。拥有者直接操作时间轮，并使邮箱中该节点尚未执行的请求作废；其他线程投递到邮箱
+    void arm( node* timer, int64_t expire, int slack = 0 ){
+        if( owned() ){
+            timer->request.store( REQ_NONE, std::memory_order_relaxed );
+            add( timer, expire, slack );
+            return;
+        }
+        timer->req_expire.store( expire, std::memory_order_relaxed );
+        timer->req_slack.store( slack, std::memory_order_relaxed );
+        post( timer, REQ_ARM );
+    }
+
+    // 任意线程调用：把节点从时间轮中移除
+    void cancel( node* timer ){
+        if( owned() ){
+            timer->request.store( REQ_NONE, std::memory_order_relaxed );
+            remove( timer );
+            return;
+        }
+        post( timer, REQ_CANCEL );
+    }
+
+    // 以下只能由拥有者调用。插入定时器，已在时间轮中的先移除
+    void add( node* timer, int64_t expire, int slack = 0 ){
+        if( linked( timer ) ){
+            unlink( timer );
+        }
+        timer->expire = expire;
+        timer->slack = slack;
+        int64_t tick = expire / TICK_MS;
+        // 当前槽已经处理过，最早放到下一个槽；超过一圈的放到最远的槽
+        if( tick <= m_tick ){
+            tick = m_tick + 1;
+        }
+        else if( tick > m_tick + SLOT_NUMBER - 1 ){
+            tick = m_tick + SLOT_NUMBER - 1;
+        }
+        int index = tick & ( SLOT_NUMBER - 1 );
+        int64_t latest = expire + ( ( slack > 0 ) ? slack : 0 );
+        if( ! ( m_bitmap[ index >> 6 ] & ( 1ULL << ( index & 63 ) ) ) || ( latest < m_latest[ index ] ) ){
+            m_latest[ index ] = latest;
+        }
+        node* head = &m_slots[ index ];
+        timer->next = head->next;
+        timer->prev = head;
+        head->next->prev = timer;
+        head->next = timer;
+        m_bitmap[ index >> 6 ] |= 1ULL << ( index & 63 );
+        ++m_count;
+    }
+
+    void remove( node* timer ){
+        if( linked( timer ) ){
+            unlink( timer );
+        }
+    }
+
+    // 执行邮箱中的请求，再处理now之前的所有槽，长时间没有调用时一圈最多处理一次。每轮事件循环都可以调用
+    void tick( int64_t now ){
+        node* mail = m_mailbox.exchange( NULL, std::memory_order_acquire );
+        while( mail ){
+            node* timer = mail;
+            mail = timer->mail_next;
+            // 先出队再取请求，之后投递的请求会让节点重新入队
+            timer->queued.store( false, std::memory_order_seq_cst );
+            int request = timer->request.exchange( REQ_NONE, std::memory_order_acquire );
+            if( request == REQ_ARM ){
+                add( timer, timer->req_expire.load( std::memory_order_relaxed ), timer->req_slack.load( std::memory_order_relaxed ) );
+            }
+            else if( request == REQ_CANCEL ){
+                remove( timer );
+            }
+        }
+
+        int64_t target = now / TICK_MS;
+        int64_t steps = target - m_tick;
+        if( steps > SLOT_NUMBER ){
+            steps = SLOT_NUMBER;
+        }
+        int slots = 0;
+        for( int64_t i = 0; i < steps; ++i ){
+            // 先推进当前时间，回调中重新加入的定时器最早落在下一个槽，不会在本轮被再次处理
+            ++m_tick;
+            int index = m_tick & ( SLOT_NUMBER - 1 );
+            if( ! ( m_bitmap[ index >> 6 ] & ( 1ULL << ( index & 63 ) ) ) ){
+                continue;
+            }
+            node* head = &m_slots[ index ];
+            m_bitmap[ index >> 6 ] &= ~( 1ULL << ( index & 63 ) );
+            node pending;
+            pending.next = head->next;
+            pending.prev = head->prev;
+            pending.next->prev = &pending;
+            pending.prev->next = &pending;
+            head->prev = head->next = head;
+            bool fired = false;
+            while( pending.next != &pending ){
+                node* timer = pending.next;
+                unlink( timer );
+                if( timer->expire <= now ){
+                    fired = true;
+                    ++m_stats.expired;
+                    m_callback( timer, m_arg );
+                }
+                else{
+                    // 放在最远槽中的长期限，或同一槽中稍晚到期的定时器
+                    add( timer, timer->expire, timer->slack );
+                }
+            }
+            slots += fired;
+        }
+        m_tick = target;
+        if( slots > 0 ){
+            ++m_stats.wakeups;
+            m_stats.wakeups_saved += slots - 1;
+        }
+    }
+
+    /**
+     * 事件循环调用epoll_wait的超时值（毫秒），没有定时器时返回-1。
+     * 从最早的非空槽开始，把最早处理时间不晚于当前唤醒时间的定时器依次并入这一批，唤醒时间取它们窗口上限中最早的一个，
+     * 这样这一批定时器都在各自的窗口内由同一次唤醒处理。
+     * 槽中的定时器最早在推进到该槽时处理，所以一个槽的窗口上限就是槽中最小的expire + slack与槽起始时间中较晚的一个，
+     * 只读位图和add维护的m_latest，不遍历槽中的定时器
+    */
+    int next_timeout() const{
+        int64_t now = now_ms();
+        int64_t wake = INT64_MAX;
+        for( int64_t tick = m_tick + 1; tick < m_tick + SLOT_NUMBER; ++tick ){
+            int index = tick & ( SLOT_NUMBER - 1 );
+            uint64_t bits = m_bitmap[ index >> 6 ] >> ( index & 63 );
+            // 跳过空槽：本字中剩余的位都为0时跳到下一个字，否则跳到下一个非空槽
+            if( ! bits ){
+                tick += 63 - ( index & 63 );
+                continue;
+            }
+            if( ! ( bits & 1 ) ){
+                tick += __builtin_ctzll( bits ) - 1;
+                continue;
+            }
+            // 这个槽最早的处理时间已经晚于唤醒时间，后面的槽更晚
+            if( tick * TICK_MS > wake ){
+                break;
+            }
+            int64_t latest = ( m_latest[ index ] > tick * TICK_MS ) ? m_latest[ index ] : tick * TICK_MS;
+            if( latest < wake ){
+                wake = latest;
+            }
+        }
+        if( m_mailbox.load( std::memory_order_relaxed ) ){
+            wake = now;
+        }
+        if( wake == INT64_MAX ){
+            return -1;
+        }
+        return ( wake <= now ) ? 0 : ( int )( wake - now );
+    }
+
+    // 时间轮中定时器的数量
+    size_t size() const { return m_count; }
+
+    const stats& get_stats() const { return m_stats; }
+
+private:
+    // 记录请求并把节点压入邮箱（无锁栈，拥有者一次取走整个链表，不存在ABA问题），已在邮箱中的节点不重复入队。
+    // 邮箱原来为空时拥有者可能正阻塞在epoll_wait中，写eventfd唤醒它；非空时已经有人唤醒过
+    void post( node* timer, int request ){
+        timer->request.store( request, std::memory_order_release );
+        if( timer->queued.exchange( true, std::memory_order_seq_cst ) ){
+            return;
+        }
+        node* head = m_mailbox.load( std::memory_order_relaxed );
+        do{
+            timer->mail_next = head;
+        }while( ! m_mailbox.compare_exchange_weak( head, timer, std::memory_order_release, std::memory_order_relaxed ) );
+        if( ! head ){
+            uint64_t one = 1;
+            ssize_t ret = write( m_wakeupfd, &one, sizeof( one ) );
+            ( void )ret;
+        }
+    }
+
+    void unlink( node* timer ){
+        node* next = timer->next;
+        timer->prev->next = next;
+        next->prev = timer->prev;
+        timer->prev = timer->next = NULL;
+        --m_count;
+        // 槽变空时清除位图，哨兵的next指向自己
+        if( ( next->next == next ) && ( next >= m_slots ) && ( next < m_slots + SLOT_NUMBER ) ){
+            int index = next - m_slots;
+            m_bitmap[ index >> 6 ] &= ~( 1ULL << ( index & 63 ) );
+        }
+    }
+
+private:
+    callback m_callback;
+    void* m_arg;
+    node m_slots[ SLOT_NUMBER ];        // 每个槽是一个带哨兵的循环链表
+    uint64_t m_bitmap[ SLOT_NUMBER / 64 ];  // 非空槽的位图
+    // 非空槽中定时器expire + slack的最小值，槽由空变为非空时重置。移除定时器时不更新，最多让唤醒提前，
+    // tick处理该槽时未到期的定时器会重新add到后面的槽中，最小值随之重新计算
+    int64_t m_latest[ SLOT_NUMBER ];
+    int64_t m_tick;                     // 已经处理到的槽对应的时间（以TICK_MS为单位）
+    size_t m_count;
+    stats m_stats;
+    pthread_t m_owner;
+    int m_wakeupfd;                     // 邮箱由空变为非空时唤醒拥有者
+    std::atomic< node* > m_mailbox;     // 其他线程投递了请求的节点
+};
+
+#endif
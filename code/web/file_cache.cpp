@@ -0,0 +1,230 @@
+#include "file_cache.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include "response_cache.h"
+
+// 会使缓存内容过期的inotify事件
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+                                 | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+file_cache* file_cache::instance(){
+    static file_cache cache;
+    return &cache;
+}
+
+file_cache::file_cache() : m_inotify_fd( -1 ){}
+
+file_cache::~file_cache(){
+    m_lock.lock();
+    invalidate_all();
+    m_lock.unlock();
+    if( m_inotify_fd != -1 ){
+        close( m_inotify_fd );
+    }
+}
+
+int file_cache::init( const char* root ){
+    m_inotify_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    if( m_inotify_fd < 0 ){
+        return -1;
+    }
+    m_root = root;
+    add_watch( root );
+    return m_inotify_fd;
+}
+
+// 监视目录dir，并递归监视其子目录（inotify本身不递归）
+void file_cache::add_watch( const std::string& dir ){
+    int wd = inotify_add_watch( m_inotify_fd, dir.c_str(), WATCH_MASK | IN_ONLYDIR );
+    if( wd < 0 ){
+        return;
+    }
+    m_watches[ wd ] = dir;
+
+    DIR* dp = opendir( dir.c_str() );
+    if( ! dp ){
+        return;
+    }
+    struct dirent* entry;
+    while( ( entry = readdir( dp ) ) != NULL ){
+        if( ( entry->d_type != DT_DIR ) || ( strcmp( entry->d_name, "." ) == 0 ) || ( strcmp( entry->d_name, ".." ) == 0 ) ){
+            continue;
+        }
+        add_watch( dir + "/" + entry->d_name );
+    }
+    closedir( dp );
+}
+
+void file_cache::handle_events(){
+    char buf[ 4096 ] __attribute__( ( aligned( __alignof__( struct inotify_event ) ) ) );
+    while( true ){
+        ssize_t len = ::read( m_inotify_fd, buf, sizeof( buf ) );
+        if( len <= 0 ){
+            break;
+        }
+
+        m_lock.lock();
+        for( char* ptr = buf; ptr < buf + len; ){
+            const struct inotify_event* event = ( const struct inotify_event* )ptr;
+            ptr += sizeof( struct inotify_event ) + event->len;
+
+            // 事件队列溢出，无法得知哪些文件发生了变化
+            if( event->mask & IN_Q_OVERFLOW ){
+                invalidate_all();
+                response_cache::instance()->invalidate_all();
+                continue;
+            }
+            std::unordered_map< int, std::string >::iterator it = m_watches.find( event->wd );
+            if( it == m_watches.end() ){
+                continue;
+            }
+            // 被监视的目录自身被删除或移走，目录下所有文件的路径都已失效
+            if( event->mask & ( IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED ) ){
+                if( event->mask & IN_IGNORED ){
+                    m_watches.erase( it );
+                }
+                invalidate_all();
+                response_cache::instance()->invalidate_all();
+                continue;
+            }
+            if( event->len == 0 ){
+                continue;
+            }
+
+            std::string path = it->second + "/" + event->name;
+            if( ( event->mask & IN_ISDIR ) && ( event->mask & ( IN_CREATE | IN_MOVED_TO ) ) ){
+                add_watch( path );
+            }
+            invalidate( path );
+            // 完整响应以URL为键：文件的变化使其URL的响应失效；目录的变化涉及其下所有URL，全部失效
+            if( event->mask & IN_ISDIR ){
+                response_cache::instance()->invalidate_all();
+            }
+            else if( path.compare( 0, m_root.size(), m_root ) == 0 ){
+                response_cache::instance()->invalidate( path.c_str() + m_root.size() );
+            }
+        }
+        m_lock.unlock();
+    }
+}
+
+cached_file* file_cache::acquire( const char* path ){
+    std::string key( path );
+    m_lock.lock();
+    std::unordered_map< std::string, cached_file* >::iterator it = m_files.find( key );
+    if( it != m_files.end() ){
+        cached_file* file = it->second;
+        ++file->refs;
+        // 同一路径的并发未命中合并为一次加载：等待正在加载的线程完成
+        while( file->loading ){
+            m_loaded.wait( m_lock.get() );
+        }
+        m_lock.unlock();
+        return file;
+    }
+
+    if( m_files.size() >= MAX_FILES ){
+        shrink();
+    }
+    cached_file* file = new cached_file;
+    file->path = key;
+    file->err = 0;
+    file->fd = -1;
+    file->address = 0;
+    file->loading = true;
+    file->stale = false;
+    // 一个引用属于缓存，一个属于调用者
+    file->refs = 2;
+    m_files[ key ] = file;
+    m_lock.unlock();
+
+    // 在锁外执行系统调用
+    load( file );
+
+    m_lock.lock();
+    file->loading = false;
+    m_loaded.broadcast();
+    m_lock.unlock();
+    return file;
+}
+
+void file_cache::release( cached_file* file ){
+    if( file && ( --file->refs == 0 ) ){
+        destroy( file );
+    }
+}
+
+void file_cache::load( cached_file* file ){
+    const char* path = file->path.c_str();
+    if( stat( path, &file->st ) < 0 ){
+        file->err = errno;
+        return;
+    }
+    if( S_ISDIR( file->st.st_mode ) || ! ( file->st.st_mode & S_IROTH ) ){
+        return;
+    }
+
+    file->fd = open( path, O_RDONLY | O_CLOEXEC );
+    if( file->fd < 0 ){
+        file->err = errno;
+        return;
+    }
+    if( ( file->st.st_size > 0 ) && ( file->st.st_size < MAP_THRESHOLD ) ){
+        void* address = mmap( 0, file->st.st_size, PROT_READ, MAP_SHARED, file->fd, 0 );
+        if( address != MAP_FAILED ){
+            file->address = ( char* )address;
+        }
+    }
+}
+
+void file_cache::destroy( cached_file* file ){
+    if( file->address ){
+        munmap( file->address, file->st.st_size );
+    }
+    if( file->fd != -1 ){
+        close( file->fd );
+    }
+    delete file;
+}
+
+void file_cache::invalidate( const std::string& path ){
+    std::unordered_map< std::string, cached_file* >::iterator it = m_files.find( path );
+    if( it == m_files.end() ){
+        return;
+    }
+    cached_file* file = it->second;
+    m_files.erase( it );
+    file->stale = true;
+    release( file );
+}
+
+void file_cache::invalidate_all(){
+    std::unordered_map< std::string, cached_file* > files;
+    files.swap( m_files );
+    for( std::unordered_map< std::string, cached_file* >::iterator it = files.begin(); it != files.end(); ++it ){
+        it->second->stale = true;
+        release( it->second );
+    }
+}
+
+// 缓存已满，清除所有只被缓存自身引用的项
+void file_cache::shrink(){
+    std::unordered_map< std::string, cached_file* >::iterator it = m_files.begin();
+    while( it != m_files.end() ){
+        cached_file* file = it->second;
+        if( ( file->refs == 1 ) && ! file->loading ){
+            it = m_files.erase( it );
+            file->stale = true;
+            release( file );
+        }
+        else{
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+
+/**
+ * @brief 被缓存的目标文件：打开的描述符、stat结果以及可选的只读映射
+ * 由引用计数在并发请求之间共享，缓存本身也持有一个引用
+*/
+struct cached_file{
+    std::string path;           // 文件完整路径，即http_conn::m_real_file
+    int err;                    // stat失败时的errno，0表示文件存在（不存在的文件同样会被缓存）
+    int fd;                     // 只读打开的描述符，sendfile直接使用；目录或不可读文件为-1
+    struct stat st;             // 文件状态
+    char* address;              // 小文件的只读映射，大文件不做映射，为0
+    bool loading;               // 正在由某个线程执行stat/open/mmap，其他线程需等待其完成
+    std::atomic< bool > stale;  // 已被inotify判定为过期，不再出现在缓存中，最后一个引用释放时销毁
+    std::atomic< int > refs;    // 引用计数
+};
+
+/**
+ * @brief 进程内共享的打开文件/stat缓存，以m_real_file为键
+ * 热点文件的请求不产生任何文件系统调用；同一路径上并发的未命中只由一个线程执行系统调用，其余线程等待结果；
+ * 通过inotify监视doc_root，文件被修改、删除、创建或移动时使对应缓存项失效
+*/
+class file_cache{
+public:
+    // 小于该大小的文件在加载时mmap到内存，由http_conn与响应头一起writev；其余文件由http_conn用sendfile发送
+    static const off_t MAP_THRESHOLD = 16 * 1024;
+    // 缓存项数上限，达到上限时清除所有未被请求引用的缓存项
+    static const size_t MAX_FILES = 4096;
+
+public:
+    static file_cache* instance();
+
+    /**
+     * @brief 开始监视网站根目录及其子目录
+     * @return inotify描述符，由反应堆注册到epoll中，可读时调用handle_events；失败返回-1
+    */
+    int init( const char* root );
+    // 处理inotify事件，使对应的缓存项失效
+    void handle_events();
+
+    // 获取path对应的缓存项并增加其引用计数，未命中时加载
+    cached_file* acquire( const char* path );
+    // 释放acquire得到的引用
+    void release( cached_file* file );
+
+private:
+    file_cache();
+    ~file_cache();
+
+    void load( cached_file* file );
+    void destroy( cached_file* file );
+    void add_watch( const std::string& dir );
+    // 以下函数需在持有m_lock时调用
+    void invalidate( const std::string& path );
+    void invalidate_all();
+    void shrink();
+
+private:
+    int m_inotify_fd;
+    std::string m_root;                                             // 网站根目录，路径去掉它即为URL
+    std::unordered_map< int, std::string > m_watches;               // inotify watch描述符到目录路径的映射
+    std::unordered_map< std::string, cached_file* > m_files;        // 路径到缓存项的映射
+    locker m_lock;                                                  // 保护m_files和m_watches
+    cond m_loaded;                                                  // 有缓存项加载完成
+};
+
+#endif
@@ -1,4 +1,6 @@
 #include "http_conn.h"
+#include "http_scan.h"
+#include "log.h"
 
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
@@ -29,7 +31,10 @@ void addfd( int epollfd, int fd, bool one_shot ){
     {
         event.events |= EPOLLONESHOT;
     }
-    epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
+    // 描述符已由调用者注册过（如processpool在交给http_conn之前）时改为修改其事件
+    if( ( epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event ) < 0 ) && ( errno == EEXIST ) ){
+        epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
+    }
     setnonblocking( fd );
 }
 
@@ -46,20 +51,49 @@ void modfd( int epollfd, int fd, int ev ){
     epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
 }
 
-int http_conn::m_user_count = 0;
-int http_conn::m_epollfd = -1;
+std::atomic< int > http_conn::m_user_count( 0 );
 
 void http_conn::close_conn( bool real_close ){
     if( real_close && ( m_sockfd != -1 ) ){
         //modfd( m_epollfd, m_sockfd, EPOLLIN );
-        // 从epoll中移除并关闭socket
-        removefd( m_epollfd, m_sockfd );
+        // 先清理本对象，最后才从epoll中移除并关闭socket：工作线程关闭连接时，
+        // 同一个描述符一旦被关闭就可能立即被主线程accept复用并重新init本对象
+        int sockfd = m_sockfd;
         m_sockfd = -1;
+        unmap();
+        while( m_resp_count > 0 ){
+            pop_response();
+        }
+        m_read_idx = 0;
+        release_buffers();
+        m_phase_word = PHASE_CLOSED;
+        // 在工作线程中关闭时由反应堆线程在下一个tick中移除节点；若描述符先被accept复用，init中的arm使这个请求作废
+        if( m_timers ){
+            m_timers->cancel( &m_timer );
+        }
         m_user_count--;
+        if( m_ring ){
+            // 尚未完成的操作持有socket和管道的引用，shutdown让它们立即结束；之后的完成事件因代数不同而被丢弃
+            ++m_gen;
+            m_ring->register_fd( sockfd, -1, false );
+            shutdown( sockfd, SHUT_RDWR );
+            close( sockfd );
+            if( m_pipe[0] != -1 ){
+                close( m_pipe[0] );
+                close( m_pipe[1] );
+                m_pipe[0] = m_pipe[1] = -1;
+            }
+        }
+        else{
+            removefd( m_epollfd, sockfd );
+        }
     }
 }
 
-void http_conn::init( int sockfd, const sockaddr_in& addr ){
+void http_conn::init( int epollfd, int sockfd, const sockaddr_in& addr, conn_timer* timers ){
+    m_ring = NULL;
+    m_epollfd = epollfd;
+    m_timers = timers;
     m_sockfd = sockfd;
     m_address = addr;
     int error = 0;
@@ -70,11 +104,94 @@ void http_conn::init( int sockfd, const sockaddr_in& addr ){
     addfd( m_epollfd, sockfd, true );
     m_user_count++;
 
+    m_file = 0;
+    m_response = 0;
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_headers = NULL;
+    m_write = NULL;
+    m_phase_word = ( conn_timer::now_ms() << 3 ) | PHASE_HEADER_READ;
     init();
+    // 在addfd之后才加入时间轮也无妨：事件由同一个反应堆线程处理，本函数返回前不会被分派
+    if( m_timers ){
+        m_timers->arm( &m_timer, deadline(), DEADLINE_SLACK );
+    }
+}
+
+// socket保持阻塞：ring上的操作在socket不可读写时由内核等待，不需要非阻塞标志
+void http_conn::init( uring* ring, int sockfd, const sockaddr_in& addr, conn_timer* timers ){
+    m_ring = ring;
+    ++m_gen;
+    m_inflight = 0;
+    m_send_close = false;
+    m_pipe_pending = 0;
+    m_epollfd = -1;
+    m_timers = timers;
+    m_sockfd = sockfd;
+    m_address = addr;
+    m_user_count++;
+
+    m_file = 0;
+    m_response = 0;
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_headers = NULL;
+    m_write = NULL;
+    m_msg = NULL;
+    m_phase_word = ( conn_timer::now_ms() << 3 ) | PHASE_HEADER_READ;
+    init();
+    if( m_timers ){
+        m_timers->arm( &m_timer, deadline(), DEADLINE_SLACK );
+    }
+}
+
+int64_t http_conn::deadline() const{
+    static const int timeouts[] = { HEADER_TIMEOUT, BODY_TIMEOUT, WRITE_TIMEOUT, KEEPALIVE_TIMEOUT };
+    int64_t word = m_phase_word.load( std::memory_order_acquire );
+    int phase = word & 7;
+    if( phase == PHASE_CLOSED ){
+        return -1;
+    }
+    return ( word >> 3 ) + timeouts[ phase ];
+}
+
+// 期限只在到期时才由反应堆线程重新检查，延后期限不需要通知时间轮；
+// 阶段改变时新的期限可能更早（例如消息体读完后进入较短的keep-alive空闲），重新arm节点，工作线程中调用时由反应堆线程执行
+void http_conn::set_phase( DEADLINE_PHASE phase, bool restart ){
+    int64_t word = m_phase_word.load( std::memory_order_relaxed );
+    bool changed = ( word & 7 ) != phase;
+    if( ! changed && ! restart ){
+        return;
+    }
+    m_phase_word.store( ( conn_timer::now_ms() << 3 ) | phase, std::memory_order_release );
+    if( changed && m_timers ){
+        m_timers->arm( &m_timer, deadline(), DEADLINE_SLACK );
+    }
+}
+
+void http_conn::set_read_phase(){
+    if( m_read_idx == 0 ){
+        set_phase( PHASE_KEEPALIVE_IDLE, true );
+    }
+    else{
+        set_phase( ( m_check_state == CHECK_STATE_CONTENT ) ? PHASE_BODY_READ : PHASE_HEADER_READ, false );
+    }
 }
 
 // 初始化成员变量
 void http_conn::init(){
+    m_start_line = 0;
+    m_request_start = 0;
+    m_checked_idx = 0;
+    m_read_idx = 0;
+    m_write_idx = 0;
+    m_resp_head = 0;
+    m_resp_count = 0;
+    init_request();
+}
+
+// 重置单个请求的解析状态。读缓冲中m_checked_idx之后的数据属于流水线上的下一个请求，予以保留
+void http_conn::init_request(){
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_linger = false;
 
@@ -83,19 +200,37 @@ void http_conn::init(){
     m_version = 0;
     m_content_length = 0;
     m_host = 0;
-    m_start_line = 0;
-    m_checked_idx = 0;
-    m_read_idx = 0;
-    m_write_idx = 0;
-    memset( m_read_buf, '\0', READ_BUFFER_SIZE );
-    memset( m_write_buf, '\0', WRITE_BUFFER_SIZE );
-    memset( m_real_file, '\0', FILENAME_LEN );
+    m_request_start = m_start_line = m_checked_idx;
+    if ( m_headers ){
+        m_headers->clear();
+    }
+    set_phase( PHASE_HEADER_READ, true );
+}
+
+// 已处理请求占用的空间不再需要，将剩余数据移到缓冲区开头，并修正指向当前请求的指针
+void http_conn::compact_read_buf(){
+    int shift = m_request_start;
+    if ( shift == 0 ){
+        return;
+    }
+    memmove( m_read_buf, m_read_buf + shift, m_read_idx - shift );
+    m_read_idx -= shift;
+    m_checked_idx -= shift;
+    m_start_line -= shift;
+    m_request_start = 0;
+    rebase_read_buf( -shift );
 }
 
 // 从状态机
+// 用http_scan一次检查16/32个字节，直接跳到下一个'\r'或'\n'。没有找到时m_checked_idx停在已读数据的末尾，
+// 下次读入更多数据后从那里继续扫描，因此状态机仍可以跨多次read恢复
 http_conn::LINE_STATUS http_conn::parse_line(){
     char temp;
     for ( ; m_checked_idx < m_read_idx; ++m_checked_idx ){
+        m_checked_idx = http_scan::find_crlf( m_read_buf + m_checked_idx, m_read_buf + m_read_idx ) - m_read_buf;
+        if ( m_checked_idx == m_read_idx ){
+            break;
+        }
         temp = m_read_buf[ m_checked_idx ];
         if ( temp == '\r' ){
             if ( ( m_checked_idx + 1 ) == m_read_idx ){
@@ -122,15 +257,20 @@ http_conn::LINE_STATUS http_conn::parse_line(){
     return LINE_OPEN;
 }
 
-// 循环读取客户数据，直到无数据可读或者对方关闭连接（非阻塞）
+// 循环读取客户数据，直到无数据可读、读缓冲已满或者对方关闭连接（非阻塞）
+// 读缓冲区在第一次读时才从buffer_pool借用，装满后换用大一级的缓冲区，达到MAX_READ_BUFFER_SIZE仍装不下一个请求时才失败。
+// 剩余数据留在socket中：处理完已读入的流水线请求后重新注册EPOLLIN，由于数据仍可读，事件会再次触发
 bool http_conn::read(){
-    if( m_read_idx >= READ_BUFFER_SIZE ){
+    if( ! reserve_read_buf() ){
+        return false;
+    }
+    if( ( m_read_idx >= m_read_size ) && ! grow_read_buf() ){
         return false;
     }
 
     int bytes_read = 0;
-    while( true ){
-        bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+    while( m_read_idx < m_read_size ){
+        bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, m_read_size - m_read_idx, 0 );
         if ( bytes_read == -1 ){
             if( errno == EAGAIN || errno == EWOULDBLOCK ){
                 break;
@@ -141,34 +281,135 @@ bool http_conn::read(){
             return false;
         }
         m_read_idx += bytes_read;
+        // 空闲连接上到达了新请求的第一个字节，开始计算读请求头的期限
+        if( ( m_phase_word.load( std::memory_order_relaxed ) & 7 ) == PHASE_KEEPALIVE_IDLE ){
+            set_phase( PHASE_HEADER_READ, true );
+        }
     }
     return true;
 }
 
+// 多发接收的数据不能留在socket中，读缓冲区满时先丢弃已处理的请求，仍不够再换用大一级的缓冲区
+bool http_conn::feed( const char* data, size_t len ){
+    if( ! reserve_read_buf() ){
+        return false;
+    }
+    while( len > 0 ){
+        if( m_read_idx >= m_read_size ){
+            compact_read_buf();
+            if( ( m_read_idx >= m_read_size ) && ! grow_read_buf() ){
+                return false;
+            }
+        }
+        size_t n = ( len < ( size_t )( m_read_size - m_read_idx ) ) ? len : m_read_size - m_read_idx;
+        memcpy( m_read_buf + m_read_idx, data, n );
+        m_read_idx += n;
+        data += n;
+        len -= n;
+    }
+    if( ( m_phase_word.load( std::memory_order_relaxed ) & 7 ) == PHASE_KEEPALIVE_IDLE ){
+        set_phase( PHASE_HEADER_READ, true );
+    }
+    return true;
+}
+
+bool http_conn::reserve_read_buf(){
+    if( m_read_buf ){
+        return true;
+    }
+    size_t size = 0;
+    m_read_buf = buffer_pool::instance()->alloc( READ_BUFFER_SIZE, &size );
+    if( ! m_read_buf ){
+        return false;
+    }
+    m_read_size = size;
+    m_headers = ( http_headers* )buffer_pool::instance()->alloc( sizeof( http_headers ), &size );
+    if( ! m_headers ){
+        buffer_pool::instance()->free( m_read_buf, m_read_size );
+        m_read_buf = NULL;
+        m_read_size = 0;
+        return false;
+    }
+    m_headers->clear();
+    return true;
+}
+
+bool http_conn::grow_read_buf(){
+    if( m_read_size >= MAX_READ_BUFFER_SIZE ){
+        return false;
+    }
+    size_t size = 0;
+    char* buf = buffer_pool::instance()->alloc( m_read_size * 2, &size );
+    if( ! buf ){
+        return false;
+    }
+    memcpy( buf, m_read_buf, m_read_idx );
+    rebase_read_buf( buf - m_read_buf );
+    buffer_pool::instance()->free( m_read_buf, m_read_size );
+    m_read_buf = buf;
+    m_read_size = size;
+    return true;
+}
+
+void http_conn::rebase_read_buf( ptrdiff_t delta ){
+    if ( m_url ){
+        m_url += delta;
+    }
+    if ( m_version ){
+        m_version += delta;
+    }
+    if ( m_host ){
+        m_host += delta;
+    }
+}
+
+void http_conn::release_buffers(){
+    if( m_read_buf && ( m_read_idx == 0 ) ){
+        buffer_pool::instance()->free( m_read_buf, m_read_size );
+        m_read_buf = NULL;
+        m_read_size = 0;
+        buffer_pool::instance()->free( ( char* )m_headers, sizeof( http_headers ) );
+        m_headers = NULL;
+        m_checked_idx = m_start_line = m_request_start = 0;
+    }
+    if( m_write && ( m_resp_count == 0 ) ){
+        buffer_pool::instance()->free( ( char* )m_write, sizeof( write_buffer ) );
+        m_write = NULL;
+        if( m_msg ){
+            buffer_pool::instance()->free( ( char* )m_msg, sizeof( uring_msg ) );
+            m_msg = NULL;
+        }
+        m_write_idx = 0;
+        m_resp_head = 0;
+    }
+}
+
 // 解析HTTP请求行，获得请求方法，目标URL，以及HTTP版本号
 http_conn::HTTP_CODE http_conn::parse_request_line( char* text ){
-    m_url = strpbrk( text, " \t" );
-    if ( ! m_url ){
+    // parse_line已将行尾的"\r\n"替换为两个'\0'，行的长度由m_checked_idx直接得到，不必再扫描
+    char* end = m_read_buf + m_checked_idx - 2;
+    m_url = ( char* )http_scan::find_blank( text, end );
+    if ( m_url == end ){
         return BAD_REQUEST;
     }
+    size_t method_len = m_url - text;
     *m_url++ = '\0';
 
-    char* method = text;
-    if ( strcasecmp( method, "GET" ) == 0 ){
+    if ( http_scan::token_equal( text, method_len, "GET" ) ){
         m_method = GET;
     }
     else{
         return BAD_REQUEST;
     }
 
-    m_url += strspn( m_url, " \t" );
-    m_version = strpbrk( m_url, " \t" );
-    if ( ! m_version ){
+    m_url = ( char* )http_scan::skip_blank( m_url, end );
+    m_version = ( char* )http_scan::find_blank( m_url, end );
+    if ( m_version == end ){
         return BAD_REQUEST;
     }
     *m_version++ = '\0';
-    m_version += strspn( m_version, " \t" );
-    if ( strcasecmp( m_version, "HTTP/1.1" ) != 0 ){
+    m_version = ( char* )http_scan::skip_blank( m_version, end );
+    if ( ! http_scan::token_equal( m_version, end - m_version, "HTTP/1.1" ) ){
         return BAD_REQUEST;
     }
 
@@ -186,52 +427,40 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char* text ){
 }
 
 // 解析HTTP请求的一个头部信息
+// 头部名称经http_headers的完美哈希分派，常用头部在解析时即转换为类型化的值，其余头部只记录位置，不做任何字符串库调用
 http_conn::HTTP_CODE http_conn::parse_headers( char* text ){
     // 遇到空行，标识头部字段解析完毕
     if( text[ 0 ] == '\0' ){
-        if ( m_method == HEAD ){
-            return GET_REQUEST;
+        size_t len = 0;
+        m_host = ( char* )m_headers->get( http_headers::HOST, m_read_buf + m_request_start, &len );
+        m_linger = ( m_headers->connection & http_headers::CONNECTION_KEEP_ALIVE ) != 0;
+        // 消息体必须能完整放入读缓冲区
+        if ( m_headers->content_length > MAX_READ_BUFFER_SIZE ){
+            return BAD_REQUEST;
         }
+        m_content_length = m_headers->content_length;
         // 如果HTTP请求有消息体，则还需读取m_content_length字节的消息体，同时转移状态机状态
         if ( m_content_length != 0 ){
             m_check_state = CHECK_STATE_CONTENT;
+            set_phase( PHASE_BODY_READ, true );
             return NO_REQUEST;
         }
         // 得到完整的HTTP请求
         return GET_REQUEST;
     }
-    // 处理Connection都不字段
-    else if ( strncasecmp( text, "Connection:", 11 ) == 0 ){
-        text += 11;
-        text += strspn( text, " \t" );
-        if ( strcasecmp( text, "keep-alive" ) == 0 ){
-            m_linger = true;
-        }
-    }
-    // 处理Content-Length头部字段
-    else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 ){
-        text += 15;
-        text += strspn( text, " \t" );
-        m_content_length = atol( text );
-    }
-    // 处理Host头部字段
-    else if ( strncasecmp( text, "Host:", 5 ) == 0 ){
-        text += 5;
-        text += strspn( text, " \t" );
-        m_host = text;
-    }
-    else{
-        printf( "oop! unknow header %s\n", text );
-    }
 
+    // 格式错误的头部行、过多的头部字段和非法的Content-Length都视为错误的请求
+    char* end = m_read_buf + m_checked_idx - 2;
+    if ( ! m_headers->add( m_read_buf + m_request_start, text, end, m_read_buf + m_read_size ) ){
+        return BAD_REQUEST;
+    }
     return NO_REQUEST;
-
 }
 
-// 我们没有真正解析HTTP请求的消息体，只是判断它是否被完整读入
-http_conn::HTTP_CODE http_conn::parse_content( char* text ){
+// 我们没有真正解析HTTP请求的消息体，只是判断它是否被完整读入。
+// 消息体之后可能紧跟着流水线上的下一个请求，因此不能在消息体末尾写入字符串结束符
+http_conn::HTTP_CODE http_conn::parse_content(){
     if ( m_read_idx >= ( m_content_length + m_checked_idx ) ){
-        text[ m_content_length ] = '\0';
         return GET_REQUEST;
     }
 
@@ -247,7 +476,7 @@ http_conn::HTTP_CODE http_conn::process_read(){
                 || ( ( line_status = parse_line() ) == LINE_OK ) ){
         text = get_line();
         m_start_line = m_checked_idx;
-        printf( "got 1 http line: %s\n", text );
+        LOG_DEBUG( "got 1 http line: %s", text );
 
         switch ( m_check_state ){
             case CHECK_STATE_REQUESTLINE:{
@@ -268,93 +497,326 @@ http_conn::HTTP_CODE http_conn::process_read(){
                 break;
             }
             case CHECK_STATE_CONTENT:{
-                ret = parse_content( text );
+                ret = parse_content();
                 if ( ret == GET_REQUEST ){
+                    // 跳过消息体，下一个请求从消息体之后开始
+                    m_checked_idx += m_content_length;
+                    m_start_line = m_checked_idx;
                     return do_request();
                 }
-                line_status = LINE_OPEN;
-                break;
+                // 消息体尚未读完，等待更多数据，不能把消息体当作行来解析
+                return NO_REQUEST;
             }
             default:{
                 return INTERNAL_ERROR;
             }
         }
     }
+    if ( line_status == LINE_BAD ){
+        return BAD_REQUEST;
+    }
 
     return NO_REQUEST;
 }
 
 // 得到一个完整、正确的HTTP请求时，我们分析目标文件的属性。
-// 如果目标文件存在，对所有用户可读，且不是目录，则使用mmap将其映射到内存地址为m_file_address处，并告知调用者获取文件成功
+// 目标文件的stat结果、描述符和小文件的映射都来自进程内共享的file_cache，热点文件不产生任何文件系统调用。
+// 如果目标文件存在，对所有用户可读，且不是目录，则告知调用者获取文件成功：
+// 小文件使用缓存中的映射，与响应头一起发送；大文件由flush用sendfile直接从页缓存发送。
+// 若response_cache中已有该URL的完整响应，则连文件缓存都不必查询
 http_conn::HTTP_CODE http_conn::do_request(){
-    strcpy( m_real_file, doc_root );
+    m_response = response_cache::instance()->lookup( m_url, m_linger );
+    if ( m_response ){
+        return CACHED_REQUEST;
+    }
+
+    // 客户请求的目标文件的完整路径，其内容等于doc_root + m_url，doc_root是网站根目录
+    char real_file[ FILENAME_LEN ];
     int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    if ( stat( m_real_file, &m_file_stat ) < 0 ){
+    memcpy( real_file, doc_root, len );
+    strncpy( real_file + len, m_url, FILENAME_LEN - len - 1 );
+    real_file[ FILENAME_LEN - 1 ] = '\0';
+    m_file = file_cache::instance()->acquire( real_file );
+    if ( m_file->err != 0 ){
+        unmap();
         return NO_RESOURCE;
     }
 
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) ){
+    if ( ! ( m_file->st.st_mode & S_IROTH ) ){
+        unmap();
         return FORBIDDEN_REQUEST;
     }
 
-    if ( S_ISDIR( m_file_stat.st_mode ) ){
+    if ( S_ISDIR( m_file->st.st_mode ) ){
+        unmap();
         return BAD_REQUEST;
     }
 
-    int fd = open( m_real_file, O_RDONLY );
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
+    if ( m_file->fd < 0 ){
+        unmap();
+        return INTERNAL_ERROR;
+    }
     return FILE_REQUEST;
 }
 
 
-// 对内存映射区执行munmap操作
+// 归还当前请求持有的文件和缓存响应引用，映射和描述符由file_cache在缓存项失效且无人引用时释放
 void http_conn::unmap(){
-    if( m_file_address ){
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = 0;
+    if( m_response ){
+        response_cache::instance()->release( m_response );
+        m_response = 0;
+    }
+    if( m_file ){
+        file_cache::instance()->release( m_file );
+        m_file = 0;
     }
 }
 
-// 写HTTP响应
-bool http_conn::write(){
-    int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;
-    if ( bytes_to_send == 0 ){
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
-        init();
-        return true;
+void http_conn::pop_response(){
+    response& resp = m_write->responses[ m_resp_head ];
+    if( resp.cached ){
+        response_cache::instance()->release( resp.cached );
+    }
+    if( resp.file ){
+        file_cache::instance()->release( resp.file );
     }
+    m_resp_head = ( m_resp_head + 1 ) % MAX_PIPELINE;
+    --m_resp_count;
+}
 
-    while( 1 ){
-        temp = writev( m_sockfd, m_iv, m_iv_count );
-        if ( temp <= -1 ){
+// 按顺序发送响应队列。队首起连续的内存块（响应头、缓存响应、mmap的小文件）用一次sendmsg聚集发送，
+// 遇到需要sendfile的大文件时，其响应头以MSG_MORE发送（等价于TCP_CORK），与第一段文件数据合并成满载的报文。
+// 每个响应记录自己已发送的字节数，部分发送后EPOLLOUT再次到来时从上次停下的位置继续
+http_conn::WRITE_STATUS http_conn::flush(){
+    if( m_ring ){
+        return flush_uring();
+    }
+    struct iovec iv[ MAX_PIPELINE * 2 ];
+    bool progress = false;
+    while( m_resp_count > 0 ){
+        response& head = m_write->responses[ m_resp_head ];
+        ssize_t temp = 0;
+        if ( ( head.body_fd != -1 ) && ( head.sent >= ( size_t )head.header_len ) ){
+            off_t offset = head.sent - head.header_len;
+            temp = sendfile( m_sockfd, head.body_fd, &offset, head.header_len + head.body_len - head.sent );
+        }
+        else{
+            int count = 0;
+            bool more = false;
+            for ( int i = 0; i < m_resp_count; ++i ){
+                const response& resp = m_write->responses[ ( m_resp_head + i ) % MAX_PIPELINE ];
+                size_t skip = ( i == 0 ) ? resp.sent : 0;
+                if ( skip < ( size_t )resp.header_len ){
+                    iv[ count ].iov_base = m_write->buf + resp.header_start + skip;
+                    iv[ count ].iov_len = resp.header_len - skip;
+                    ++count;
+                    skip = 0;
+                }
+                else{
+                    skip -= resp.header_len;
+                }
+                if ( resp.body_fd != -1 ){
+                    more = true;
+                    break;
+                }
+                if ( resp.body_len > skip ){
+                    iv[ count ].iov_base = ( char* )resp.body + skip;
+                    iv[ count ].iov_len = resp.body_len - skip;
+                    ++count;
+                }
+            }
+            struct msghdr msg;
+            memset( &msg, 0, sizeof( msg ) );
+            msg.msg_iov = iv;
+            msg.msg_iovlen = count;
+            temp = sendmsg( m_sockfd, &msg, more ? MSG_MORE : 0 );
+        }
+
+        if ( temp < 0 ){
             // 如果TCP写缓冲没有空间，等待下一轮EPOLLOUT事件，虽然在此期间，服务器无法接受到同一个客户的下一个请求，但可以保证连接的完整性
             if( errno == EAGAIN ){
+                // 写停滞的期限从最后一次发送进展开始计算，慢速但仍在接收的客户端不会被关闭
+                set_phase( PHASE_WRITE_STALL, progress );
                 modfd( m_epollfd, m_sockfd, EPOLLOUT );
-                return true;
+                return WRITE_AGAIN;
             }
-            unmap();
-            return false;
+            return WRITE_CLOSE;
+        }
+        // 文件在发送过程中被截断，无法再发出承诺的Content-Length
+        if ( temp == 0 ){
+            return WRITE_CLOSE;
         }
+        progress = true;
+        if ( ! consume( temp ) ){
+            return WRITE_CLOSE;
+        }
+    }
+    release_buffers();
+    return WRITE_DONE;
+}
 
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if ( bytes_to_send <= bytes_have_send ){
+// 将发送的字节依次记到各个响应上，发送完毕的响应出队
+bool http_conn::consume( size_t n ){
+    while ( n > 0 ){
+        response& resp = m_write->responses[ m_resp_head ];
+        size_t left = resp.header_len + resp.body_len - resp.sent;
+        size_t count = ( n < left ) ? n : left;
+        resp.sent += count;
+        n -= count;
+        if ( resp.sent == resp.header_len + resp.body_len ){
             // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
-            unmap();
-            if( m_linger ){
-                init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return true;
+            bool linger = resp.linger;
+            pop_response();
+            if ( ! linger ){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// io_uring引擎的发送：与flush相同，队首起连续的内存块用一次sendmsg聚集发送；遇到大文件时，
+// sendmsg（带MSG_MORE）、文件到管道的splice和管道到socket的splice链接成一串，在一次提交中完成响应头和第一段文件数据的发送。
+// sendmsg使用MSG_WAITALL，只有全部发出才继续链上的下一个操作，保证字节顺序。
+// 操作的结果由send_done记到各个响应上，一批操作全部完成前不提交新的发送
+http_conn::WRITE_STATUS http_conn::flush_uring(){
+    if( m_inflight > 0 ){
+        return WRITE_AGAIN;
+    }
+    if( m_resp_count == 0 ){
+        release_buffers();
+        return WRITE_DONE;
+    }
+    if( ! m_msg ){
+        size_t size = 0;
+        m_msg = ( uring_msg* )buffer_pool::instance()->alloc( sizeof( uring_msg ), &size );
+        if( ! m_msg ){
+            return WRITE_CLOSE;
+        }
+    }
+    const response& head = m_write->responses[ m_resp_head ];
+    if( m_pipe_pending > 0 ){
+        // 上一次splice到管道中的数据还没有全部发到socket
+        m_ring->splice( m_pipe[0], -1, m_sockfd, m_pipe_pending, uring::pack( uring::OP_SPLICE_OUT, m_sockfd, m_gen ), false );
+        ++m_inflight;
+    }
+    else if( ( head.body_fd != -1 ) && ( head.sent >= ( size_t )head.header_len ) ){
+        if( ! splice_body( head, head.sent - head.header_len ) ){
+            return WRITE_CLOSE;
+        }
+    }
+    else{
+        int count = 0;
+        const response* file = NULL;
+        for ( int i = 0; i < m_resp_count; ++i ){
+            const response& resp = m_write->responses[ ( m_resp_head + i ) % MAX_PIPELINE ];
+            size_t skip = ( i == 0 ) ? resp.sent : 0;
+            if ( skip < ( size_t )resp.header_len ){
+                m_msg->iv[ count ].iov_base = m_write->buf + resp.header_start + skip;
+                m_msg->iv[ count ].iov_len = resp.header_len - skip;
+                ++count;
+                skip = 0;
             }
             else{
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return false;
-            } 
+                skip -= resp.header_len;
+            }
+            if ( resp.body_fd != -1 ){
+                file = &resp;
+                break;
+            }
+            if ( resp.body_len > skip ){
+                m_msg->iv[ count ].iov_base = ( char* )resp.body + skip;
+                m_msg->iv[ count ].iov_len = resp.body_len - skip;
+                ++count;
+            }
+        }
+        memset( &m_msg->msg, 0, sizeof( m_msg->msg ) );
+        m_msg->msg.msg_iov = m_msg->iv;
+        m_msg->msg.msg_iovlen = count;
+        m_ring->sendmsg( m_sockfd, &m_msg->msg, MSG_WAITALL | ( file ? MSG_MORE : 0 ),
+                uring::pack( uring::OP_SEND, m_sockfd, m_gen ), file != NULL );
+        ++m_inflight;
+        if( file && ! splice_body( *file, 0 ) ){
+            return WRITE_CLOSE;
+        }
+    }
+    // 写停滞的期限从每次提交发送开始计算
+    set_phase( PHASE_WRITE_STALL, true );
+    return WRITE_AGAIN;
+}
+
+bool http_conn::splice_body( const response& resp, size_t offset ){
+    if( ( m_pipe[0] == -1 ) && ( pipe2( m_pipe, O_CLOEXEC ) < 0 ) ){
+        m_pipe[0] = m_pipe[1] = -1;
+        return false;
+    }
+    size_t len = resp.body_len - offset;
+    if( len > ( size_t )SPLICE_CHUNK ){
+        len = SPLICE_CHUNK;
+    }
+    m_ring->splice( resp.body_fd, offset, m_pipe[1], len, uring::pack( uring::OP_SPLICE_IN, m_sockfd, m_gen ), true );
+    m_ring->splice( m_pipe[0], -1, m_sockfd, len, uring::pack( uring::OP_SPLICE_OUT, m_sockfd, m_gen ), false );
+    m_inflight += 2;
+    return true;
+}
+
+bool http_conn::send_done( int op, int res ){
+    --m_inflight;
+    if( res < 0 ){
+        // 链上前一个操作失败或不完整时后面的操作被取消，管道中剩余的数据由下一次flush_uring继续发送
+        if( res != -ECANCELED ){
+            m_send_close = true;
+        }
+    }
+    else if( op == uring::OP_SPLICE_IN ){
+        // 文件在发送过程中被截断
+        if( res == 0 ){
+            m_send_close = true;
         }
+        m_pipe_pending += res;
+    }
+    else{
+        if( op == uring::OP_SPLICE_OUT ){
+            m_pipe_pending -= res;
+        }
+        if( ( res == 0 ) || ! consume( res ) ){
+            m_send_close = true;
+        }
+    }
+    if( m_inflight > 0 ){
+        return true;
+    }
+    if( m_send_close ){
+        return false;
+    }
+    // 队列发完时与flush一样先回收写缓冲区，否则已发出的响应头仍占着写缓冲区，读缓冲中流水线上的请求得不到处理
+    if( m_resp_count == 0 ){
+        release_buffers();
+    }
+    // 继续发送队列中剩余的响应；队列发完后处理读缓冲中流水线上的请求，没有则等待新的请求
+    process();
+    return true;
+}
+
+// 由主线程在EPOLLOUT事件到来时调用，继续发送响应队列
+bool http_conn::write(){
+    WRITE_STATUS ret = flush();
+    if ( ret == WRITE_CLOSE ){
+        // 由调用者关闭连接，此时不能再注册事件，否则主线程可能与调用者同时关闭该连接
+        return false;
+    }
+    // 队列发完后，若读缓冲中还留有流水线请求，由调用者交给工作线程处理，否则等待新的请求
+    if ( ( ret == WRITE_DONE ) && ! has_pending_request() ){
+        release_buffers();
+        set_read_phase();
+        wait_read();
+    }
+    return true;
+}
+
+void http_conn::wait_read(){
+    if( ! m_ring ){
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
     }
 }
 
@@ -365,7 +827,7 @@ bool http_conn::add_response( const char* format, ... ){
     }
     va_list arg_list;
     va_start( arg_list, format );
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
+    int len = vsnprintf( m_write->buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
     if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) ){
         return false;
     }
@@ -379,9 +841,7 @@ bool http_conn::add_status_line( int status, const char* title ){
 }
 
 bool http_conn::add_headers( int content_len ){
-    add_content_length( content_len );
-    add_linger();
-    add_blank_line();
+    return add_content_length( content_len ) && add_linger() && add_blank_line();
 }
 
 bool http_conn::add_content_length( int content_len ){
@@ -400,8 +860,26 @@ bool http_conn::add_content( const char* content ){
     return add_response( "%s", content );
 }
 
-// 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
+// 根据服务器处理HTTP请求的结果，生成响应并加入响应队列的队尾
 bool http_conn::process_write( HTTP_CODE ret ){
+    if ( ! m_write ){
+        size_t size = 0;
+        m_write = ( write_buffer* )buffer_pool::instance()->alloc( sizeof( write_buffer ), &size );
+        if ( ! m_write ){
+            unmap();
+            return false;
+        }
+    }
+    response& resp = m_write->responses[ ( m_resp_head + m_resp_count ) % MAX_PIPELINE ];
+    resp.header_start = m_write_idx;
+    resp.body = 0;
+    resp.body_fd = -1;
+    resp.body_len = 0;
+    resp.sent = 0;
+    resp.file = 0;
+    resp.cached = 0;
+    resp.linger = m_linger;
+
     switch ( ret ){
         case INTERNAL_ERROR:{
             add_status_line( 500, error_500_title );
@@ -412,6 +890,8 @@ bool http_conn::process_write( HTTP_CODE ret ){
             break;
         }
         case BAD_REQUEST:{
+            // 出错的请求之后无法确定下一个请求从哪里开始，发送完错误响应后关闭连接
+            m_linger = resp.linger = false;
             add_status_line( 400, error_400_title );
             add_headers( strlen( error_400_form ) );
             if ( ! add_content( error_400_form ) ){
@@ -435,47 +915,91 @@ bool http_conn::process_write( HTTP_CODE ret ){
             }
             break;
         }
+        case CACHED_REQUEST:{
+            resp.body = response_cache::instance()->data( m_response );
+            resp.body_len = response_cache::instance()->length( m_response );
+            resp.cached = m_response;
+            m_response = 0;
+            break;
+        }
         case FILE_REQUEST:{
             add_status_line( 200, ok_200_title );
-            if ( m_file_stat.st_size != 0 ){
-                add_headers( m_file_stat.st_size );
-                m_iv[ 0 ].iov_base = m_write_buf;
-                m_iv[ 0 ].iov_len = m_write_idx;
-                m_iv[ 1 ].iov_base = m_file_address;
-                m_iv[ 1 ].iov_len = m_file_stat.st_size;
-                m_iv_count = 2;
-                return true;
+            if ( m_file->st.st_size != 0 ){
+                add_headers( m_file->st.st_size );
+                // 小文件的响应头和内容拼接后放入response_cache，之后的同一请求直接命中，写缓冲中的响应头随即可以回收
+                if ( m_file->address ){
+                    m_response = response_cache::instance()->insert( m_url, m_linger, m_file, m_write->buf + resp.header_start, m_write_idx - resp.header_start );
+                    if ( m_response ){
+                        m_write_idx = resp.header_start;
+                        file_cache::instance()->release( m_file );
+                        m_file = 0;
+                        return process_write( CACHED_REQUEST );
+                    }
+                    resp.body = m_file->address;
+                }
+                else{
+                    // 大文件的内容由flush通过sendfile发送，这里只需准备响应头
+                    resp.body_fd = m_file->fd;
+                }
+                resp.body_len = m_file->st.st_size;
+                resp.file = m_file;
+                m_file = 0;
             }
             else{
+                unmap();
                 const char* ok_string = "<html><body></body></html>";
                 add_headers( strlen( ok_string ) );
                 if ( ! add_content( ok_string ) ){
                     return false;
                 }
             }
+            break;
         }
         default:{
             return false;
         }
     }
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
+    resp.header_len = m_write_idx - resp.header_start;
+    ++m_resp_count;
     return true;
 }
 
 // 由线程池中的工作线程调用，处理HTTP请求的入口函数
+// 依次解析读缓冲中所有完整的流水线请求，把它们的响应按顺序排入队列，再由工作线程直接一并发送（缓存命中时只需一次send）；
+// 只有TCP写缓冲满时才注册EPOLLOUT交给主线程继续发送
 void http_conn::process(){
-    HTTP_CODE read_ret = process_read();
-    if ( read_ret == NO_REQUEST ){
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
-        return;
-    }
-    bool write_ret = process_write( read_ret );
-    if ( ! write_ret ){
-        close_conn();
+    while ( true ){
+        while ( ( m_resp_count < MAX_PIPELINE )
+                    && ( WRITE_BUFFER_SIZE - m_write_idx >= MAX_RESPONSE_HEADER )
+                    && ( ( m_resp_count == 0 ) || m_write->responses[ ( m_resp_head + m_resp_count - 1 ) % MAX_PIPELINE ].linger ) ){
+            HTTP_CODE read_ret = process_read();
+            if ( read_ret == NO_REQUEST ){
+                break;
+            }
+            if ( ! process_write( read_ret ) ){
+                close_conn();
+                return;
+            }
+            init_request();
+        }
+        compact_read_buf();
+
+        if ( m_resp_count == 0 ){
+            // 空闲的keep-alive连接不占用缓冲区
+            release_buffers();
+            set_read_phase();
+            wait_read();
+            return;
+        }
+        WRITE_STATUS write_ret = flush();
+        if ( write_ret == WRITE_AGAIN ){
+            return;
+        }
+        if ( write_ret == WRITE_CLOSE ){
+            close_conn();
+            return;
+        }
+        // 队列已发完，继续处理读缓冲中剩余的请求
     }
-    modfd( m_epollfd, m_sockfd, EPOLLOUT );
 }
-
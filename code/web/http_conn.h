@@ -19,32 +19,88 @@
 #include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "file_cache.h"
+#include "response_cache.h"
+#include "buffer_pool.h"
+#include "http_headers.h"
+#include "conn_timer.h"
+#include "uring.h"
+#include <atomic>
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 
 class http_conn{
 public:
     // 文件名最大长度
     static const int FILENAME_LEN = 200;
-    // 读缓冲区的大小
+    // 读缓冲区的初始大小，请求头或URL过长时按buffer_pool的级别翻倍增长
     static const int READ_BUFFER_SIZE = 2048;
-    // 写缓冲区的大小
+    // 读缓冲区的最大大小
+    static const int MAX_READ_BUFFER_SIZE = 64 * 1024;
+    // 写缓冲区的大小，流水线上排队的多个响应头依次存放其中
     static const int WRITE_BUFFER_SIZE = 1024;
+    // 生成一个响应（响应头及错误页面内容）至少需要的写缓冲区空间，不足时暂停解析后续请求
+    static const int MAX_RESPONSE_HEADER = 256;
+    // 一次最多排队等待发送的响应数量
+    static const int MAX_PIPELINE = 16;
     // HTTP请求方法，此处，我们仅支持GET
     enum METHOD { GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, PATCH };
     // 解析客户请求时，主状态机所处的状态
     enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
     // 服务器处理HTTP请求的可能结果
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, CACHED_REQUEST };
     // 行的读取状态
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    // 发送响应队列的结果：全部发完，等待EPOLLOUT，出错或需要关闭连接
+    enum WRITE_STATUS { WRITE_DONE = 0, WRITE_AGAIN, WRITE_CLOSE };
+    // 连接所处的阶段，每个阶段有各自的期限：读请求头、读消息体、等待TCP写缓冲（期间没有任何发送进展）、keep-alive空闲
+    enum DEADLINE_PHASE { PHASE_HEADER_READ = 0, PHASE_BODY_READ, PHASE_WRITE_STALL, PHASE_KEEPALIVE_IDLE, PHASE_CLOSED };
+    // 各阶段的超时时间（毫秒）
+    static const int HEADER_TIMEOUT = 10000;
+    static const int BODY_TIMEOUT = 30000;
+    static const int WRITE_TIMEOUT = 30000;
+    static const int KEEPALIVE_TIMEOUT = 15000;
+    // 期限的容忍窗口（毫秒）：超时的连接可以晚这么久再关闭，期限相近的连接由反应堆的同一次唤醒处理
+    static const int DEADLINE_SLACK = 1000;
+    // io_uring引擎每次用splice发送的文件数据的最大字节数，不超过管道的默认容量
+    static const int SPLICE_CHUNK = 65536;
+
+private:
+    // 一个已生成、等待发送的响应，由响应头和可选的响应体组成
+    struct response{
+        int header_start;               // 响应头在m_write_buf中的起始位置
+        int header_len;                 // 响应头长度，缓存响应为0
+        const char* body;               // 内存中的响应体：缓存的完整响应或mmap的小文件
+        int body_fd;                    // 用sendfile发送的文件描述符，-1表示响应体在body中
+        size_t body_len;                // 响应体长度
+        size_t sent;                    // 本响应已经发送的字节数
+        cached_file* file;              // 持有的文件缓存引用
+        cached_response* cached;        // 持有的响应缓存引用
+        bool linger;                    // 发送完本响应后是否保持连接
+    };
+    // 写缓冲区：排队的响应及其响应头，只在有响应等待发送时从buffer_pool借用
+    struct write_buffer{
+        response responses[ MAX_PIPELINE ];
+        char buf[ WRITE_BUFFER_SIZE ];
+    };
+    // io_uring引擎中sendmsg的参数，须保持到发送完成，与写缓冲区一起借用和归还
+    struct uring_msg{
+        struct iovec iv[ MAX_PIPELINE * 2 ];
+        struct msghdr msg;
+    };
 
 public:
-    http_conn(){}
+    http_conn() : m_phase_word( PHASE_CLOSED ), m_timers( NULL ), m_ring( NULL ), m_gen( 0 ), m_inflight( 0 ), m_msg( NULL ){
+        m_timer.data = this;
+        m_pipe[0] = m_pipe[1] = -1;
+    }
     ~http_conn(){}
 
 public:
-    // 初始化新接受的连接
-    void init( int sockfd, const sockaddr_in& addr );
+    // 初始化新接受的连接，并将其注册到epollfd。timers不为NULL时由调用线程（其拥有者）的时间轮监视连接的期限
+    void init( int epollfd, int sockfd, const sockaddr_in& addr, conn_timer* timers = NULL );
+    // io_uring引擎：初始化由ring接受的连接，socket上的收发都在ring上进行，不注册到epoll
+    void init( uring* ring, int sockfd, const sockaddr_in& addr, conn_timer* timers );
     // 关闭连接
     void close_conn( bool real_close = true );
     // 关闭客户请求
@@ -53,10 +109,52 @@ public:
     bool read();
     // 非阻塞写操作
     bool write();
+    // 响应队列已发送完毕，但读缓冲中还有流水线上尚未处理的请求数据，需要再次交给工作线程处理
+    bool has_pending_request() const { return ( m_resp_count == 0 ) && ( m_read_idx > 0 ); }
+    // 当前阶段的期限（CLOCK_MONOTONIC毫秒），连接已关闭时返回-1。任意线程都可以调用
+    int64_t deadline() const;
+    // 时间轮中代表本连接的节点，data指向本对象
+    conn_timer::node* timer(){ return &m_timer; }
+    // io_uring引擎：把多发接收得到的数据追加到读缓冲区，读缓冲区达到最大仍放不下时返回false
+    bool feed( const char* data, size_t len );
+    // io_uring引擎：ring上的一个发送操作完成。一批操作全部完成后继续发送或处理流水线上的请求，返回false时由调用者关闭连接
+    bool send_done( int op, int res );
+    // io_uring引擎：是否有发送操作尚未完成，此时新到达的数据只放入读缓冲区，等发送完成后再处理
+    bool sending() const { return m_inflight > 0; }
+    // io_uring引擎：连接的代数，每次init和close_conn都加1，完成事件中的代数不同时属于已关闭的连接
+    uint32_t generation() const { return m_gen; }
 
 private:
     // 初始化连接
     void init();
+    // 一个请求处理完毕，重置解析状态以解析流水线上的下一个请求，不丢弃已读入的数据
+    void init_request();
+    // 将尚未处理完的请求数据移动到读缓冲区的开头
+    void compact_read_buf();
+    // 第一次读入数据前从buffer_pool借用读缓冲区，失败返回false
+    bool reserve_read_buf();
+    // 读缓冲区已满时换用大一级的缓冲区，失败返回false
+    bool grow_read_buf();
+    // 读缓冲区移动或数据前移delta字节后，修正指向当前请求的指针
+    void rebase_read_buf( ptrdiff_t delta );
+    // 归还不再需要的读写缓冲区：没有未处理的请求数据时归还读缓冲区，没有待发送的响应时归还写缓冲区
+    void release_buffers();
+    // 发送响应队列中的响应
+    WRITE_STATUS flush();
+    // io_uring引擎：把响应队列的发送提交到ring上
+    WRITE_STATUS flush_uring();
+    // io_uring引擎：从文件的offset处经管道splice一段响应体到socket，与之前提交的操作链接
+    bool splice_body( const response& resp, size_t offset );
+    // 记录发送了n字节，发送完毕的响应出队；发完一个不保持连接的响应时返回false
+    bool consume( size_t n );
+    // 重新等待新的请求：epoll模式下重新注册EPOLLIN，io_uring模式下多发接收一直有效
+    void wait_read();
+    // 从队首移除一个已发送完毕的响应
+    void pop_response();
+    // 进入新的阶段，restart为true或阶段改变时重新开始计时
+    void set_phase( DEADLINE_PHASE phase, bool restart );
+    // 重新等待EPOLLIN之前调用：读缓冲为空时进入keep-alive空闲，否则继续等待请求的剩余部分
+    void set_read_phase();
     // 解析HTTP请求
     HTTP_CODE process_read();
     // 填充HTTP应答
@@ -65,12 +163,13 @@ private:
     // 被process_read调用，用以分析HTTP请求
     HTTP_CODE parse_request_line( char* text );
     HTTP_CODE parse_headers( char* text );
-    HTTP_CODE parse_content( char* text );
+    HTTP_CODE parse_content();
     HTTP_CODE do_request();
     char* get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
     // 被process_write调用，用以填充HTTP应答
+    // 归还当前请求持有的文件和缓存响应引用
     void unmap();
     bool add_response( const char* format, ... );
     bool add_content( const char* content );
@@ -81,27 +180,33 @@ private:
     bool add_blank_line();
 
 public:
-    // 所有socket上的事件都被注册到同一个epoll内核事件表中，所以将epoll文件描述符设置为静态
-    static int m_epollfd;
-    // 用户数量
-    static int m_user_count;
+    // 用户数量，工作线程和主线程都可能关闭连接
+    static std::atomic< int > m_user_count;
 
 private:
+    // 连接所注册的epoll内核事件表：半同步/半反应堆模式下所有连接共用一个，多反应堆模式下属于接受该连接的反应堆线程
+    int m_epollfd;
     // HTTP连接的socket和对方的socket地址
     int m_sockfd;
     sockaddr_in m_address;
 
-    // 读缓冲区
-    char m_read_buf[ READ_BUFFER_SIZE ];
+    // 读缓冲区，从buffer_pool借用，连接空闲时为NULL
+    char* m_read_buf;
+    // 读缓冲区的大小
+    int m_read_size;
     // 标识读缓冲中已经读入的客户数据的最后一个字节的下一个位置
     int m_read_idx;
     // 当前分析的字符在读缓冲区中的位置
     int m_checked_idx;
     // 当前正在解析的行的起始位置
     int m_start_line;
-    // 写缓冲区
-    char m_write_buf[ WRITE_BUFFER_SIZE ];
-    // 写缓冲区中待发送的字节数
+    // 当前正在解析的请求的起始位置，之前的数据都属于已处理的请求
+    int m_request_start;
+    // 当前请求的头部字段，与读缓冲区一起从buffer_pool借用和归还
+    http_headers* m_headers;
+    // 写缓冲区，从buffer_pool借用，没有待发送的响应时为NULL
+    write_buffer* m_write;
+    // 写缓冲区中已使用的字节数，队列中所有响应发送完毕后归零
     int m_write_idx;
 
     // 主状态机当前所处的状态
@@ -109,8 +214,6 @@ private:
     // 请求方法
     METHOD m_method;
 
-    // 客户请求的目标文件的完整路径，其内容等于doc_root + m_url，doc_root是网站根目录
-    char m_real_file[ FILENAME_LEN ];
     // 客户请求的目标文件的文件名
     char* m_url;
     // HTTP协议版本号，目前只支持HTTP/1.1
@@ -122,14 +225,34 @@ private:
     // HTTP请求是否要保持连接
     bool m_linger;
 
-    // 客户请求的目标文件被mmap到内存中的起始位置
-    char* m_file_address;
-    // 目标文件的状态，可以用来判断文件是否存在，是否为目录、是否可读，并获取文件大小等
-    struct stat m_file_stat;
-    // 采用writev来执行写操作
-    struct iovec m_iv[2];
-    // 写内存块的数量
-    int m_iv_count;
+    // 当前请求的目标文件在file_cache中的缓存项，生成响应后转交给响应队列
+    cached_file* m_file;
+    // 当前请求命中或新加入response_cache的完整响应，生成响应后转交给响应队列
+    cached_response* m_response;
+
+    // 当前阶段及其开始时间：( 开始时间 << 3 ) | 阶段。由处理连接的线程写，反应堆线程在定时器到期时读
+    std::atomic< int64_t > m_phase_word;
+    // 监视本连接期限的时间轮，属于接受连接的反应堆线程
+    conn_timer* m_timers;
+    conn_timer::node m_timer;
+
+    // io_uring引擎，epoll模式下为NULL
+    uring* m_ring;
+    uint32_t m_gen;
+    // 尚未完成的发送操作数
+    int m_inflight;
+    // 本批发送操作中有失败的，或者已发完不保持连接的响应
+    bool m_send_close;
+    // splice文件数据用的管道，第一次发送大文件时创建
+    int m_pipe[2];
+    // 已splice到管道中、尚未发到socket的字节数
+    size_t m_pipe_pending;
+    uring_msg* m_msg;
+
+    // 按请求顺序排队等待发送的响应，是写缓冲区中的环形队列，队首响应的位置
+    int m_resp_head;
+    // 队列中的响应数量
+    int m_resp_count;
 };
 
 #endif
@@ -0,0 +1,282 @@
+#include "http_headers.h"
+#include "http_scan.h"
+
+// 长度为len的小写名称是否等于字面量word
+static inline bool name_equal( const char* name, size_t len, const char* word, size_t word_len ){
+    if( len != word_len ){
+        return false;
+    }
+    for( size_t i = 0; i < len; ++i ){
+        if( name[i] != word[i] ){
+            return false;
+        }
+    }
+    return true;
+}
+
+// 取出逗号分隔列表中的下一个元素，去掉两端空白和';'之后的参数。返回下一个元素的起始位置
+static const char* next_token( const char* begin, const char* end, const char** token, size_t* len, const char** params ){
+    const char* comma = http_scan::find_first_of( begin, end, ',', ',' );
+    const char* t = http_scan::skip_blank( begin, comma );
+    const char* semicolon = http_scan::find_first_of( t, comma, ';', ';' );
+    const char* e = semicolon;
+    while( ( e > t ) && ( ( e[-1] == ' ' ) || ( e[-1] == '\t' ) ) ){
+        --e;
+    }
+    *token = t;
+    *len = e - t;
+    *params = semicolon;
+    return ( comma < end ) ? comma + 1 : end;
+}
+
+// 解析不带符号的十进制整数，[begin, end)必须全是数字
+static bool parse_number( const char* begin, const char* end, long* value ){
+    if( ( begin == end ) || ( end - begin > 18 ) ){
+        return false;
+    }
+    long v = 0;
+    for( ; begin < end; ++begin ){
+        unsigned d = ( unsigned char )*begin - '0';
+        if( d > 9 ){
+            return false;
+        }
+        v = v * 10 + d;
+    }
+    *value = v;
+    return true;
+}
+
+void http_headers::clear(){
+    count = 0;
+    for( int i = 0; i < HEADER_NUMBER; ++i ){
+        index[i] = -1;
+    }
+    content_length = 0;
+    connection = 0;
+    accept_encoding = 0;
+    has_range = false;
+    range_first = range_last = -1;
+}
+
+http_headers::HEADER_ID http_headers::lookup( const char* name, size_t len, const char* limit ){
+    if( ( len < 2 ) || ( len > MAX_NAME_LEN ) ){
+        return UNKNOWN;
+    }
+    // fold_lower每次写16字节，留出余量
+    char folded[ MAX_NAME_LEN + 16 ];
+    http_scan::fold_lower( folded, name, len, limit );
+
+#define HEADER_CASE( str, id ) \
+    case hash( str, sizeof( str ) - 1 ): \
+        return name_equal( folded, len, str, sizeof( str ) - 1 ) ? id : UNKNOWN;
+
+    switch( hash( folded, len ) ){
+        HEADER_CASE( "host", HOST )
+        HEADER_CASE( "connection", CONNECTION )
+        HEADER_CASE( "content-length", CONTENT_LENGTH )
+        HEADER_CASE( "content-type", CONTENT_TYPE )
+        HEADER_CASE( "range", RANGE )
+        HEADER_CASE( "if-modified-since", IF_MODIFIED_SINCE )
+        HEADER_CASE( "if-range", IF_RANGE )
+        HEADER_CASE( "accept", ACCEPT )
+        HEADER_CASE( "accept-encoding", ACCEPT_ENCODING )
+        HEADER_CASE( "accept-language", ACCEPT_LANGUAGE )
+        HEADER_CASE( "user-agent", USER_AGENT )
+        HEADER_CASE( "referer", REFERER )
+        HEADER_CASE( "cookie", COOKIE )
+        HEADER_CASE( "cache-control", CACHE_CONTROL )
+        HEADER_CASE( "pragma", PRAGMA )
+        HEADER_CASE( "upgrade", UPGRADE )
+        HEADER_CASE( "transfer-encoding", TRANSFER_ENCODING )
+        HEADER_CASE( "expect", EXPECT )
+        HEADER_CASE( "authorization", AUTHORIZATION )
+        HEADER_CASE( "origin", ORIGIN )
+        HEADER_CASE( "te", TE )
+        HEADER_CASE( "dnt", DNT )
+        HEADER_CASE( "sec-fetch-site", SEC_FETCH_SITE )
+        HEADER_CASE( "sec-fetch-mode", SEC_FETCH_MODE )
+        HEADER_CASE( "sec-fetch-dest", SEC_FETCH_DEST )
+        HEADER_CASE( "sec-fetch-user", SEC_FETCH_USER )
+        HEADER_CASE( "upgrade-insecure-requests", UPGRADE_INSECURE_REQUESTS )
+        HEADER_CASE( "x-forwarded-for", X_FORWARDED_FOR )
+        HEADER_CASE( "keep-alive", KEEP_ALIVE )
+        default:
+            return UNKNOWN;
+    }
+#undef HEADER_CASE
+}
+
+bool http_headers::add( const char* base, char* line, char* end, const char* limit ){
+    if( count >= MAX_FIELDS ){
+        return false;
+    }
+    char* colon = ( char* )http_scan::find_first_of( line, end, ':', ':' );
+    // 名称不能为空，名称与冒号之间不允许有空白
+    if( ( colon == end ) || ( colon == line ) || ( colon[-1] == ' ' ) || ( colon[-1] == '\t' ) ){
+        return false;
+    }
+    char* value = ( char* )http_scan::skip_blank( colon + 1, end );
+    char* value_end = end;
+    while( ( value_end > value ) && ( ( value_end[-1] == ' ' ) || ( value_end[-1] == '\t' ) ) ){
+        --value_end;
+    }
+    *value_end = '\0';
+
+    HEADER_ID id = lookup( line, colon - line, limit );
+    field& f = fields[ count ];
+    f.name_off = line - base;
+    f.name_len = colon - line;
+    f.value_off = value - base;
+    f.value_len = value_end - value;
+    f.id = id;
+
+    switch( id ){
+        case CONTENT_LENGTH:
+            if( ! parse_content_length( value, value_end - value ) ){
+                return false;
+            }
+            break;
+        case CONNECTION:
+            parse_connection( value, value_end );
+            break;
+        case ACCEPT_ENCODING:
+            parse_accept_encoding( value, value_end );
+            break;
+        case RANGE:
+            // 重复的Range头部没有意义，只认第一个
+            if( index[ RANGE ] < 0 ){
+                parse_range( value, value_end );
+            }
+            break;
+        default:
+            break;
+    }
+    if( ( id != UNKNOWN ) && ( index[ id ] < 0 ) ){
+        index[ id ] = count;
+    }
+    ++count;
+    return true;
+}
+
+// 多个Content-Length的值必须相同，否则无法确定消息体的边界
+bool http_headers::parse_content_length( const char* value, size_t len ){
+    long length = 0;
+    if( ! parse_number( value, value + len, &length ) ){
+        return false;
+    }
+    if( ( index[ CONTENT_LENGTH ] >= 0 ) && ( length != content_length ) ){
+        return false;
+    }
+    content_length = length;
+    return true;
+}
+
+void http_headers::parse_connection( const char* value, const char* end ){
+    const char* token;
+    const char* params;
+    size_t len;
+    while( value < end ){
+        value = next_token( value, end, &token, &len, &params );
+        if( http_scan::token_equal( token, len, "KEEP-ALIVE" ) ){
+            connection |= CONNECTION_KEEP_ALIVE;
+        }
+        else if( http_scan::token_equal( token, len, "CLOSE" ) ){
+            connection |= CONNECTION_CLOSE;
+        }
+        else if( http_scan::token_equal( token, len, "UPGRADE" ) ){
+            connection |= CONNECTION_UPGRADE;
+        }
+    }
+}
+
+void http_headers::parse_accept_encoding( const char* value, const char* end ){
+    const char* token;
+    const char* params;
+    size_t len;
+    while( value < end ){
+        const char* next = next_token( value, end, &token, &len, &params );
+        // 只识别"q=0"、"q=0.0"等权重为0的参数，表示客户端拒绝该编码
+        const char* comma = ( next < end ) ? next - 1 : end;
+        const char* q = ( params < comma ) ? http_scan::skip_blank( params + 1, comma ) : comma;
+        bool refused = false;
+        if( ( comma - q >= 3 ) && ( ( q[0] | 0x20 ) == 'q' ) && ( q[1] == '=' ) && ( q[2] == '0' ) ){
+            refused = true;
+            for( const char* p = q + 3; p < comma; ++p ){
+                if( ( *p != '.' ) && ( *p != '0' ) && ( *p != ' ' ) && ( *p != '\t' ) ){
+                    refused = false;
+                    break;
+                }
+            }
+        }
+        value = next;
+        if( refused ){
+            continue;
+        }
+        if( http_scan::token_equal( token, len, "GZIP" ) ){
+            accept_encoding |= ENCODING_GZIP;
+        }
+        else if( http_scan::token_equal( token, len, "DEFLATE" ) ){
+            accept_encoding |= ENCODING_DEFLATE;
+        }
+        else if( http_scan::token_equal( token, len, "BR" ) ){
+            accept_encoding |= ENCODING_BR;
+        }
+        else if( http_scan::token_equal( token, len, "IDENTITY" ) ){
+            accept_encoding |= ENCODING_IDENTITY;
+        }
+    }
+}
+
+// 只识别单个范围，多个范围（multipart/byteranges）和格式错误的Range都当作没有Range
+void http_headers::parse_range( const char* value, const char* end ){
+    if( ( end - value < 6 ) || ! http_scan::token_equal( value, 6, "BYTES=" ) ){
+        return;
+    }
+    value += 6;
+    if( http_scan::find_first_of( value, end, ',', ',' ) != end ){
+        return;
+    }
+    const char* dash = http_scan::find_first_of( value, end, '-', '-' );
+    if( dash == end ){
+        return;
+    }
+    long first = -1;
+    long last = -1;
+    if( ( dash > value ) && ! parse_number( value, dash, &first ) ){
+        return;
+    }
+    if( ( dash + 1 < end ) && ! parse_number( dash + 1, end, &last ) ){
+        return;
+    }
+    // "bytes=-"和first大于last都是无效的范围
+    if( ( ( first < 0 ) && ( last < 0 ) ) || ( ( first >= 0 ) && ( last >= 0 ) && ( first > last ) ) ){
+        return;
+    }
+    has_range = true;
+    range_first = first;
+    range_last = last;
+}
+
+const char* http_headers::get( HEADER_ID id, const char* base, size_t* len ) const{
+    if( ( id >= HEADER_NUMBER ) || ( index[ id ] < 0 ) ){
+        return NULL;
+    }
+    const field& f = fields[ ( int )index[ id ] ];
+    *len = f.value_len;
+    return base + f.value_off;
+}
+
+const char* http_headers::get( const char* name, const char* base, size_t* len ) const{
+    size_t name_len = 0;
+    while( name[ name_len ] ){
+        ++name_len;
+    }
+    for( int i = 0; i < count; ++i ){
+        const field& f = fields[i];
+        if( ( f.name_len == name_len ) && http_scan::token_equal_nocase( base + f.name_off, name, name_len ) ){
+            *len = f.value_len;
+            return base + f.value_off;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,94 @@
+#ifndef HTTP_HEADERS_H
+#define HTTP_HEADERS_H
+
+#include <stddef.h>
+
+/**
+ * @brief 一个HTTP请求的全部头部字段
+ * 每个字段只记录名称和值相对于请求起始位置的偏移，不复制数据，读缓冲区增长或前移后依然有效。
+ * 常用头部的名称经完美哈希分派到固定的编号，并在解析时转换为类型化的值（Content-Length、Connection、Range、
+ * Accept-Encoding等）；其余头部只记录位置，可以按名称查询。
+ * 对象本身是POD，由http_conn从buffer_pool借用，与读缓冲区同时借用和归还
+*/
+class http_headers{
+public:
+    // 已知头部的编号，名称表见http_headers.cpp中的lookup
+    enum HEADER_ID {
+        HOST = 0, CONNECTION, CONTENT_LENGTH, CONTENT_TYPE, RANGE, IF_MODIFIED_SINCE, IF_RANGE,
+        ACCEPT, ACCEPT_ENCODING, ACCEPT_LANGUAGE, USER_AGENT, REFERER, COOKIE, CACHE_CONTROL, PRAGMA, UPGRADE,
+        TRANSFER_ENCODING, EXPECT, AUTHORIZATION, ORIGIN, TE, DNT, SEC_FETCH_SITE, SEC_FETCH_MODE, SEC_FETCH_DEST,
+        SEC_FETCH_USER, UPGRADE_INSECURE_REQUESTS, X_FORWARDED_FOR, KEEP_ALIVE,
+        HEADER_NUMBER,
+        UNKNOWN = HEADER_NUMBER
+    };
+    // Connection头部中出现的选项
+    enum CONNECTION_OPTION { CONNECTION_KEEP_ALIVE = 1, CONNECTION_CLOSE = 2, CONNECTION_UPGRADE = 4 };
+    // Accept-Encoding中客户端接受的编码（q=0的编码不计入）
+    enum ENCODING { ENCODING_GZIP = 1, ENCODING_DEFLATE = 2, ENCODING_BR = 4, ENCODING_IDENTITY = 8 };
+    // 一个请求最多的头部字段数量
+    static const int MAX_FIELDS = 48;
+    // 参与哈希分派的头部名称的最大长度，更长的名称都是未知头部
+    static const size_t MAX_NAME_LEN = 32;
+
+    struct field{
+        unsigned short name_off;        // 名称相对于请求起始位置的偏移
+        unsigned short name_len;
+        unsigned short value_off;       // 值（已去掉两端空白）相对于请求起始位置的偏移
+        unsigned short value_len;
+        int id;                         // HEADER_ID
+    };
+
+public:
+    // 开始解析一个新请求
+    void clear();
+    /**
+     * @brief 解析一个头部行
+     * @param base 当前请求的起始位置，偏移都相对于它
+     * @param line 头部行，[line, end)不含行尾的"\r\n"，*end为'\0'
+     * @param limit 读缓冲区的末尾，用于判断能否整块读取名称
+     * @return 行格式错误、字段过多或类型化的值非法时返回false
+    */
+    bool add( const char* base, char* line, char* end, const char* limit );
+    // 返回已知头部的值（以'\0'结尾）及其长度，请求中没有该头部时返回NULL。同名头部出现多次时返回第一个
+    const char* get( HEADER_ID id, const char* base, size_t* len ) const;
+    // 按名称（忽略大小写）查找任意头部
+    const char* get( const char* name, const char* base, size_t* len ) const;
+
+    /**
+     * @brief 头部名称的完美哈希，name须已转换为小写，len至少为2
+     * 只用长度和三个字节，对全部已知名称无冲突：lookup中的switch以哈希值作为case标签，新增名称若产生冲突将无法通过编译
+    */
+    static constexpr unsigned hash( const char* name, size_t len ){
+        return ( len + ( unsigned char )name[0] + 13 * ( unsigned char )name[ len - 2 ] + 17 * ( unsigned char )name[ len - 1 ] ) & 63;
+    }
+    // 由头部名称得到编号，limit含义同add
+    static HEADER_ID lookup( const char* name, size_t len, const char* limit );
+
+private:
+    bool parse_content_length( const char* value, size_t len );
+    void parse_connection( const char* value, const char* end );
+    void parse_accept_encoding( const char* value, const char* end );
+    void parse_range( const char* value, const char* end );
+
+public:
+    // 字段数量
+    int count;
+    // 各个已知头部第一次出现的字段下标，-1表示没有
+    signed char index[ HEADER_NUMBER ];
+    // 按出现顺序排列的字段
+    field fields[ MAX_FIELDS ];
+
+    // 消息体长度，没有Content-Length时为0
+    long content_length;
+    // CONNECTION_OPTION的组合
+    unsigned connection;
+    // ENCODING的组合
+    unsigned accept_encoding;
+    // 是否有可以识别的单个字节范围"bytes=first-last"
+    bool has_range;
+    // 范围的起止位置，first为-1表示"bytes=-n"形式的后缀范围，last为-1表示直到文件末尾
+    long range_first;
+    long range_last;
+};
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stddef.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define HTTP_SCAN_X86
+#endif
+
+/**
+ * @brief HTTP请求的字节扫描器：在缓冲区中查找行边界（'\r'、'\n'）和字段分隔符（' '、'\t'）
+ * x86上按CPU特性在运行时选择AVX2（每次32字节）或SSE2（每次16字节）实现，其他平台使用逐字节的标量实现。
+ * 只有头文件，供web服务器和analysis-http-request.cpp共用
+*/
+class http_scan{
+public:
+    typedef const char* ( *scan_func )( const char* begin, const char* end, char c1, char c2 );
+
+    // 返回[begin, end)中第一个等于c1或c2的字节的位置，没有则返回end
+    static const char* find_first_of( const char* begin, const char* end, char c1, char c2 ){
+        static const scan_func func = select();
+        return func( begin, end, c1, c2 );
+    }
+    // 查找行结束符
+    static const char* find_crlf( const char* begin, const char* end ){
+        return find_first_of( begin, end, '\r', '\n' );
+    }
+    // 查找请求行中字段之间的空白
+    static const char* find_blank( const char* begin, const char* end ){
+        return find_first_of( begin, end, ' ', '\t' );
+    }
+    // 跳过空白，返回第一个非空白字节的位置
+    static const char* skip_blank( const char* begin, const char* end ){
+        while( ( begin < end ) && ( ( *begin == ' ' ) || ( *begin == '\t' ) ) ){
+            ++begin;
+        }
+        return begin;
+    }
+    // 长度为len的token是否与全大写的字面量word相同（忽略大小写）
+    static bool token_equal( const char* token, size_t len, const char* word ){
+        size_t i = 0;
+        for( ; ( i < len ) && word[i]; ++i ){
+            char c = token[i];
+            if( ( c >= 'a' ) && ( c <= 'z' ) ){
+                c -= 'a' - 'A';
+            }
+            if( c != word[i] ){
+                return false;
+            }
+        }
+        return ( i == len ) && ( word[i] == '\0' );
+    }
+    // 长度为len的两个字节串是否相同（忽略ASCII大小写）
+    static bool token_equal_nocase( const char* a, const char* b, size_t len ){
+        for( size_t i = 0; i < len; ++i ){
+            char x = a[i];
+            char y = b[i];
+            if( ( x >= 'A' ) && ( x <= 'Z' ) ){
+                x |= 0x20;
+            }
+            if( ( y >= 'A' ) && ( y <= 'Z' ) ){
+                y |= 0x20;
+            }
+            if( x != y ){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief 将src开始的len个字节转换为小写后写入dst
+     * SSE2下每次处理16字节，dst至少要有len+15字节的空间；只有src+16不超过limit时才整块读取，否则逐字节处理
+    */
+    static void fold_lower( char* dst, const char* src, size_t len, const char* limit ){
+#ifdef __SSE2__
+        const __m128i upper_a = _mm_set1_epi8( 'A' - 1 );
+        const __m128i upper_z = _mm_set1_epi8( 'Z' + 1 );
+        const __m128i to_lower = _mm_set1_epi8( 0x20 );
+        while( ( len > 0 ) && ( src + 16 <= limit ) ){
+            __m128i x = _mm_loadu_si128( ( const __m128i* )src );
+            __m128i is_upper = _mm_and_si128( _mm_cmpgt_epi8( x, upper_a ), _mm_cmplt_epi8( x, upper_z ) );
+            _mm_storeu_si128( ( __m128i* )dst, _mm_or_si128( x, _mm_and_si128( is_upper, to_lower ) ) );
+            size_t n = ( len < 16 ) ? len : 16;
+            src += n;
+            dst += n;
+            len -= n;
+        }
+#endif
+        for( ; len > 0; --len ){
+            char c = *src++;
+            *dst++ = ( ( c >= 'A' ) && ( c <= 'Z' ) ) ? ( c | 0x20 ) : c;
+        }
+    }
+
+    // 当前使用的实现名称
+    static const char* impl_name(){
+#ifdef HTTP_SCAN_X86
+        scan_func func = select();
+        if( func == find_avx2 ){
+            return "avx2";
+        }
+        if( func == find_sse2 ){
+            return "sse2";
+        }
+#endif
+        return "scalar";
+    }
+
+    static const char* find_scalar( const char* begin, const char* end, char c1, char c2 ){
+        for( ; begin < end; ++begin ){
+            if( ( *begin == c1 ) || ( *begin == c2 ) ){
+                return begin;
+            }
+        }
+        return end;
+    }
+
+#ifdef HTTP_SCAN_X86
+    __attribute__( ( target( "sse2" ) ) )
+    static const char* find_sse2( const char* begin, const char* end, char c1, char c2 ){
+        const __m128i v1 = _mm_set1_epi8( c1 );
+        const __m128i v2 = _mm_set1_epi8( c2 );
+        for( ; end - begin >= 16; begin += 16 ){
+            __m128i x = _mm_loadu_si128( ( const __m128i* )begin );
+            int mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( x, v1 ), _mm_cmpeq_epi8( x, v2 ) ) );
+            if( mask ){
+                return begin + __builtin_ctz( mask );
+            }
+        }
+        return find_scalar( begin, end, c1, c2 );
+    }
+
+    __attribute__( ( target( "avx2" ) ) )
+    static const char* find_avx2( const char* begin, const char* end, char c1, char c2 ){
+        const __m256i v1 = _mm256_set1_epi8( c1 );
+        const __m256i v2 = _mm256_set1_epi8( c2 );
+        for( ; end - begin >= 32; begin += 32 ){
+            __m256i x = _mm256_loadu_si256( ( const __m256i* )begin );
+            unsigned mask = _mm256_movemask_epi8( _mm256_or_si256( _mm256_cmpeq_epi8( x, v1 ), _mm256_cmpeq_epi8( x, v2 ) ) );
+            if( mask ){
+                return begin + __builtin_ctz( mask );
+            }
+        }
+        // 不足32字节的尾部交给SSE2处理
+        return find_sse2( begin, end, c1, c2 );
+    }
+#endif
+
+private:
+    static scan_func select(){
+#ifdef HTTP_SCAN_X86
+        __builtin_cpu_init();
+        if( __builtin_cpu_supports( "avx2" ) ){
+            return find_avx2;
+        }
+        if( __builtin_cpu_supports( "sse2" ) ){
+            return find_sse2;
+        }
+#endif
+        return find_scalar;
+    }
+};
+
+#endif
@@ -4,6 +4,12 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <atomic>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 
 // 封装信号量
@@ -49,6 +55,10 @@ public:
     bool unlock(){
         return pthread_mutex_unlock( &m_mutex ) == 0;
     }
+    // 获取底层互斥锁，供条件变量在外部锁上等待
+    pthread_mutex_t* get(){
+        return &m_mutex;
+    }
 
 private:
     pthread_mutex_t m_mutex;
@@ -78,13 +88,69 @@ public:
         pthread_mutex_unlock( &m_mutex );
         return ret == 0;
     }
+    // 在调用者已经持有的互斥锁上等待，返回时重新持有该锁
+    bool wait( pthread_mutex_t* mutex ){
+        return pthread_cond_wait( &m_cond, mutex ) == 0;
+    }
     bool signal(){
         return pthread_cond_signal( &m_cond ) == 0;
     }
+    bool broadcast(){
+        return pthread_cond_broadcast( &m_cond ) == 0;
+    }
 
 private:
     pthread_mutex_t m_mutex;
     pthread_cond_t m_cond;
 };
 
+
+/**
+ * @brief 基于futex的事件计数器（eventcount），让等待者只在无锁队列为空时才睡眠
+ * 等待方先prepare_wait取得当前纪元，再次检查条件，条件仍不满足才wait；通知方在使条件成立后调用notify。
+ * 没有等待者时notify只是一次原子读，不进入内核
+*/
+class eventcount{
+public:
+    eventcount() : m_epoch( 0 ), m_waiters( 0 ){}
+
+    // 声明即将等待，返回当前纪元。之后必须调用cancel_wait或wait之一
+    uint32_t prepare_wait(){
+        m_waiters.fetch_add( 1, std::memory_order_seq_cst );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        return m_epoch.load( std::memory_order_seq_cst );
+    }
+    // 再次检查发现条件已经满足，放弃等待
+    void cancel_wait(){
+        m_waiters.fetch_sub( 1, std::memory_order_relaxed );
+    }
+    // 纪元仍为key时睡眠，直到被notify唤醒（也可能被信号等原因提前唤醒，调用者需重新检查条件）
+    void wait( uint32_t key ){
+        if( m_epoch.load( std::memory_order_seq_cst ) == key ){
+            syscall( SYS_futex, ( uint32_t* )&m_epoch, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0 );
+        }
+        m_waiters.fetch_sub( 1, std::memory_order_relaxed );
+    }
+    void notify_one(){
+        notify( 1 );
+    }
+    void notify_all(){
+        notify( INT_MAX );
+    }
+
+private:
+    void notify( int count ){
+        // 与prepare_wait中的fetch_add配对：要么等待者看到了条件成立，要么这里看到了等待者
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        if( m_waiters.load( std::memory_order_relaxed ) > 0 ){
+            m_epoch.fetch_add( 1, std::memory_order_seq_cst );
+            syscall( SYS_futex, ( uint32_t* )&m_epoch, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0 );
+        }
+    }
+
+private:
+    std::atomic< uint32_t > m_epoch;
+    std::atomic< int > m_waiters;
+};
+
 #endif
@@ -0,0 +1,658 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include "locker.h"
+
+/**
+ * 异步日志
+ * 每个调用点在第一次执行时登记自己的格式字符串，得到一个格式编号；之后每条日志只把编号、时间戳和二进制形式的参数
+ * 写入本线程独占的单生产者单消费者环形缓冲区，不格式化、不加锁、不进行系统调用。
+ * 后台线程处理所有线程的环形缓冲区，按格式字符串格式化后成批写出；或者原样写出二进制记录，由log-decoder离线解码。
+ * 所有环形缓冲区都为空时后台线程在eventcount上睡眠，写日志的线程只在自己的环形缓冲区由空变为非空时唤醒它。
+ * 环形缓冲区满时丢弃日志并计数，从不阻塞调用者。
+ * 低于LOG_MIN_LEVEL的日志在编译期就被去掉，参数也不会被求值
+*/
+
+enum LOG_LEVEL { LOG_LEVEL_DEBUG = 0, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR };
+
+// 编译期的日志级别下限，可以用-DLOG_MIN_LEVEL=0打开调试日志
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_WRITE( level, format, ... ) \
+    do{ \
+        if( ( level ) >= LOG_MIN_LEVEL ){ \
+            static const int log_format_id_ = logger::instance()->register_format( level, __FILE__, __LINE__, format ); \
+            logger::instance()->write( log_format_id_, ##__VA_ARGS__ ); \
+        } \
+    } while( 0 )
+
+#define LOG_DEBUG( format, ... ) LOG_WRITE( LOG_LEVEL_DEBUG, format, ##__VA_ARGS__ )
+#define LOG_INFO( format, ... ) LOG_WRITE( LOG_LEVEL_INFO, format, ##__VA_ARGS__ )
+#define LOG_WARN( format, ... ) LOG_WRITE( LOG_LEVEL_WARN, format, ##__VA_ARGS__ )
+#define LOG_ERROR( format, ... ) LOG_WRITE( LOG_LEVEL_ERROR, format, ##__VA_ARGS__ )
+
+class logger{
+public:
+    // 每个线程环形缓冲区的大小
+    static const size_t RING_SIZE = 64 * 1024;
+    // 字符串参数最多记录的字节数
+    static const size_t MAX_STRING_LEN = 1024;
+    // 最多登记的格式数量
+    static const int MAX_FORMATS = 4096;
+    // 二进制日志文件的开头，与记录头一样长
+    static const char* binary_magic(){ return "HPS-BINARY-LOG1\n"; }
+
+    // 参数的类型标记，整数统一扩展为64位
+    enum ARG_TYPE { ARG_INT = 1, ARG_UINT, ARG_DOUBLE, ARG_STRING, ARG_POINTER };
+    // 记录编号中的特殊值：环形缓冲区末尾的填充；二进制文件中的格式定义
+    static const uint32_t PADDING_ID = 0xffffffff;
+    static const uint32_t DEFINITION_ID = 0xfffffffe;
+
+    // 每条记录的头部，记录按8字节对齐
+    struct record_header{
+        uint32_t size;                  // 记录总长度，含头部和对齐填充
+        uint32_t id;                    // 格式编号
+        uint64_t time;                  // CLOCK_REALTIME，纳秒
+    };
+    struct format_def{
+        int level;
+        int line;
+        const char* file;
+        const char* format;
+    };
+
+public:
+    static logger* instance(){
+        static logger log;
+        return &log;
+    }
+
+    /**
+     * @brief 设置日志的输出位置，应在写日志之前调用
+     * @param path 日志文件，NULL表示标准错误
+     * @param binary 是否写出二进制记录
+    */
+    bool init( const char* path, bool binary ){
+        int fd = STDERR_FILENO;
+        if( path ){
+            fd = open( path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+            if( fd < 0 ){
+                return false;
+            }
+        }
+        m_output_lock.lock();
+        m_fd = fd;
+        m_binary = binary;
+        m_magic_written = false;
+        m_output_lock.unlock();
+        return true;
+    }
+
+    // 登记调用点的格式字符串，返回格式编号。file和format须是字符串字面量
+    int register_format( int level, const char* file, int line, const char* format ){
+        m_lock.lock();
+        int id = m_format_count.load( std::memory_order_relaxed );
+        if( id >= MAX_FORMATS ){
+            m_lock.unlock();
+            return -1;
+        }
+        const char* name = strrchr( file, '/' );
+        m_formats[ id ].level = level;
+        m_formats[ id ].line = line;
+        m_formats[ id ].file = name ? name + 1 : file;
+        m_formats[ id ].format = format;
+        m_format_count.store( id + 1, std::memory_order_release );
+        start();
+        m_lock.unlock();
+        return id;
+    }
+
+    // 写一条日志，args只能是整数、枚举、浮点数、字符串和指针
+    template< typename... Args >
+    void write( int id, Args... args ){
+        if( id < 0 ){
+            return;
+        }
+        size_t size = ( sizeof( record_header ) + args_size( args... ) + 7 ) & ~( size_t )7;
+        ring* r = local_ring();
+        uint64_t start = r ? r->head.load( std::memory_order_relaxed ) : 0;
+        char* p = r ? r->reserve( size ) : NULL;
+        if( ! p ){
+            m_dropped.fetch_add( 1, std::memory_order_relaxed );
+            return;
+        }
+        struct timespec ts;
+        clock_gettime( CLOCK_REALTIME, &ts );
+        record_header* h = ( record_header* )p;
+        h->size = size;
+        h->id = id;
+        h->time = ( uint64_t )ts.tv_sec * 1000000000 + ts.tv_nsec;
+        encode( p + sizeof( record_header ), args... );
+        r->commit( size );
+        // 后台线程已读到本条记录之前，即环形缓冲区原本为空时才唤醒它。屏障与worker中prepare_wait之后的检查相对：
+        // 要么这里看到了已读空的tail，要么后台线程睡眠前看到了新的head
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        if( r->tail.load( std::memory_order_relaxed ) == start ){
+            m_ready.notify_one();
+        }
+    }
+
+    // 等待此前写入的日志全部输出
+    void flush(){
+        uint64_t round = m_round.load( std::memory_order_acquire );
+        // 后台线程每完成一轮就加一，多等一轮确保调用前写入的记录都已处理。
+        // 有flush在等待时后台线程不睡眠；它可能已经在睡眠，先唤醒它
+        m_flushers.fetch_add( 1 );
+        while( m_running.load() ){
+            uint32_t key = m_drained.prepare_wait();
+            if( m_round.load( std::memory_order_acquire ) >= round + 2 ){
+                m_drained.cancel_wait();
+                break;
+            }
+            m_ready.notify_one();
+            m_drained.wait( key );
+        }
+        m_flushers.fetch_sub( 1 );
+    }
+
+    // 因环形缓冲区已满而丢弃的日志数量
+    uint64_t dropped() const { return m_dropped.load( std::memory_order_relaxed ); }
+
+    /**
+     * @brief 按格式字符串和二进制参数格式化一条日志，log-decoder也使用这个函数
+     * 支持printf的转换说明（不支持'*'宽度），长度修饰符被忽略，按参数实际的类型输出
+     * @return 写入out的字节数
+    */
+    static size_t format_message( char* out, size_t out_size, const char* format, const char* args, const char* args_end ){
+        size_t n = 0;
+        char spec[ 32 ];
+        while( *format && ( n + 1 < out_size ) ){
+            if( *format != '%' ){
+                out[ n++ ] = *format++;
+                continue;
+            }
+            if( format[1] == '%' ){
+                out[ n++ ] = '%';
+                format += 2;
+                continue;
+            }
+            // 复制标志、宽度和精度，去掉长度修饰符，直到转换字符
+            size_t len = 0;
+            spec[ len++ ] = *format++;
+            while( *format && ! strchr( "diouxXcsfFeEgGaAp", *format ) ){
+                if( ! strchr( "hlLqjzt", *format ) && ( len < sizeof( spec ) - 4 ) ){
+                    spec[ len++ ] = *format;
+                }
+                ++format;
+            }
+            if( ! *format ){
+                break;
+            }
+            char conversion = *format++;
+            int type = ( args < args_end ) ? ( unsigned char )*args++ : 0;
+            int written = 0;
+            size_t room = out_size - n;
+            if( ( type == ARG_INT ) || ( type == ARG_UINT ) ){
+                int64_t v;
+                memcpy( &v, args, sizeof( v ) );
+                args += sizeof( v );
+                if( conversion == 'c' ){
+                    spec[ len++ ] = 'c';
+                    spec[ len ] = '\0';
+                    written = snprintf( out + n, room, spec, ( int )v );
+                }
+                else if( strchr( "fFeEgGaA", conversion ) ){
+                    spec[ len++ ] = conversion;
+                    spec[ len ] = '\0';
+                    written = snprintf( out + n, room, spec, ( double )v );
+                }
+                else{
+                    if( strchr( "sp", conversion ) ){
+                        conversion = ( type == ARG_INT ) ? 'd' : 'u';
+                    }
+                    spec[ len++ ] = 'l';
+                    spec[ len++ ] = 'l';
+                    spec[ len++ ] = conversion;
+                    spec[ len ] = '\0';
+                    written = snprintf( out + n, room, spec, ( long long )v );
+                }
+            }
+            else if( type == ARG_DOUBLE ){
+                double v;
+                memcpy( &v, args, sizeof( v ) );
+                args += sizeof( v );
+                spec[ len++ ] = strchr( "fFeEgGaA", conversion ) ? conversion : 'g';
+                spec[ len ] = '\0';
+                written = snprintf( out + n, room, spec, v );
+            }
+            else if( type == ARG_STRING ){
+                uint16_t slen;
+                memcpy( &slen, args, sizeof( slen ) );
+                args += sizeof( slen );
+                // 字符串在记录中没有结束符，复制出来再按原来的宽度和精度输出
+                char str[ MAX_STRING_LEN + 1 ];
+                memcpy( str, args, slen );
+                str[ slen ] = '\0';
+                args += slen;
+                spec[ len++ ] = 's';
+                spec[ len ] = '\0';
+                written = snprintf( out + n, room, spec, str );
+            }
+            else if( type == ARG_POINTER ){
+                uint64_t v;
+                memcpy( &v, args, sizeof( v ) );
+                args += sizeof( v );
+                written = snprintf( out + n, room, "%p", ( void* )( uintptr_t )v );
+            }
+            else{
+                written = snprintf( out + n, room, "<?>" );
+            }
+            if( written > 0 ){
+                n += ( ( size_t )written < room ) ? written : room - 1;
+            }
+        }
+        out[ n ] = '\0';
+        return n;
+    }
+
+    // 格式化完整的一行：时间、级别、调用点和消息
+    static size_t format_line( char* out, size_t out_size, const format_def& def, const record_header* h ){
+        static const char* level_names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+        time_t sec = h->time / 1000000000;
+        struct tm tm;
+        localtime_r( &sec, &tm );
+        size_t n = strftime( out, out_size, "%Y-%m-%d %H:%M:%S", &tm );
+        const char* level = ( ( def.level >= 0 ) && ( def.level <= LOG_LEVEL_ERROR ) ) ? level_names[ def.level ] : "?    ";
+        n += snprintf( out + n, out_size - n, ".%06u %s %s:%d ", ( unsigned )( h->time % 1000000000 / 1000 ), level, def.file, def.line );
+        if( n >= out_size - 1 ){
+            return out_size - 1;
+        }
+        const char* args = ( const char* )( h + 1 );
+        n += format_message( out + n, out_size - n - 1, def.format, args, ( const char* )h + h->size );
+        out[ n++ ] = '\n';
+        return n;
+    }
+
+private:
+    /**
+     * @brief 单生产者单消费者的字节环形缓冲区，生产者是写日志的线程，消费者是后台线程
+     * 记录总是连续存放，末尾放不下时先写一个填充记录再从头开始
+    */
+    struct ring{
+        ring() : closed( false ), retired( false ), next( NULL ){
+            head.store( 0, std::memory_order_relaxed );
+            tail.store( 0, std::memory_order_relaxed );
+        }
+        char* reserve( size_t size ){
+            uint64_t h = head.load( std::memory_order_relaxed );
+            uint64_t t = tail.load( std::memory_order_acquire );
+            size_t offset = h & ( RING_SIZE - 1 );
+            size_t contiguous = RING_SIZE - offset;
+            size_t need = ( contiguous < size ) ? contiguous + size : size;
+            if( ( size > RING_SIZE / 4 ) || ( h + need - t > RING_SIZE ) ){
+                return NULL;
+            }
+            if( contiguous < size ){
+                record_header* pad = ( record_header* )( buffer + offset );
+                pad->size = contiguous;
+                pad->id = PADDING_ID;
+                head.store( h + contiguous, std::memory_order_release );
+                offset = 0;
+            }
+            return buffer + offset;
+        }
+        void commit( size_t size ){
+            head.store( head.load( std::memory_order_relaxed ) + size, std::memory_order_release );
+        }
+
+        alignas( 64 ) std::atomic< uint64_t > head;     // 生产者写入的位置
+        alignas( 64 ) std::atomic< uint64_t > tail;     // 后台线程读取的位置
+        std::atomic< bool > closed;     // 所属线程已退出，读空后由后台线程释放
+        bool retired;                   // 已关闭且已读空，等待后台线程从链表中摘下，只由后台线程访问
+        ring* next;
+        alignas( 64 ) char buffer[ RING_SIZE ];
+    };
+
+    // 线程退出时标记其环形缓冲区
+    struct ring_holder{
+        ring* r;
+        ring_holder() : r( NULL ){}
+        ~ring_holder(){
+            if( r ){
+                r->closed.store( true, std::memory_order_release );
+            }
+        }
+    };
+
+    // 各种参数的类型和编码后的长度
+    template< typename T >
+    struct arg_type{
+        typedef typename std::remove_cv< typename std::remove_pointer< T >::type >::type pointee;
+        static const int value = std::is_floating_point< T >::value ? ARG_DOUBLE :
+                                 std::is_pointer< T >::value ? ( std::is_same< pointee, char >::value ? ARG_STRING : ARG_POINTER ) :
+                                 ( std::is_enum< T >::value || std::is_signed< T >::value ) ? ARG_INT : ARG_UINT;
+        static_assert( std::is_arithmetic< T >::value || std::is_enum< T >::value || std::is_pointer< T >::value,
+                       "log arguments must be integers, floating point numbers, strings or pointers" );
+    };
+
+    static size_t string_len( const char* s ){
+        return s ? strnlen( s, MAX_STRING_LEN ) : 6;
+    }
+
+    static size_t args_size(){ return 0; }
+    template< typename T, typename... Rest >
+    static size_t args_size( T arg, Rest... rest ){
+        return 1 + arg_size( arg, std::integral_constant< int, arg_type< T >::value >() ) + args_size( rest... );
+    }
+    template< typename T, int type >
+    static size_t arg_size( T, std::integral_constant< int, type > ){ return 8; }
+    template< typename T >
+    static size_t arg_size( T arg, std::integral_constant< int, ARG_STRING > ){ return 2 + string_len( arg ); }
+
+    static void encode( char* ){}
+    template< typename T, typename... Rest >
+    static void encode( char* p, T arg, Rest... rest ){
+        *p++ = arg_type< T >::value;
+        p = encode_arg( p, arg, std::integral_constant< int, arg_type< T >::value >() );
+        encode( p, rest... );
+    }
+    template< typename T >
+    static char* encode_arg( char* p, T arg, std::integral_constant< int, ARG_INT > ){
+        int64_t v = ( int64_t )arg;
+        memcpy( p, &v, sizeof( v ) );
+        return p + sizeof( v );
+    }
+    template< typename T >
+    static char* encode_arg( char* p, T arg, std::integral_constant< int, ARG_UINT > ){
+        uint64_t v = ( uint64_t )arg;
+        memcpy( p, &v, sizeof( v ) );
+        return p + sizeof( v );
+    }
+    template< typename T >
+    static char* encode_arg( char* p, T arg, std::integral_constant< int, ARG_DOUBLE > ){
+        double v = arg;
+        memcpy( p, &v, sizeof( v ) );
+        return p + sizeof( v );
+    }
+    template< typename T >
+    static char* encode_arg( char* p, T arg, std::integral_constant< int, ARG_POINTER > ){
+        uint64_t v = ( uintptr_t )arg;
+        memcpy( p, &v, sizeof( v ) );
+        return p + sizeof( v );
+    }
+    template< typename T >
+    static char* encode_arg( char* p, T arg, std::integral_constant< int, ARG_STRING > ){
+        const char* s = arg ? arg : "(null)";
+        uint16_t len = string_len( arg );
+        memcpy( p, &len, sizeof( len ) );
+        memcpy( p + sizeof( len ), s, len );
+        return p + sizeof( len ) + len;
+    }
+
+private:
+    logger() : m_fd( STDERR_FILENO ), m_binary( false ), m_magic_written( false ), m_running( false ), m_rings( NULL ),
+            m_out_len( 0 ), m_defined( 0 ){
+        m_format_count.store( 0, std::memory_order_relaxed );
+        m_dropped.store( 0, std::memory_order_relaxed );
+        m_round.store( 0, std::memory_order_relaxed );
+        m_flushers.store( 0, std::memory_order_relaxed );
+    }
+    ~logger(){
+        if( m_running.load() ){
+            m_running.store( false );
+            m_ready.notify_one();
+            pthread_join( m_thread, NULL );
+        }
+    }
+
+    ring* local_ring(){
+        static thread_local ring_holder holder;
+        if( ! holder.r ){
+            ring* r = new ring;
+            m_lock.lock();
+            r->next = m_rings;
+            m_rings = r;
+            m_lock.unlock();
+            holder.r = r;
+        }
+        return holder.r;
+    }
+
+    // 启动后台线程，调用者持有m_lock
+    void start(){
+        if( m_running.load() ){
+            return;
+        }
+        static bool atfork_registered = false;
+        if( ! atfork_registered ){
+            pthread_atfork( before_fork, after_fork_parent, after_fork_child );
+            atfork_registered = true;
+        }
+        m_running.store( true );
+        if( pthread_create( &m_thread, NULL, worker, this ) != 0 ){
+            m_running.store( false );
+        }
+    }
+
+    // fork时不能有其他线程持有m_output_lock和m_lock；子进程中只有调用fork的线程，需要重新启动后台线程，并丢弃从父进程复制来的尚未输出的日志
+    static void before_fork(){
+        instance()->m_output_lock.lock();
+        instance()->m_lock.lock();
+    }
+    static void after_fork_parent(){
+        instance()->m_lock.unlock();
+        instance()->m_output_lock.unlock();
+    }
+    static void after_fork_child(){
+        logger* log = instance();
+        for( ring* r = log->m_rings; r; r = r->next ){
+            r->tail.store( r->head.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+        }
+        log->m_out_len = 0;
+        // 父进程中在等待的线程没有进入子进程，重置等待者计数，否则每次通知都会多一次futex系统调用，后台线程也不会睡眠
+        new ( &log->m_ready ) eventcount;
+        new ( &log->m_drained ) eventcount;
+        log->m_flushers.store( 0, std::memory_order_relaxed );
+        log->m_running.store( false );
+        log->start();
+        log->m_lock.unlock();
+        log->m_output_lock.unlock();
+    }
+
+    // 没有待处理的记录且没有flush在等待时睡眠，直到有环形缓冲区由空变为非空、flush或析构时被唤醒
+    static void* worker( void* arg ){
+        logger* log = ( logger* )arg;
+        while( log->m_running.load() ){
+            if( ! log->drain() ){
+                uint32_t key = log->m_ready.prepare_wait();
+                if( log->m_running.load() && ( log->m_flushers.load() == 0 ) && ! log->pending() ){
+                    log->m_ready.wait( key );
+                }
+                else{
+                    log->m_ready.cancel_wait();
+                }
+            }
+            log->m_round.fetch_add( 1, std::memory_order_release );
+            log->m_drained.notify_all();
+        }
+        log->drain();
+        log->m_round.fetch_add( 1, std::memory_order_release );
+        log->m_drained.notify_all();
+        return NULL;
+    }
+
+    // 是否有环形缓冲区中还有未处理的记录
+    bool pending(){
+        bool any = false;
+        m_lock.lock();
+        for( ring* r = m_rings; r && ! any; r = r->next ){
+            any = r->head.load( std::memory_order_acquire ) != r->tail.load( std::memory_order_relaxed );
+        }
+        m_lock.unlock();
+        return any;
+    }
+
+    /**
+     * @brief 处理所有线程的环形缓冲区中已提交的记录，返回是否处理了记录
+     * m_lock只在取链表头和摘下已关闭的缓冲区时持有，格式化和写文件时不持有，登记格式或新线程的缓冲区不会等待磁盘。
+     * 新的缓冲区只会插到链表头部，只有后台线程摘下缓冲区，所以取到的链表头之后的部分在处理期间不会变化
+    */
+    bool drain(){
+        bool any = false;
+        bool retired = false;
+        m_output_lock.lock();
+        m_lock.lock();
+        ring* first = m_rings;
+        m_lock.unlock();
+        for( ring* r = first; r; r = r->next ){
+            bool closed = r->closed.load( std::memory_order_acquire );
+            uint64_t head = r->head.load( std::memory_order_acquire );
+            uint64_t tail = r->tail.load( std::memory_order_relaxed );
+            while( tail < head ){
+                const record_header* h = ( const record_header* )( r->buffer + ( tail & ( RING_SIZE - 1 ) ) );
+                if( h->id != PADDING_ID ){
+                    output( h );
+                    any = true;
+                }
+                tail += h->size;
+            }
+            r->tail.store( tail, std::memory_order_release );
+            if( closed ){
+                r->retired = true;
+                retired = true;
+            }
+        }
+        flush_output();
+        m_output_lock.unlock();
+
+        if( retired ){
+            m_lock.lock();
+            ring** link = &m_rings;
+            while( *link ){
+                ring* r = *link;
+                if( r->retired ){
+                    *link = r->next;
+                    delete r;
+                }
+                else{
+                    link = &r->next;
+                }
+            }
+            m_lock.unlock();
+        }
+        return any;
+    }
+
+    void output( const record_header* h ){
+        if( h->id >= ( uint32_t )m_format_count.load( std::memory_order_acquire ) ){
+            return;
+        }
+        if( m_binary ){
+            // 二进制文件中每个格式在第一次使用前写出其定义
+            define_formats();
+            append( ( const char* )h, h->size );
+        }
+        else{
+            if( m_out_len + MAX_LINE > sizeof( m_out ) ){
+                flush_output();
+            }
+            m_out_len += format_line( m_out + m_out_len, MAX_LINE, m_formats[ h->id ], h );
+        }
+    }
+
+    // 二进制格式定义：记录头（编号为DEFINITION_ID），之后是格式编号、级别、行号和以'\0'结尾的文件名与格式字符串
+    void define_formats(){
+        if( ! m_magic_written ){
+            append( binary_magic(), strlen( binary_magic() ) );
+            m_magic_written = true;
+        }
+        int count = m_format_count.load( std::memory_order_acquire );
+        for( ; m_defined < count; ++m_defined ){
+            const format_def& def = m_formats[ m_defined ];
+            size_t file_len = strlen( def.file ) + 1;
+            size_t format_len = strlen( def.format ) + 1;
+            record_header h;
+            h.size = ( sizeof( h ) + 12 + file_len + format_len + 7 ) & ~( size_t )7;
+            h.id = DEFINITION_ID;
+            h.time = 0;
+            int32_t fields[3] = { m_defined, def.level, def.line };
+            char zeros[8] = { 0 };
+            append( ( const char* )&h, sizeof( h ) );
+            append( ( const char* )fields, sizeof( fields ) );
+            append( def.file, file_len );
+            append( def.format, format_len );
+            append( zeros, h.size - sizeof( h ) - sizeof( fields ) - file_len - format_len );
+        }
+    }
+
+    void append( const char* data, size_t len ){
+        if( m_out_len + len > sizeof( m_out ) ){
+            flush_output();
+        }
+        if( len > sizeof( m_out ) ){
+            write_all( data, len );
+            return;
+        }
+        memcpy( m_out + m_out_len, data, len );
+        m_out_len += len;
+    }
+
+    void flush_output(){
+        write_all( m_out, m_out_len );
+        m_out_len = 0;
+    }
+
+    void write_all( const char* data, size_t len ){
+        while( len > 0 ){
+            ssize_t n = ::write( m_fd, data, len );
+            if( n < 0 ){
+                if( errno == EINTR ){
+                    continue;
+                }
+                return;
+            }
+            data += n;
+            len -= n;
+        }
+    }
+
+private:
+    // 一行文本日志的最大长度
+    static const size_t MAX_LINE = 2048;
+
+    locker m_lock;                      // 保护格式登记和环形缓冲区链表
+    locker m_output_lock;               // 保护输出位置和输出缓冲区，只有后台线程、init和fork时使用
+    int m_fd;
+    bool m_binary;
+    bool m_magic_written;
+    std::atomic< bool > m_running;
+    pthread_t m_thread;
+    eventcount m_ready;                 // 有新的记录或需要停止，唤醒后台线程
+    eventcount m_drained;               // 后台线程完成了一轮，唤醒flush
+    std::atomic< int > m_flushers;      // 正在等待的flush数
+    ring* m_rings;                      // 所有线程的环形缓冲区
+    format_def m_formats[ MAX_FORMATS ];
+    std::atomic< int > m_format_count;
+    std::atomic< uint64_t > m_dropped;
+    std::atomic< uint64_t > m_round;    // 后台线程完成的轮数
+    char m_out[ 64 * 1024 ];            // 批量写出的缓冲区
+    size_t m_out_len;
+    int m_defined;                      // 已写出定义的格式数量
+};
+
+#endif
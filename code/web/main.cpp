@@ -9,16 +9,31 @@
 #include <stdlib.h>
 #include <cassert>
 #include <sys/epoll.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "file_cache.h"
+#include "response_cache.h"
+#include "uring.h"
+#include "http_scan.h"
+#include "log.h"
 
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
+#define RESPONSE_CACHE_MB 64
+// io_uring引擎提交队列的大小，以及多发接收所用提供缓冲区的数目和大小
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE 4096
 
 extern int addfd( int epollfd, int fd, bool one_shot );
 extern int removefd( int epollfd, int fd );
+extern const char* doc_root;
+extern int run_prefork( const char* ip, int port, int process_number, const char* mode_name );
 
 void addsig( int sig, void( handler )(int), bool restart = true ){
     struct sigaction sa;
@@ -32,39 +47,56 @@ void addsig( int sig, void( handler )(int), bool restart = true ){
 }
 
 void show_error( int connfd, const char* info ){
-    printf( "%s", info );
+    LOG_WARN( "%s", info );
     send( connfd, info, strlen( info ), 0 );
     close( connfd );
 }
 
 
-int main( int argc, char* argv[] ){
-    if( argc <= 2 ){
-        printf( "usage: %s ip_address port_number\n", basename( argv[0] ) );
-        return 1;
-    }
-    const char* ip = argv[1];
-    int port = atoi( argv[2] );
+void usage( const char* prog ){
+    printf( "usage: %s [-c cache_mb] [-H] [-U [-P] | -R reactors | -W | -F processes [-A mode]] [-L log_file [-B]] ip_address port_number\n", prog );
+    printf( "  -c cache_mb  小文件完整响应缓存的内存预算（MB），0表示不启用，默认%d\n", RESPONSE_CACHE_MB );
+    printf( "  -H           响应缓存尝试使用大页\n" );
+    printf( "  -R reactors  多反应堆模式：reactors个线程各自监听（SO_REUSEPORT）并完整处理自己的连接，0表示每个CPU一个；\n" );
+    printf( "               不指定时使用半同步/半反应堆模式：主线程监听和读写，线程池解析请求\n" );
+    printf( "  -W           半同步/半反应堆模式的线程池使用工作窃取调度，同一连接的请求优先交给同一个工作线程\n" );
+    printf( "  -U           io_uring引擎：主线程在一个ring上完成接受、接收、解析和发送，内核不支持时退回epoll\n" );
+    printf( "  -P           io_uring引擎使用内核线程轮询提交队列（SQPOLL）\n" );
+    printf( "  -F processes 预派生模式：processes个子进程（processpool）各自用一个epoll完整处理自己的连接，0表示每个CPU一个\n" );
+    printf( "  -A mode      预派生模式接受新连接的方式：dispatch、reuseport（默认）、exclusive或balance\n" );
+    printf( "  -L log_file  日志写入log_file，默认写到标准错误\n" );
+    printf( "  -B           日志以二进制记录写出，用log-decoder转换为文本\n" );
+}
 
-    addsig( SIGPIPE, SIG_IGN );
+// 所有连接对象，以socket描述符为下标。描述符在进程内唯一，所以多个反应堆线程可以共用这个数组，每个连接只属于接受它的反应堆
+static http_conn* users = NULL;
 
-    threadpool< http_conn >* pool = NULL;
-    try{
-        pool = new threadpool< http_conn >;
-    }
-    catch( ... ){
-        return 1;
-    }
-
-    http_conn* users = new http_conn[ MAX_FD ];
-    assert( users );
-    int user_count = 0;
+/**
+ * @brief 一个事件循环：一个epoll内核事件表及注册在其上的监听socket
+ * pool不为NULL时是半同步/半反应堆模式，读写在本线程完成，请求交给线程池解析；
+ * pool为NULL时是多反应堆模式中的一个反应堆，请求就在本线程中解析并生成响应（run-to-completion）
+*/
+template< typename Pool >
+struct reactor{
+    int epollfd;
+    int listenfd;
+    int inotifyfd;                      // 只由一个事件循环处理网站根目录的变化，其余为-1
+    conn_timer timers;                  // 本事件循环所接受连接的期限，决定epoll_wait的超时
+    int cpu;                            // 绑定的CPU，-1表示不绑定
+    Pool* pool;
+    pthread_t thread;
+};
 
+int create_listenfd( const char* ip, int port, bool reuseport ){
     int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
     assert( listenfd >= 0 );
-    struct linger tmp = { 1, 0 };
-    // 待理解
-    setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ) );
+    // 不设置SO_LINGER{1,0}：该选项会被accept得到的socket继承，close时直接发送RST并丢弃发送缓冲区中尚未发出的响应数据，
+    // 大文件在Connection: close下会被截断
+    if( reuseport ){
+        // 每个反应堆绑定同一地址的一个监听socket，由内核按连接的四元组哈希把新连接分给它们
+        int reuse = 1;
+        setsockopt( listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) );
+    }
 
     int ret = 0;
     struct sockaddr_in address;
@@ -76,44 +108,124 @@ int main( int argc, char* argv[] ){
     ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
     assert( ret >= 0 );
 
-    ret = listen( listenfd, 5 );
+    // 连接成批到达时，过小的backlog使内核丢弃SYN，客户要等SYN重传（1秒起）才能连上
+    ret = listen( listenfd, SOMAXCONN );
     assert( ret >= 0 );
+    return listenfd;
+}
 
-    epoll_event events[ MAX_EVENT_NUMBER ];
-    int epollfd = epoll_create( 5 );
-    assert( epollfd != -1 );
-    addfd( epollfd, listenfd, false );
-    http_conn::m_epollfd = epollfd;
+// 连接的定时器到期。期限只在这里重新检查：阶段推进后期限已经延后的重新放入时间轮，真正超时的连接
+// 用shutdown唤醒其socket上的EPOLLRDHUP，由事件循环按正常路径关闭。连接可能正被工作线程处理，不能在这里直接关闭
+template< typename Reactor >
+void on_deadline( conn_timer::node* timer, void* arg ){
+    Reactor* r = ( Reactor* )arg;
+    http_conn* conn = ( http_conn* )timer->data;
+    int64_t deadline = conn->deadline();
+    if( deadline < 0 ){
+        r->timers.remove( timer );
+        return;
+    }
+    if( deadline > conn_timer::now_ms() ){
+        r->timers.add( timer, deadline, http_conn::DEADLINE_SLACK );
+        return;
+    }
+    r->timers.remove( timer );
+    LOG_INFO( "connection %d timed out", ( int )( conn - users ) );
+    shutdown( conn - users, SHUT_RDWR );
+}
+
+template< typename Pool >
+void init_reactor( reactor< Pool >* r, int listenfd, int inotifyfd, Pool* pool ){
+    r->epollfd = epoll_create( 5 );
+    assert( r->epollfd != -1 );
+    r->listenfd = listenfd;
+    r->inotifyfd = inotifyfd;
+    r->cpu = -1;
+    r->pool = pool;
+    addfd( r->epollfd, listenfd, false );
+    if( inotifyfd != -1 ){
+        epoll_event event;
+        event.data.fd = inotifyfd;
+        event.events = EPOLLIN;
+        epoll_ctl( r->epollfd, EPOLL_CTL_ADD, inotifyfd, &event );
+    }
+    int wakeupfd = r->timers.init( on_deadline< reactor< Pool > >, r );
+    assert( wakeupfd != -1 );
+    epoll_event event;
+    event.data.fd = wakeupfd;
+    event.events = EPOLLIN;
+    epoll_ctl( r->epollfd, EPOLL_CTL_ADD, wakeupfd, &event );
+}
+
+// 处理连接上的请求：半同步/半反应堆模式下交给线程池，多反应堆模式下直接在本线程处理
+// 以socket作为affinity，工作窃取调度下同一连接的请求优先由同一个工作线程处理，缓存更热
+template< typename Pool >
+static inline void dispatch( reactor< Pool >* r, http_conn* conn, int sockfd ){
+    if( r->pool ){
+        // 请求队列已满，服务器过载，关闭连接
+        if( ! r->pool->append( conn, sockfd ) ){
+            conn->close_conn();
+        }
+    }
+    else{
+        conn->process();
+    }
+}
 
+template< typename Pool >
+void event_loop( reactor< Pool >* r ){
+    epoll_event events[ MAX_EVENT_NUMBER ];
+    int epollfd = r->epollfd;
+    int listenfd = r->listenfd;
     while( true ){
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
+        // 每轮都处理已到期的定时器，被I/O事件唤醒时也顺便处理，再按合并后的期限决定最多等待多久
+        uint64_t wakeups = r->timers.get_stats().wakeups;
+        r->timers.tick( conn_timer::now_ms() );
+        const conn_timer::stats& stats = r->timers.get_stats();
+        if( stats.wakeups != wakeups ){
+            LOG_DEBUG( "timer wakeup: %llu wakeups, %llu expired, %llu wakeups saved", ( unsigned long long )stats.wakeups,
+                    ( unsigned long long )stats.expired, ( unsigned long long )stats.wakeups_saved );
+        }
+        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, r->timers.next_timeout() );
         if ( ( number < 0 ) && ( errno != EINTR ) ){
-            printf( "epoll failure\n" );
+            LOG_ERROR( "epoll failure: %s", strerror( errno ) );
             break;
         }
 
         for ( int i = 0; i < number; i++ ){
             int sockfd = events[i].data.fd;
             if( sockfd == listenfd ){
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof( client_address );
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                if ( connfd < 0 ){
-                    printf( "errno is: %d\n", errno );
-                    continue;
+                // 监听socket是边沿触发的，一次事件可能对应多个待接受的连接，需循环accept直到EAGAIN
+                while( true ){
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlength = sizeof( client_address );
+                    int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
+                    if ( connfd < 0 ){
+                        if( errno != EAGAIN && errno != EWOULDBLOCK ){
+                            LOG_WARN( "accept failed, errno is: %d", errno );
+                        }
+                        break;
+                    }
+                    if( ( http_conn::m_user_count >= MAX_FD ) || ( connfd >= MAX_FD ) ){
+                        show_error( connfd, "Internal server busy" );
+                        continue;
+                    }
+                    users[connfd].init( epollfd, connfd, client_address, &r->timers );
                 }
-                if( http_conn::m_user_count >= MAX_FD ){
-                    show_error( connfd, "Internal server busy" );
-                    continue;
-                }
-                users[connfd].init( connfd, client_address );
+            }
+            else if( sockfd == r->inotifyfd ){
+                file_cache::instance()->handle_events();
+            }
+            // 工作线程向时间轮投递了请求，由下一轮的tick执行
+            else if( sockfd == r->timers.wakeup_fd() ){
+                r->timers.clear_wakeup();
             }
             else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ){
                 users[sockfd].close_conn();
             }
             else if( events[i].events & EPOLLIN ){
                 if( users[sockfd].read() ){
-                    pool->append( users + sockfd );
+                    dispatch( r, users + sockfd, sockfd );
                 }
                 else{
                     users[sockfd].close_conn();
@@ -123,15 +235,333 @@ int main( int argc, char* argv[] ){
                 if( !users[sockfd].write() ){
                     users[sockfd].close_conn();
                 }
+                // 响应队列发完后，读缓冲中还有流水线上的请求，继续处理
+                else if( users[sockfd].has_pending_request() ){
+                    dispatch( r, users + sockfd, sockfd );
+                }
             }
             else
             {}
         }
     }
+}
 
-    close( epollfd );
-    close( listenfd );
-    delete [] users;
+template< typename Pool >
+void* reactor_thread( void* arg ){
+    reactor< Pool >* r = ( reactor< Pool >* )arg;
+    r->timers.set_owner();
+    if( r->cpu >= 0 ){
+        cpu_set_t cpus;
+        CPU_ZERO( &cpus );
+        CPU_SET( r->cpu, &cpus );
+        pthread_setaffinity_np( pthread_self(), sizeof( cpus ), &cpus );
+    }
+    event_loop( r );
+    return NULL;
+}
+
+// 半同步/半反应堆模式：主线程运行唯一的事件循环，请求交给Pool类型的线程池
+template< typename Pool >
+int run_half_sync( const char* ip, int port, int inotifyfd ){
+    Pool* pool = NULL;
+    try{
+        pool = new Pool;
+    }
+    catch( ... ){
+        return 1;
+    }
+
+    reactor< Pool > r;
+    init_reactor( &r, create_listenfd( ip, port, false ), inotifyfd, pool );
+    event_loop( &r );
+
+    close( r.epollfd );
+    close( r.listenfd );
     delete pool;
     return 0;
 }
+
+/**
+ * @brief io_uring引擎：一个ring上的事件循环，连接在主线程中解析并生成响应（run-to-completion）
+ * 多发accept和多发接收一经提交就持续产生完成事件，不再需要为每个请求重新注册EPOLLONESHOT；
+ * 每一轮循环中产生的所有提交（新连接的接收、响应的发送）由一次io_uring_enter提交，同时等待下一批完成事件
+*/
+struct uring_reactor{
+    uring ring;
+    int listenfd;
+    int inotifyfd;
+    conn_timer timers;
+};
+
+static void uring_accept( uring_reactor* r, int connfd ){
+    if( ( http_conn::m_user_count >= MAX_FD ) || ( connfd >= MAX_FD ) ){
+        show_error( connfd, "Internal server busy" );
+        return;
+    }
+    // 多发accept不返回对方地址，连接不使用它
+    struct sockaddr_in client_address;
+    memset( &client_address, 0, sizeof( client_address ) );
+    http_conn* conn = users + connfd;
+    conn->init( &r->ring, connfd, client_address, &r->timers );
+    // 先把socket登记到注册文件表，链接其后的多发接收即可使用固定文件
+    r->ring.register_fd( connfd, connfd, true );
+    r->ring.recv_multishot( connfd, uring::pack( uring::OP_RECV, connfd, conn->generation() ) );
+}
+
+static void uring_recv( uring_reactor* r, io_uring_cqe* cqe ){
+    int sockfd = uring::fd_of( cqe->user_data );
+    http_conn* conn = users + sockfd;
+    bool current = conn->generation() == uring::gen_of( cqe->user_data );
+    bool fed = true;
+    // 选中的缓冲区总要归还，即使连接已经关闭
+    if( cqe->flags & IORING_CQE_F_BUFFER ){
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if( current && ( cqe->res > 0 ) ){
+            fed = conn->feed( r->ring.buffer( bid ), cqe->res );
+        }
+        r->ring.recycle( bid );
+    }
+    if( ! current ){
+        return;
+    }
+    // 提供缓冲区暂时用完时多发接收终止，重新提交
+    if( cqe->res == -ENOBUFS ){
+        r->ring.recv_multishot( sockfd, cqe->user_data );
+        return;
+    }
+    if( ( cqe->res <= 0 ) || ! fed ){
+        conn->close_conn();
+        return;
+    }
+    if( ! ( cqe->flags & IORING_CQE_F_MORE ) ){
+        r->ring.recv_multishot( sockfd, cqe->user_data );
+    }
+    // 发送进行中时请求留在读缓冲区里，由send_done在发送完成后处理
+    if( ! conn->sending() ){
+        conn->process();
+    }
+}
+
+static void uring_complete( uring_reactor* r, io_uring_cqe* cqe ){
+    int op = uring::op_of( cqe->user_data );
+    bool more = ( cqe->flags & IORING_CQE_F_MORE ) != 0;
+    switch( op ){
+        case uring::OP_ACCEPT:{
+            if( cqe->res >= 0 ){
+                uring_accept( r, cqe->res );
+            }
+            else{
+                LOG_WARN( "accept failed: %s", strerror( -cqe->res ) );
+            }
+            if( ! more ){
+                r->ring.accept_multishot( r->listenfd, cqe->user_data );
+            }
+            break;
+        }
+        case uring::OP_RECV:{
+            uring_recv( r, cqe );
+            break;
+        }
+        case uring::OP_SEND:
+        case uring::OP_SPLICE_IN:
+        case uring::OP_SPLICE_OUT:{
+            http_conn* conn = users + uring::fd_of( cqe->user_data );
+            if( ( conn->generation() == uring::gen_of( cqe->user_data ) ) && ! conn->send_done( op, cqe->res ) ){
+                conn->close_conn();
+            }
+            break;
+        }
+        case uring::OP_POLL:{
+            file_cache::instance()->handle_events();
+            if( ! more ){
+                r->ring.poll_multishot( r->inotifyfd, POLLIN, cqe->user_data );
+            }
+            break;
+        }
+        case uring::OP_FILES_UPDATE:{
+            // 成功的登记不产生完成事件
+            LOG_WARN( "cannot update registered file %d: %s", uring::fd_of( cqe->user_data ), strerror( -cqe->res ) );
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// 内核不支持所需的io_uring特性时返回-1，由调用者退回epoll
+int run_uring( const char* ip, int port, int inotifyfd, bool sqpoll ){
+    uring_reactor* r = new uring_reactor;
+    if( ! r->ring.init( URING_ENTRIES, sqpoll, MAX_FD, URING_BUFFERS, URING_BUFFER_SIZE ) ){
+        LOG_WARN( "io_uring unavailable (%s), falling back to epoll", r->ring.error() );
+        delete r;
+        return -1;
+    }
+    r->listenfd = create_listenfd( ip, port, false );
+    r->inotifyfd = inotifyfd;
+    // 所有连接都在本线程中处理，时间轮不会收到其他线程的请求，不需要监听它的eventfd
+    r->timers.init( on_deadline< uring_reactor >, r );
+    r->ring.accept_multishot( r->listenfd, uring::pack( uring::OP_ACCEPT, r->listenfd, 0 ) );
+    if( inotifyfd != -1 ){
+        r->ring.poll_multishot( inotifyfd, POLLIN, uring::pack( uring::OP_POLL, inotifyfd, 0 ) );
+    }
+    LOG_INFO( "io_uring engine started%s", sqpoll ? " with SQPOLL" : "" );
+
+    while( true ){
+        r->timers.tick( conn_timer::now_ms() );
+        int ret = r->ring.submit_and_wait( r->timers.next_timeout() );
+        if( ( ret < 0 ) && ( ret != -ETIME ) && ( ret != -EINTR ) && ( ret != -EBUSY ) ){
+            LOG_ERROR( "io_uring_enter failure: %s", strerror( -ret ) );
+            break;
+        }
+        r->ring.for_each_cqe( [r]( io_uring_cqe* cqe ){ uring_complete( r, cqe ); } );
+    }
+
+    close( r->listenfd );
+    delete r;
+    return 0;
+}
+
+// 多反应堆模式：每个反应堆线程有自己的监听socket（SO_REUSEPORT）和epoll
+int run_reactors( const char* ip, int port, int inotifyfd, int reactor_number ){
+    int cpu_number = sysconf( _SC_NPROCESSORS_ONLN );
+    if( reactor_number == 0 ){
+        reactor_number = cpu_number;
+    }
+    // 每个反应堆线程绑定一个CPU，主线程运行第0个反应堆
+    typedef reactor< threadpool< http_conn > > reactor_t;
+    reactor_t* reactors = new reactor_t[ reactor_number ];
+    for( int i = 0; i < reactor_number; ++i ){
+        init_reactor< threadpool< http_conn > >( reactors + i, create_listenfd( ip, port, true ), ( i == 0 ) ? inotifyfd : -1, NULL );
+        reactors[i].cpu = ( cpu_number > 0 ) ? i % cpu_number : -1;
+    }
+    for( int i = 1; i < reactor_number; ++i ){
+        if( pthread_create( &reactors[i].thread, NULL, reactor_thread< threadpool< http_conn > >, reactors + i ) != 0 ){
+            return 1;
+        }
+    }
+    reactor_thread< threadpool< http_conn > >( reactors );
+
+    for( int i = 0; i < reactor_number; ++i ){
+        close( reactors[i].epollfd );
+        close( reactors[i].listenfd );
+    }
+    delete [] reactors;
+    return 0;
+}
+
+int main( int argc, char* argv[] ){
+    int cache_mb = RESPONSE_CACHE_MB;
+    bool hugepage = false;
+    // 反应堆线程数，-1表示使用半同步/半反应堆模式
+    int reactor_number = -1;
+    bool work_stealing_pool = false;
+    bool use_uring = false;
+    bool sqpoll = false;
+    // 预派生模式的子进程数，-1表示不使用
+    int process_number = -1;
+    const char* accept_mode = NULL;
+    const char* log_file = NULL;
+    bool binary_log = false;
+    int opt;
+    while( ( opt = getopt( argc, argv, "c:HR:WUPF:A:L:B" ) ) != -1 ){
+        switch( opt ){
+            case 'c':{
+                cache_mb = atoi( optarg );
+                break;
+            }
+            case 'H':{
+                hugepage = true;
+                break;
+            }
+            case 'R':{
+                reactor_number = atoi( optarg );
+                break;
+            }
+            case 'W':{
+                work_stealing_pool = true;
+                break;
+            }
+            case 'U':{
+                use_uring = true;
+                break;
+            }
+            case 'P':{
+                use_uring = true;
+                sqpoll = true;
+                break;
+            }
+            case 'F':{
+                process_number = atoi( optarg );
+                break;
+            }
+            case 'A':{
+                accept_mode = optarg;
+                break;
+            }
+            case 'L':{
+                log_file = optarg;
+                break;
+            }
+            case 'B':{
+                binary_log = true;
+                break;
+            }
+            default:{
+                usage( basename( argv[0] ) );
+                return 1;
+            }
+        }
+    }
+    if( argc - optind < 2 ){
+        usage( basename( argv[0] ) );
+        return 1;
+    }
+    const char* ip = argv[optind];
+    int port = atoi( argv[optind + 1] );
+
+    if( ( log_file || binary_log ) && ! logger::instance()->init( log_file, binary_log ) ){
+        printf( "cannot open log file %s\n", log_file );
+        return 1;
+    }
+
+    LOG_INFO( "http request scanner: %s", http_scan::impl_name() );
+
+    if( cache_mb > 0 ){
+        response_cache::instance()->init( ( size_t )cache_mb << 20, hugepage );
+    }
+
+    addsig( SIGPIPE, SIG_IGN );
+
+    // 预派生模式的连接对象和网站根目录的监视都在子进程中
+    if( process_number >= 0 ){
+        int ret = run_prefork( ip, port, process_number, accept_mode );
+        if( ret < 0 ){
+            usage( basename( argv[0] ) );
+            return 1;
+        }
+        return ret;
+    }
+
+    users = new http_conn[ MAX_FD ];
+    assert( users );
+
+    // 监视网站根目录，文件变化时使file_cache中的缓存项失效
+    int inotifyfd = file_cache::instance()->init( doc_root );
+
+    // 未使用io_uring引擎或内核不支持时使用epoll
+    int ret = use_uring ? run_uring( ip, port, inotifyfd, sqpoll ) : -1;
+    if( ret < 0 ){
+        if( reactor_number >= 0 ){
+            ret = run_reactors( ip, port, inotifyfd, reactor_number );
+        }
+        else if( work_stealing_pool ){
+            ret = run_half_sync< threadpool< http_conn, work_stealing > >( ip, port, inotifyfd );
+        }
+        else{
+            ret = run_half_sync< threadpool< http_conn > >( ip, port, inotifyfd );
+        }
+    }
+
+    delete [] users;
+    return ret;
+}
@@ -0,0 +1,116 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <new>
+#include <atomic>
+#include <exception>
+
+/**
+ * @brief 有界的多生产者多消费者无锁环形队列（Dmitry Vyukov的算法）
+ * 每个槽位带一个序号：序号等于入队位置表示槽位空闲，等于入队位置+1表示已写入数据。
+ * 生产者和消费者各自用CAS抢占位置，不需要互斥锁，也不为每个元素分配内存。
+ * 入队位置、出队位置和每个槽位都独占一个缓存行，避免生产者与消费者之间的伪共享
+ * @tparam T 元素类型，须可平凡复制，通常是指针
+*/
+template< typename T >
+class mpmc_queue{
+public:
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    // capacity向上取整为2的幂
+    explicit mpmc_queue( size_t capacity ) : m_buffer( NULL ), m_mask( 0 ){
+        size_t size = 2;
+        while( size < capacity ){
+            size <<= 1;
+        }
+        void* buffer = NULL;
+        if( posix_memalign( &buffer, CACHE_LINE_SIZE, size * sizeof( cell ) ) != 0 ){
+            throw std::exception();
+        }
+        m_buffer = ( cell* )buffer;
+        m_mask = size - 1;
+        for( size_t i = 0; i < size; ++i ){
+            new( &m_buffer[i].sequence ) std::atomic< size_t >( i );
+        }
+        m_enqueue_pos.store( 0, std::memory_order_relaxed );
+        m_dequeue_pos.store( 0, std::memory_order_relaxed );
+    }
+    ~mpmc_queue(){
+        free( m_buffer );
+    }
+
+    // 入队，队列满时返回false
+    bool push( const T& data ){
+        cell* c;
+        size_t pos = m_enqueue_pos.load( std::memory_order_relaxed );
+        while( true ){
+            c = &m_buffer[ pos & m_mask ];
+            size_t seq = c->sequence.load( std::memory_order_acquire );
+            ptrdiff_t diff = ( ptrdiff_t )seq - ( ptrdiff_t )pos;
+            if( diff == 0 ){
+                if( m_enqueue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ){
+                    break;
+                }
+            }
+            else if( diff < 0 ){
+                // 槽位上还是一圈之前的数据，队列已满
+                return false;
+            }
+            else{
+                pos = m_enqueue_pos.load( std::memory_order_relaxed );
+            }
+        }
+        c->data = data;
+        c->sequence.store( pos + 1, std::memory_order_release );
+        return true;
+    }
+
+    // 出队，队列空时返回false
+    bool pop( T& data ){
+        cell* c;
+        size_t pos = m_dequeue_pos.load( std::memory_order_relaxed );
+        while( true ){
+            c = &m_buffer[ pos & m_mask ];
+            size_t seq = c->sequence.load( std::memory_order_acquire );
+            ptrdiff_t diff = ( ptrdiff_t )seq - ( ptrdiff_t )( pos + 1 );
+            if( diff == 0 ){
+                if( m_dequeue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ){
+                    break;
+                }
+            }
+            else if( diff < 0 ){
+                // 槽位尚未被写入，队列为空
+                return false;
+            }
+            else{
+                pos = m_dequeue_pos.load( std::memory_order_relaxed );
+            }
+        }
+        data = c->data;
+        // 槽位留给下一圈的生产者
+        c->sequence.store( pos + m_mask + 1, std::memory_order_release );
+        return true;
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    mpmc_queue( const mpmc_queue& );
+    mpmc_queue& operator=( const mpmc_queue& );
+
+    struct alignas( CACHE_LINE_SIZE ) cell{
+        std::atomic< size_t > sequence;
+        T data;
+    };
+
+private:
+    alignas( CACHE_LINE_SIZE ) cell* m_buffer;
+    size_t m_mask;
+    alignas( CACHE_LINE_SIZE ) std::atomic< size_t > m_enqueue_pos;
+    // 对齐同时使对象大小补齐到整缓存行，出队位置不会与相邻对象共享缓存行
+    alignas( CACHE_LINE_SIZE ) std::atomic< size_t > m_dequeue_pos;
+};
+
+#endif
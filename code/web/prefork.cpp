@@ -0,0 +1,159 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+
+#include "http_conn.h"
+#include "file_cache.h"
+#include "conn_timer.h"
+#include "log.h"
+#include "../process-thread/processpool.h"
+
+extern const char* doc_root;
+extern int create_listenfd( const char* ip, int port, bool reuseport );
+
+/**
+ * 预派生（prefork）模式：processpool<http_conn>。每个子进程有自己的epoll和连接对象数组，
+ * 连接的读取、解析和发送都在接受它的子进程中完成（run-to-completion），子进程之间不共享连接，也没有跨线程的交接。
+ * 以下是processpool子进程事件循环的扩展点对http_conn的实现，须在实例化processpool<http_conn>之前声明
+*/
+
+// 子进程中的状态，fork之后由child_init初始化：连接对象数组、连接期限的时间轮和网站根目录的inotify描述符。
+// file_cache在每个子进程中各有一份，由子进程自己的inotify使其失效；在父进程中监视的话变化只能被父进程看到
+static http_conn* child_users = NULL;
+static conn_timer* child_timers = NULL;
+static int child_inotifyfd = -1;
+
+// 与反应堆中的处理相同：真正超时的连接用shutdown唤醒其socket上的EPOLLRDHUP，由process_event按正常路径关闭
+static void on_deadline( conn_timer::node* timer, void* arg ){
+    http_conn* conn = ( http_conn* )timer->data;
+    int64_t deadline = conn->deadline();
+    if( deadline < 0 ){
+        child_timers->remove( timer );
+        return;
+    }
+    if( deadline > conn_timer::now_ms() ){
+        child_timers->add( timer, deadline, http_conn::DEADLINE_SLACK );
+        return;
+    }
+    child_timers->remove( timer );
+    LOG_INFO( "connection %d timed out", ( int )( conn - child_users ) );
+    shutdown( conn - child_users, SHUT_RDWR );
+}
+
+void child_init( http_conn* users, int epollfd ){
+    child_users = users;
+    // 时间轮在子进程中创建，拥有者是子进程唯一的线程，其时间从子进程启动时算起
+    child_timers = new conn_timer;
+    int wakeupfd = child_timers->init( on_deadline, NULL );
+    assert( wakeupfd != -1 );
+    epoll_event event;
+    event.data.fd = wakeupfd;
+    event.events = EPOLLIN;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, wakeupfd, &event );
+
+    child_inotifyfd = file_cache::instance()->init( doc_root );
+    if( child_inotifyfd != -1 ){
+        event.data.fd = child_inotifyfd;
+        event.events = EPOLLIN;
+        epoll_ctl( epollfd, EPOLL_CTL_ADD, child_inotifyfd, &event );
+    }
+}
+
+int child_tick( http_conn* users ){
+    child_timers->tick( conn_timer::now_ms() );
+    return child_timers->next_timeout();
+}
+
+void init_conn( http_conn* users, int epollfd, int connfd, const sockaddr_in& client_address ){
+    users[connfd].init( epollfd, connfd, client_address, child_timers );
+}
+
+void process_event( http_conn* users, int sockfd, uint32_t events ){
+    if( sockfd == child_inotifyfd ){
+        file_cache::instance()->handle_events();
+        return;
+    }
+    if( sockfd == child_timers->wakeup_fd() ){
+        child_timers->clear_wakeup();
+        return;
+    }
+    http_conn* conn = users + sockfd;
+    // 已关闭的连接上残留的事件，或不属于连接的描述符（如与父进程通信的管道）上的挂断
+    if( conn->deadline() < 0 ){
+        return;
+    }
+    if( events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ){
+        conn->close_conn();
+    }
+    else if( events & EPOLLIN ){
+        if( conn->read() ){
+            conn->process();
+        }
+        else{
+            conn->close_conn();
+        }
+    }
+    else if( events & EPOLLOUT ){
+        if( !conn->write() ){
+            conn->close_conn();
+        }
+        // 响应队列发完后，读缓冲中还有流水线上的请求，继续处理
+        else if( conn->has_pending_request() ){
+            conn->process();
+        }
+    }
+    // close_conn自己从epoll中移除并关闭socket，这里告诉进程池连接已经关闭，以便统计活跃连接数
+    if( conn->deadline() < 0 ){
+        conn_closed();
+    }
+}
+
+// 命令行中新连接接受方式的名字，按ACCEPT_MODE的顺序排列
+static const char* accept_mode_names[] = { "dispatch", "reuseport", "exclusive", "balance" };
+
+/**
+ * @brief 预派生模式的入口，父进程和每个子进程都从这里返回
+ * @param process_number 子进程数，0表示每个CPU一个，最多processpool::MAX_PROCESS_NUMBER个
+ * @param mode_name 新连接的接受方式（见accept_mode_names），NULL表示reuseport：每个子进程有自己的监听socket
+ * @return 接受方式无法识别时返回-1
+*/
+int run_prefork( const char* ip, int port, int process_number, const char* mode_name ){
+    typedef processpool< http_conn > pool_t;
+    ACCEPT_MODE mode = ACCEPT_REUSEPORT;
+    if( mode_name ){
+        int i = 0;
+        int n = sizeof( accept_mode_names ) / sizeof( accept_mode_names[0] );
+        while( ( i < n ) && ( strcmp( mode_name, accept_mode_names[i] ) != 0 ) ){
+            ++i;
+        }
+        if( i == n ){
+            return -1;
+        }
+        mode = ( ACCEPT_MODE )i;
+    }
+    if( process_number == 0 ){
+        process_number = sysconf( _SC_NPROCESSORS_ONLN );
+    }
+    if( process_number < 1 ){
+        process_number = 1;
+    }
+    if( process_number > pool_t::MAX_PROCESS_NUMBER ){
+        process_number = pool_t::MAX_PROCESS_NUMBER;
+    }
+
+    // 热升级启动时沿用旧主进程的监听socket
+    int listenfd = inherited_listenfd();
+    if( listenfd < 0 ){
+        listenfd = create_listenfd( ip, port, mode == ACCEPT_REUSEPORT );
+    }
+
+    pool_t* pool = pool_t::create( listenfd, process_number, mode );
+    pool->run();
+    delete pool;
+    close( listenfd );
+    return 0;
+}
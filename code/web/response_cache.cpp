@@ -0,0 +1,429 @@
+#include "response_cache.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <new>
+#include "log.h"
+
+response_cache* response_cache::instance(){
+    static response_cache cache;
+    return &cache;
+}
+
+response_cache::response_cache() : m_memory( 0 ), m_memory_len( 0 ), m_header( 0 ), m_slots( 0 ), m_buckets( 0 ), m_pins( 0 ),
+        m_data( 0 ), m_slot_size( 0 ), m_slot_number( 0 ), m_bucket_mask( 0 ), m_row( -1 ){}
+
+response_cache::~response_cache(){
+    if( m_memory ){
+        munmap( m_memory, m_memory_len );
+    }
+}
+
+static size_t align_up( size_t n, size_t alignment ){
+    return ( n + alignment - 1 ) / alignment * alignment;
+}
+
+bool response_cache::init( size_t budget, bool hugepage, size_t slot_size ){
+    size_t slot_number = budget / slot_size;
+    if( ( slot_number == 0 ) || ( slot_number >= NIL ) ){
+        return false;
+    }
+    size_t bucket_number = 1;
+    while( bucket_number < slot_number ){
+        bucket_number <<= 1;
+    }
+    // 共享内存依次是头部、槽、哈希桶、钉住计数和数据区；数据区按大页对齐，便于内核用透明大页映射
+    size_t slots_offset = align_up( sizeof( header ), 64 );
+    size_t buckets_offset = slots_offset + slot_number * sizeof( cached_response );
+    size_t pins_offset = align_up( buckets_offset + bucket_number * sizeof( uint32_t ), 64 );
+    size_t data_offset = align_up( pins_offset + MAX_PROCESSES * slot_number * sizeof( uint32_t ), 2 << 20 );
+    m_memory_len = data_offset + slot_number * slot_size;
+
+    // 与ChatGroup/serverplus.cpp一样用POSIX共享内存对象创建；映射由fork继承，创建后立即删除名字，
+    // 进程全部退出后内存随之释放，崩溃也不会在/dev/shm中遗留。没有/dev/shm时退回匿名共享映射
+    void* memory = MAP_FAILED;
+    bool reserved = false;
+    if( hugepage ){
+        // 显式大页需要预先在/proc/sys/vm/nr_hugepages中保留，长度须按2MB对齐；匿名共享映射同样由fork继承
+        size_t huge_len = align_up( m_memory_len, 2 << 20 );
+        memory = mmap( 0, huge_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+        if( memory != MAP_FAILED ){
+            m_memory_len = huge_len;
+            reserved = true;
+            LOG_INFO( "response cache uses %zu MB of reserved huge pages", huge_len >> 20 );
+        }
+        else{
+            LOG_WARN( "response cache cannot get reserved huge pages (%s), falling back to transparent huge pages", strerror( errno ) );
+        }
+    }
+    char name[ 64 ];
+    snprintf( name, sizeof( name ), "/response-cache-%d", getpid() );
+    int shmfd = ( memory == MAP_FAILED ) ? shm_open( name, O_CREAT | O_EXCL | O_RDWR, 0600 ) : -1;
+    if( shmfd >= 0 ){
+        shm_unlink( name );
+        if( ftruncate( shmfd, m_memory_len ) == 0 ){
+            memory = mmap( 0, m_memory_len, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0 );
+        }
+        close( shmfd );
+    }
+    if( memory == MAP_FAILED ){
+        memory = mmap( 0, m_memory_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+        if( memory == MAP_FAILED ){
+            return false;
+        }
+    }
+    m_memory = ( char* )memory;
+    m_header = new ( m_memory ) header;
+    m_slots = ( cached_response* )( m_memory + slots_offset );
+    m_buckets = ( std::atomic< uint32_t >* )( m_memory + buckets_offset );
+    m_pins = ( std::atomic< uint32_t >* )( m_memory + pins_offset );
+    m_data = m_memory + data_offset;
+    m_slot_size = slot_size;
+    m_slot_number = slot_number;
+    m_bucket_mask = bucket_number - 1;
+    // 没有保留的大页时，退而请求透明大页，内核未开启透明大页或为never时不起作用
+    if( hugepage && ! reserved && ( madvise( m_data, slot_number * slot_size, MADV_HUGEPAGE ) != 0 ) ){
+        LOG_WARN( "response cache cannot use transparent huge pages (%s)", strerror( errno ) );
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init( &attr );
+    pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+    pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+    pthread_mutex_init( &m_header->lock, &attr );
+    pthread_mutexattr_destroy( &attr );
+    m_header->generation.store( 1 );
+    for( int i = 0; i < MAX_PROCESSES; ++i ){
+        m_header->owners[i].store( 0 );
+    }
+    m_header->hand = 0;
+    m_header->unused = 0;
+    for( size_t i = 0; i < slot_number; ++i ){
+        cached_response* slot = new ( m_slots + i ) cached_response;
+        slot->seq.store( 0 );
+        slot->next.store( NIL );
+        slot->key_len.store( 0 );
+        slot->len.store( 0 );
+        slot->referenced.store( 0 );
+        slot->state = SLOT_PRIVATE;
+    }
+    for( size_t i = 0; i < bucket_number; ++i ){
+        new ( m_buckets + i ) std::atomic< uint32_t >( NIL );
+    }
+    for( size_t i = 0; i < MAX_PROCESSES * slot_number; ++i ){
+        new ( m_pins + i ) std::atomic< uint32_t >( 0 );
+    }
+
+    static bool atfork_registered = false;
+    if( ! atfork_registered ){
+        pthread_atfork( NULL, NULL, after_fork_child );
+        atfork_registered = true;
+    }
+    attach();
+    return true;
+}
+
+// 子进程继承了父进程的行号，但这一行属于父进程，第一次使用缓存时重新占用
+void response_cache::after_fork_child(){
+    instance()->m_row = -1;
+}
+
+int response_cache::row(){
+    if( m_row == -1 ){
+        attach();
+    }
+    return m_row;
+}
+
+void response_cache::attach(){
+    pid_t self = getpid();
+    // 回收所有者已经退出的行：它钉住的响应不会再被释放。先把所有者改为-1独占这一行，再清零
+    for( int i = 0; i < MAX_PROCESSES; ++i ){
+        pid_t owner = m_header->owners[i].load();
+        if( ( owner > 0 ) && ( owner != self ) && ( kill( owner, 0 ) < 0 ) && ( errno == ESRCH )
+                && m_header->owners[i].compare_exchange_strong( owner, -1 ) ){
+            for( uint32_t j = 0; j < m_slot_number; ++j ){
+                pins( i, j )->store( 0, std::memory_order_relaxed );
+            }
+            m_header->owners[i].store( 0 );
+        }
+    }
+    for( int i = 0; i < MAX_PROCESSES; ++i ){
+        pid_t owner = 0;
+        if( m_header->owners[i].compare_exchange_strong( owner, self ) ){
+            m_row = i;
+            return;
+        }
+    }
+    LOG_WARN( "response cache is shared by more than %d processes, disabled in process %d", MAX_PROCESSES, self );
+    m_row = -2;
+}
+
+// 失效以文件路径对应的URL进行，含有"//"或"/."的URL与其他写法指向同一文件，无法随之失效，不缓存
+bool response_cache::make_key( char* key, size_t& len, const char* url, bool linger ){
+    len = strlen( url );
+    if( ( len + 1 > MAX_KEY ) || strstr( url, "//" ) || strstr( url, "/." ) ){
+        return false;
+    }
+    memcpy( key, url, len );
+    key[ len++ ] = linger ? '1' : '0';
+    return true;
+}
+
+// FNV-1a
+uint64_t response_cache::hash( const char* key, size_t len ){
+    uint64_t h = 14695981039346656037ULL;
+    for( size_t i = 0; i < len; ++i ){
+        h = ( h ^ ( unsigned char )key[i] ) * 1099511628211ULL;
+    }
+    return h;
+}
+
+void response_cache::lock(){
+    // 持锁的进程崩溃了：锁交给本进程，标记为一致后继续使用。崩溃时正在改动的槽最多被遗留为奇数seq，由alloc_slot回收
+    if( pthread_mutex_lock( &m_header->lock ) == EOWNERDEAD ){
+        pthread_mutex_consistent( &m_header->lock );
+    }
+}
+
+void response_cache::unlock(){
+    pthread_mutex_unlock( &m_header->lock );
+}
+
+bool response_cache::pinned( uint32_t index ) const{
+    for( int i = 0; i < MAX_PROCESSES; ++i ){
+        if( pins( i, index )->load() != 0 ){
+            return true;
+        }
+    }
+    return false;
+}
+
+cached_response* response_cache::find( const char* key, size_t key_len, uint64_t h, int row ){
+    uint64_t generation = m_header->generation.load( std::memory_order_acquire );
+    for( int retry = 0; retry < MAX_RETRY; ++retry ){
+        bool restart = false;
+        uint32_t index = m_buckets[ h & m_bucket_mask ].load( std::memory_order_acquire );
+        for( int hops = 0; ( index != NIL ) && ( hops < MAX_HOPS ); ++hops ){
+            cached_response* slot = m_slots + index;
+            uint32_t seq = slot->seq.load( std::memory_order_acquire );
+            if( seq & 1 ){
+                restart = true;
+                break;
+            }
+            bool match = ( slot->hash.load( std::memory_order_relaxed ) == h )
+                    && ( slot->generation.load( std::memory_order_relaxed ) == generation )
+                    && ( slot->key_len.load( std::memory_order_relaxed ) == key_len )
+                    && ( memcmp( slot_data( slot ), key, key_len ) == 0 );
+            uint32_t next = slot->next.load( std::memory_order_relaxed );
+            std::atomic_thread_fence( std::memory_order_acquire );
+            if( slot->seq.load( std::memory_order_relaxed ) != seq ){
+                restart = true;
+                break;
+            }
+            if( ! match ){
+                index = next;
+                continue;
+            }
+            // 钉住之后再检查seq：写者回收槽时先改seq再检查钉住计数，两边都是顺序一致的，至少有一方能看到对方
+            pins( row, index )->fetch_add( 1 );
+            if( slot->seq.load() != seq ){
+                pins( row, index )->fetch_sub( 1 );
+                restart = true;
+                break;
+            }
+            if( ! slot->referenced.load( std::memory_order_relaxed ) ){
+                slot->referenced.store( 1, std::memory_order_relaxed );
+            }
+            return slot;
+        }
+        if( ! restart ){
+            return 0;
+        }
+    }
+    return 0;
+}
+
+cached_response* response_cache::lookup( const char* url, bool linger ){
+    if( ! m_memory ){
+        return 0;
+    }
+    int r = row();
+    char key[ MAX_KEY ];
+    size_t key_len;
+    if( ( r < 0 ) || ! make_key( key, key_len, url, linger ) ){
+        return 0;
+    }
+    return find( key, key_len, hash( key, key_len ), r );
+}
+
+cached_response* response_cache::insert( const char* url, bool linger, cached_file* file, const char* header, size_t header_len ){
+    if( ! m_memory || ! file->address ){
+        return 0;
+    }
+    int r = row();
+    char key[ MAX_KEY ];
+    size_t key_len;
+    if( ( r < 0 ) || ! make_key( key, key_len, url, linger ) || ( key_len + header_len + ( size_t )file->st.st_size > m_slot_size ) ){
+        return 0;
+    }
+    uint64_t h = hash( key, key_len );
+
+    lock();
+    cached_response* response = alloc_slot();
+    if( ! response ){
+        unlock();
+        return 0;
+    }
+    uint32_t index = response - m_slots;
+    pins( r, index )->fetch_add( 1 );
+    unlock();
+
+    // 在锁外填写：槽的seq为奇数且已被钉住，读者和其他进程的写者都不会使用它
+    char* data = slot_data( response );
+    memcpy( data, key, key_len );
+    memcpy( data + key_len, header, header_len );
+    memcpy( data + key_len + header_len, file->address, file->st.st_size );
+    response->hash.store( h, std::memory_order_relaxed );
+    response->key_len.store( key_len, std::memory_order_relaxed );
+    response->len.store( header_len + file->st.st_size, std::memory_order_relaxed );
+    response->generation.store( m_header->generation.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+
+    lock();
+    // 其他进程或线程已加入了同一个响应，或者文件在填写期间被inotify判定为过期（其URL的失效可能已经做过），
+    // 本槽不进入索引，仅供这一次发送使用，之后由alloc_slot回收
+    bool duplicate = file->stale.load() || ( indexed( key, key_len, h ) != 0 );
+    if( ! duplicate ){
+        response->next.store( m_buckets[ h & m_bucket_mask ].load( std::memory_order_relaxed ), std::memory_order_relaxed );
+        response->referenced.store( 1, std::memory_order_relaxed );
+        response->state = SLOT_INDEXED;
+    }
+    // 内容写完之后seq才变为偶数，再把槽挂到哈希链的头部
+    response->seq.store( response->seq.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+    if( ! duplicate ){
+        m_buckets[ h & m_bucket_mask ].store( index, std::memory_order_release );
+    }
+    unlock();
+    return response;
+}
+
+void response_cache::release( cached_response* response ){
+    pins( m_row, response - m_slots )->fetch_sub( 1, std::memory_order_release );
+}
+
+void response_cache::invalidate( const char* url ){
+    if( ! m_memory ){
+        return;
+    }
+    char key[ MAX_KEY ];
+    size_t key_len;
+    lock();
+    for( int linger = 0; linger < 2; ++linger ){
+        if( ! make_key( key, key_len, url, linger ) ){
+            break;
+        }
+        uint64_t h = hash( key, key_len );
+        // 同一键在链上可能还有代数已过期的槽，一并摘下
+        uint32_t index = m_buckets[ h & m_bucket_mask ].load( std::memory_order_relaxed );
+        while( index != NIL ){
+            cached_response* slot = m_slots + index;
+            index = slot->next.load( std::memory_order_relaxed );
+            if( ( slot->hash.load( std::memory_order_relaxed ) == h ) && ( slot->key_len.load( std::memory_order_relaxed ) == key_len )
+                    && ( memcmp( slot_data( slot ), key, key_len ) == 0 ) ){
+                unlink( slot );
+                slot->state = SLOT_PRIVATE;
+                // 正在验证这个槽的读者重新查找；已经钉住它的读者照常发送
+                slot->seq.store( slot->seq.load( std::memory_order_relaxed ) + 2 );
+            }
+        }
+    }
+    unlock();
+}
+
+// 代数加1后所有已有的响应都不再被查到，由alloc_slot逐渐回收
+void response_cache::invalidate_all(){
+    if( m_memory ){
+        m_header->generation.fetch_add( 1 );
+    }
+}
+
+cached_response* response_cache::indexed( const char* key, size_t key_len, uint64_t h ){
+    uint64_t generation = m_header->generation.load( std::memory_order_relaxed );
+    uint32_t index = m_buckets[ h & m_bucket_mask ].load( std::memory_order_relaxed );
+    while( index != NIL ){
+        cached_response* slot = m_slots + index;
+        if( ( slot->hash.load( std::memory_order_relaxed ) == h ) && ( slot->generation.load( std::memory_order_relaxed ) == generation )
+                && ( slot->key_len.load( std::memory_order_relaxed ) == key_len ) && ( memcmp( slot_data( slot ), key, key_len ) == 0 ) ){
+            return slot;
+        }
+        index = slot->next.load( std::memory_order_relaxed );
+    }
+    return 0;
+}
+
+/**
+ * 取出一个未被钉住的槽，返回时其seq为奇数且已从索引中摘下。
+ * 先用从未使用过的槽；之后CLOCK指针扫过所有槽，清除访问位，淘汰第一个访问位已清零（或已失效、不在索引中）且未被钉住的槽
+*/
+cached_response* response_cache::alloc_slot(){
+    if( m_header->unused < m_slot_number ){
+        cached_response* slot = m_slots + m_header->unused++;
+        slot->seq.store( slot->seq.load( std::memory_order_relaxed ) | 1 );
+        return slot;
+    }
+    uint64_t generation = m_header->generation.load( std::memory_order_relaxed );
+    for( size_t i = 0; i < 2 * ( size_t )m_slot_number; ++i ){
+        uint32_t index = m_header->hand;
+        m_header->hand = ( index + 1 ) % m_slot_number;
+        cached_response* slot = m_slots + index;
+        if( ( slot->state == SLOT_INDEXED ) && ( slot->generation.load( std::memory_order_relaxed ) == generation )
+                && slot->referenced.load( std::memory_order_relaxed ) ){
+            slot->referenced.store( 0, std::memory_order_relaxed );
+            continue;
+        }
+        uint32_t seq = slot->seq.load( std::memory_order_relaxed );
+        if( seq & 1 ){
+            // 正在被其他进程填写，填写者钉住了它；未被钉住的是填写者崩溃后遗留的，可以直接回收
+            if( pinned( index ) ){
+                continue;
+            }
+        }
+        else{
+            // 先把seq改为奇数再检查钉住计数，与find中先钉住再检查seq相对
+            slot->seq.store( seq + 1 );
+            if( pinned( index ) ){
+                slot->seq.store( seq + 2 );
+                continue;
+            }
+        }
+        if( slot->state == SLOT_INDEXED ){
+            unlink( slot );
+            slot->state = SLOT_PRIVATE;
+        }
+        slot->referenced.store( 0, std::memory_order_relaxed );
+        return slot;
+    }
+    return 0;
+}
+
+// 从哈希链上摘下，槽自己的next保持不变，正走到这个槽上的读者仍能沿着链继续
+void response_cache::unlink( cached_response* response ){
+    uint32_t index = response - m_slots;
+    std::atomic< uint32_t >* link = &m_buckets[ response->hash.load( std::memory_order_relaxed ) & m_bucket_mask ];
+    while( true ){
+        uint32_t i = link->load( std::memory_order_relaxed );
+        if( i == NIL ){
+            return;
+        }
+        if( i == index ){
+            link->store( response->next.load( std::memory_order_relaxed ), std::memory_order_release );
+            return;
+        }
+        link = &m_slots[i].next;
+    }
+}
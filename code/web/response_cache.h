@@ -0,0 +1,138 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <atomic>
+#include "file_cache.h"
+
+/**
+ * @brief 共享内存中的一个槽：槽的数据区依次存放键（URL加上keep-alive标志）和可以直接发送的完整响应（响应头和文件内容）
+ * 读者不加锁，以seq作为顺序锁验证读到的字段；改写槽的写者先把seq置为奇数，完成后再置为偶数。
+ * 读者读到的字段在seq验证之前可能不一致，所以都是原子变量（relaxed访问），state只在持有写锁时访问
+*/
+struct alignas( 64 ) cached_response{
+    std::atomic< uint32_t > seq;            // 顺序锁，奇数表示槽正在被改写
+    std::atomic< uint32_t > next;           // 哈希链上的下一个槽
+    std::atomic< uint64_t > hash;           // 键的哈希值
+    std::atomic< uint64_t > generation;     // 加入时缓存的代数，与当前代数不同的响应已失效
+    std::atomic< uint32_t > key_len;
+    std::atomic< uint32_t > len;            // 响应头与文件内容的总长度
+    std::atomic< uint8_t > referenced;      // CLOCK算法的访问位
+    uint8_t state;                          // 见response_cache::SLOT_STATE
+};
+
+/**
+ * @brief 小文件的完整响应缓存，以URL和keep-alive标志为键，位于进程间共享的内存中
+ * 命中时不需要stat，也不需要格式化响应头，一次send即可发出整个响应。
+ * 内存在init时一次性创建（shm_open/mmap），fork出的子进程继承同一映射，预派生模式下所有子进程共用同一份内容：
+ * 查找不加锁，由槽的顺序锁验证；加入、淘汰和失效由进程间共享的健壮互斥锁串行化，持锁的进程崩溃后锁仍可恢复。
+ * 正在发送的响应被钉住（pin）不能淘汰：每个进程在共享内存中占一行钉住计数，
+ * 进程崩溃后其他进程发现该行的所有者已不存在时清零并回收这一行，崩溃的进程钉住的槽不会永远无法淘汰。
+ * 内存预算切分成固定大小的槽，满时以CLOCK算法在所有进程间统一淘汰
+*/
+class response_cache{
+public:
+    // 每个槽的默认大小，键、响应头加文件内容超过槽大小的响应不缓存
+    static const size_t DEFAULT_SLOT_SIZE = 8 * 1024;
+    // 共享缓存的进程数上限（钉住计数的行数）
+    static const int MAX_PROCESSES = 32;
+
+public:
+    static response_cache* instance();
+
+    /**
+     * @brief 创建共享内存，须在fork子进程之前调用
+     * @param budget 槽可用的总字节数（不含索引和钉住计数），0表示不启用缓存
+     * @param hugepage 是否尝试用保留的大页（MAP_HUGETLB）映射缓存内存，失败时退回透明大页
+    */
+    bool init( size_t budget, bool hugepage = false, size_t slot_size = DEFAULT_SLOT_SIZE );
+
+    // 查找url对应的响应，命中时将其钉住
+    cached_response* lookup( const char* url, bool linger );
+    /**
+     * @brief 以响应头header和file中映射的文件内容组成完整响应并加入缓存
+     * @return 钉住的缓存响应；其他进程已并发加入同一响应或文件已过期时，返回的槽不进入索引，只供这一次发送使用；无法缓存时返回0
+    */
+    cached_response* insert( const char* url, bool linger, cached_file* file, const char* header, size_t header_len );
+    // 释放lookup或insert得到的钉住
+    void release( cached_response* response );
+
+    // 钉住的响应的内容和长度
+    const char* data( const cached_response* response ) const{
+        return slot_data( response ) + response->key_len.load( std::memory_order_relaxed );
+    }
+    size_t length( const cached_response* response ) const{
+        return response->len.load( std::memory_order_relaxed );
+    }
+
+    // 网站根目录下url对应的文件发生了变化，使它的响应在所有进程中失效
+    void invalidate( const char* url );
+    // 无法得知哪些文件发生了变化，使所有响应失效
+    void invalidate_all();
+
+private:
+    // 不在索引中的槽（正在填写、已失效或并发加入的重复响应）未被钉住时可以直接回收
+    enum SLOT_STATE { SLOT_PRIVATE, SLOT_INDEXED };
+    static const uint32_t NIL = 0xffffffff;
+    // 键的最大长度，更长的URL不缓存
+    static const size_t MAX_KEY = 256;
+    // 查找时一条哈希链最多走的槽数：读者可能沿着已被改写的槽走到别的链上，限制步数避免在链被改动时绕圈
+    static const int MAX_HOPS = 64;
+    // 顺序锁验证失败时重新查找的次数，仍失败按未命中处理
+    static const int MAX_RETRY = 4;
+
+    // 共享内存的头部
+    struct header{
+        pthread_mutex_t lock;                               // 写锁，进程间共享且健壮
+        std::atomic< uint64_t > generation;                 // 当前代数，invalidate_all时加1
+        std::atomic< pid_t > owners[ MAX_PROCESSES ];       // 各行钉住计数的所有者，0表示空闲
+        uint32_t hand;                                      // CLOCK指针
+        uint32_t unused;                                    // 从未使用过的槽从这里开始
+    };
+
+private:
+    response_cache();
+    ~response_cache();
+
+    static bool make_key( char* key, size_t& len, const char* url, bool linger );
+    static uint64_t hash( const char* key, size_t len );
+    static void after_fork_child();
+
+    char* slot_data( const cached_response* response ) const{
+        return m_data + ( size_t )( response - m_slots ) * m_slot_size;
+    }
+    std::atomic< uint32_t >* pins( int row, uint32_t index ) const{
+        return m_pins + ( size_t )row * m_slot_number + index;
+    }
+    // 本进程的钉住计数行，fork后的子进程第一次使用时占用一行，没有空闲行时返回负数
+    int row();
+    void attach();
+    bool pinned( uint32_t index ) const;
+    // 不加锁地查找并钉住
+    cached_response* find( const char* key, size_t key_len, uint64_t h, int row );
+
+    void lock();
+    void unlock();
+    // 以下函数需在持有写锁时调用
+    cached_response* indexed( const char* key, size_t key_len, uint64_t h );
+    cached_response* alloc_slot();
+    void unlink( cached_response* response );
+
+private:
+    char* m_memory;                                     // 整块共享内存
+    size_t m_memory_len;
+    header* m_header;
+    cached_response* m_slots;
+    std::atomic< uint32_t >* m_buckets;
+    std::atomic< uint32_t >* m_pins;                    // MAX_PROCESSES行，每行每个槽一个钉住计数
+    char* m_data;                                       // 所有槽的数据区
+    size_t m_slot_size;
+    uint32_t m_slot_number;
+    uint32_t m_bucket_mask;
+    int m_row;                                          // 本进程的行，-1表示尚未占用，-2表示占用失败
+};
+
+#endif
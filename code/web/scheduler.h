@@ -0,0 +1,198 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <exception>
+#include "locker.h"
+#include "mpmc_queue.h"
+#include "ws_deque.h"
+
+/**
+ * threadpool的任务调度策略。每个策略提供：
+ *   scheduler( int worker_number, int max_requests )
+ *   bool push( T* request, size_t affinity )  任意线程提交任务，affinity相同的任务尽量交给同一个工作线程
+ *   T* take( int worker, const std::atomic< bool >& stop )  第worker个工作线程取任务，没有任务时阻塞，stop置位后返回NULL
+ *   void wake_all()  唤醒所有阻塞的工作线程
+*/
+
+// 工作线程取任务失败后、睡眠之前重试的次数：任务密集时新任务往往很快到达，重试比一次futex睡眠和唤醒便宜
+static const int SCHEDULER_SPIN_COUNT = 64;
+
+/**
+ * @brief 全局队列：所有工作线程共享一个无锁环形队列，忽略affinity
+*/
+template< typename T >
+class global_queue{
+public:
+    global_queue( int worker_number, int max_requests ) : m_queue( max_requests ){}
+
+    bool push( T* request, size_t affinity ){
+        if( ! m_queue.push( request ) ){
+            return false;
+        }
+        m_event.notify_one();
+        return true;
+    }
+
+    T* take( int worker, const std::atomic< bool >& stop ){
+        T* request = NULL;
+        while( ! stop ){
+            for( int i = 0; i < SCHEDULER_SPIN_COUNT; ++i ){
+                if( m_queue.pop( request ) ){
+                    return request;
+                }
+            }
+            // 登记为等待者之后再检查一次，避免错过在两次检查之间入队的任务
+            uint32_t key = m_event.prepare_wait();
+            if( m_queue.pop( request ) ){
+                m_event.cancel_wait();
+                return request;
+            }
+            if( stop ){
+                m_event.cancel_wait();
+                break;
+            }
+            m_event.wait( key );
+        }
+        return NULL;
+    }
+
+    void wake_all(){
+        m_event.notify_all();
+    }
+
+private:
+    mpmc_queue< T* > m_queue;           // 请求队列
+    eventcount m_event;                 // 工作线程在队列为空时在此等待
+};
+
+/**
+ * @brief 工作窃取：每个工作线程有自己的任务队列，空闲的工作线程从随机选择的其他线程那里窃取任务
+ * 每个工作线程有两个队列：
+ *   收件箱：mpmc_queue，外部线程（反应堆）按affinity把任务放入对应工作线程的收件箱，同一连接的请求落在同一线程上；
+ *   双端队列：ws_deque，工作线程在处理任务时自己提交的任务放在这里，后进先出。
+ * 某个线程积压了一批慢请求时，其余线程会把它收件箱和双端队列中的任务偷走，不会全部堵在它后面
+*/
+template< typename T >
+class work_stealing{
+public:
+    // 每个工作线程双端队列的容量
+    static const size_t DEQUE_CAPACITY = 1024;
+
+    work_stealing( int worker_number, int max_requests ) : m_worker_number( worker_number ), m_workers( NULL ){
+        if( worker_number <= 0 ){
+            throw std::exception();
+        }
+        size_t inbox_capacity = ( max_requests + worker_number - 1 ) / worker_number;
+        m_workers = new worker*[ worker_number ];
+        for( int i = 0; i < worker_number; ++i ){
+            m_workers[i] = new worker( inbox_capacity, i );
+        }
+    }
+    ~work_stealing(){
+        for( int i = 0; i < m_worker_number; ++i ){
+            delete m_workers[i];
+        }
+        delete [] m_workers;
+    }
+
+    bool push( T* request, size_t affinity ){
+        // 工作线程自己提交的任务放入自己的双端队列
+        if( ( tls_owner == this ) && m_workers[ tls_index ]->deque.push( request ) ){
+            m_event.notify_one();
+            return true;
+        }
+        // 目标工作线程的收件箱满了，依次尝试其他线程的收件箱
+        for( int i = 0; i < m_worker_number; ++i ){
+            if( m_workers[ ( affinity + i ) % m_worker_number ]->inbox.push( request ) ){
+                m_event.notify_one();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    T* take( int index, const std::atomic< bool >& stop ){
+        tls_owner = this;
+        tls_index = index;
+        T* request = NULL;
+        while( ! stop ){
+            for( int i = 0; i < SCHEDULER_SPIN_COUNT; ++i ){
+                if( find( index, request ) ){
+                    return request;
+                }
+            }
+            uint32_t key = m_event.prepare_wait();
+            if( find( index, request ) ){
+                m_event.cancel_wait();
+                return request;
+            }
+            if( stop ){
+                m_event.cancel_wait();
+                break;
+            }
+            m_event.wait( key );
+        }
+        return NULL;
+    }
+
+    void wake_all(){
+        m_event.notify_all();
+    }
+
+private:
+    struct alignas( mpmc_queue< T* >::CACHE_LINE_SIZE ) worker{
+        worker( size_t inbox_capacity, int index ) : inbox( inbox_capacity ), deque( DEQUE_CAPACITY ),
+                seed( 2654435761u * ( index + 1 ) ){}
+        mpmc_queue< T* > inbox;
+        ws_deque< T* > deque;
+        uint32_t seed;                  // 选择窃取对象的随机数状态，只由所有者使用
+    };
+
+    // 依次查找自己的双端队列、自己的收件箱，然后从随机位置开始轮流窃取其他线程的任务
+    bool find( int index, T*& request ){
+        worker* self = m_workers[ index ];
+        if( self->deque.pop( request ) || self->inbox.pop( request ) ){
+            return true;
+        }
+        if( m_worker_number == 1 ){
+            return false;
+        }
+        self->seed ^= self->seed << 13;
+        self->seed ^= self->seed >> 17;
+        self->seed ^= self->seed << 5;
+        int start = self->seed % m_worker_number;
+        for( int i = 0; i < m_worker_number; ++i ){
+            int victim = ( start + i ) % m_worker_number;
+            if( victim == index ){
+                continue;
+            }
+            worker* w = m_workers[ victim ];
+            typename ws_deque< T* >::STEAL_STATUS status;
+            while( ( status = w->deque.steal( request ) ) == ws_deque< T* >::STEAL_ABORT ){
+            }
+            if( ( status == ws_deque< T* >::STEAL_OK ) || w->inbox.pop( request ) ){
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    int m_worker_number;
+    worker** m_workers;
+    eventcount m_event;                 // 所有工作线程都找不到任务时在此等待，任何线程都可以处理新任务，所以只唤醒一个
+
+    // 当前线程是哪个调度器的第几个工作线程，用于区分任务是否由工作线程自己提交
+    static thread_local work_stealing* tls_owner;
+    static thread_local int tls_index;
+};
+
+template< typename T >
+thread_local work_stealing< T >* work_stealing< T >::tls_owner = NULL;
+template< typename T >
+thread_local int work_stealing< T >::tls_index = 0;
+
+#endif
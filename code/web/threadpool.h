@@ -1,26 +1,34 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
-#include "locker.h"
+#include <atomic>
+#include "scheduler.h"
+#include "log.h"
 
 /**
  * @brief 线程池类
+ * 任务如何排队和分配由调度策略决定（见scheduler.h）：
+ * global_queue是所有工作线程共享的无锁环形队列；work_stealing为每个工作线程准备独立的队列，并允许空闲线程窃取任务。
+ * 两种策略下append和工作线程取任务都不加锁，工作线程只在找不到任务时才通过eventcount在futex上睡眠
  * @tparam T 任务类
+ * @tparam Scheduler 调度策略
 */
-template< typename T >
+template< typename T, template< typename > class Scheduler = global_queue >
 class threadpool{
 public:
     /**
      * @param thread_number 线程池中线程数量
-     * @param max_requests 请求队列中最多允许、等待处理的请求的数量
+     * @param max_requests 请求队列中最多允许、等待处理的请求的数量，向上取整为2的幂
     */
     threadpool( int thread_number = 8, int max_requests = 10000 );
     ~threadpool();
+    // 添加任务，队列已满时返回false
     bool append( T* request );
+    // 添加任务，affinity相同的任务尽量由同一个工作线程处理（如按连接的socket），队列已满时返回false
+    bool append( T* request, size_t affinity );
 
 private:
     /**
@@ -28,21 +36,24 @@ private:
     */
     static void* worker( void* arg );
     void run();
+    void stop();
 
 private:
     int m_thread_number;                // 线程数
     int m_max_requests;                 // 请求队列允许的最大请求数
+    std::atomic< bool > m_stop;         // 是否结束线程
     pthread_t* m_threads;               // 描述线程池的数组，大小为m_thread_number
-    std::list< T* > m_workqueue;        // 请求队列
-    locker m_queuelocker;               // 保护请求队列的互斥锁
-    sem m_queuestat;                    // 是否有任务需要处理
-    bool m_stop;                        // 是否结束线程
+    std::atomic< int > m_next_worker;   // 下一个启动的工作线程的编号
+    std::atomic< size_t > m_next_affinity;  // 没有指定affinity的任务轮流分配
+    Scheduler< T > m_scheduler;         // 请求队列
 };
 
 // 创建线程
-template< typename T >
-threadpool< T >::threadpool( int thread_number, int max_requests ) : 
-        m_thread_number( thread_number ), m_max_requests( max_requests ), m_stop( false ), m_threads( NULL ){
+template< typename T, template< typename > class Scheduler >
+threadpool< T, Scheduler >::threadpool( int thread_number, int max_requests ) :
+        m_thread_number( thread_number ), m_max_requests( max_requests ), m_stop( false ), m_threads( NULL ),
+        m_next_worker( 0 ), m_next_affinity( 0 ),
+        m_scheduler( thread_number > 0 ? thread_number : 1, max_requests > 0 ? max_requests : 1 ){
     if( ( thread_number <= 0 ) || ( max_requests <= 0 ) ){
         throw std::exception();
     }
@@ -51,15 +62,12 @@ threadpool< T >::threadpool( int thread_number, int max_requests ) :
     if( ! m_threads ){
         throw std::exception();
     }
-    // 创建线程，并将他们设置为脱离线程
+    // 创建线程。线程不脱离，析构时等待它们退出，之后才能释放调度器等成员
     for ( int i = 0; i < thread_number; ++i ){
-        printf( "create the %dth thread\n", i );
+        LOG_INFO( "create the %dth thread", i );
         if( pthread_create( m_threads + i, NULL, worker, this ) != 0 ){
-            delete [] m_threads;
-            throw std::exception();
-        }
-        if( pthread_detach( m_threads[i] ) ){
-            delete [] m_threads;
+            m_thread_number = i;
+            stop();
             throw std::exception();
         }
     }
@@ -67,50 +75,50 @@ threadpool< T >::threadpool( int thread_number, int max_requests ) :
 
 
 
-template< typename T >
-threadpool< T >::~threadpool()
+template< typename T, template< typename > class Scheduler >
+threadpool< T, Scheduler >::~threadpool()
 {
-    delete [] m_threads;
+    stop();
+}
+
+// 通知所有工作线程退出并等待它们结束，再释放线程数组
+template< typename T, template< typename > class Scheduler >
+void threadpool< T, Scheduler >::stop(){
     m_stop = true;
+    m_scheduler.wake_all();
+    for ( int i = 0; i < m_thread_number; ++i ){
+        pthread_join( m_threads[i], NULL );
+    }
+    delete [] m_threads;
+    m_threads = NULL;
 }
 
 
 // 添加任务
-template< typename T >
-bool threadpool< T >::append( T* request ){
-    m_queuelocker.lock();
-    if ( m_workqueue.size() > m_max_requests ){
-        m_queuelocker.unlock();
-        return false;
-    }
-    m_workqueue.push_back( request );
-    m_queuelocker.unlock();
-    m_queuestat.post();
-    return true;
+template< typename T, template< typename > class Scheduler >
+bool threadpool< T, Scheduler >::append( T* request ){
+    return m_scheduler.push( request, m_next_affinity.fetch_add( 1, std::memory_order_relaxed ) );
+}
+
+template< typename T, template< typename > class Scheduler >
+bool threadpool< T, Scheduler >::append( T* request, size_t affinity ){
+    return m_scheduler.push( request, affinity );
 }
 
 
 // 由于pthread_create，第三个参数只能是静态函数，要在静态函数中使用类的动态成员，如成员函数和成员变量，所以，需要将类的对象作为参数传递给静态函数
-template< typename T >
-void* threadpool< T >::worker( void* arg ){
+template< typename T, template< typename > class Scheduler >
+void* threadpool< T, Scheduler >::worker( void* arg ){
     threadpool* pool = ( threadpool* )arg;
     pool->run();
     return pool;
 }
 
-template< typename T >
-void threadpool< T >::run(){
+template< typename T, template< typename > class Scheduler >
+void threadpool< T, Scheduler >::run(){
+    int index = m_next_worker++;
     while ( ! m_stop ){
-        // 与append对应
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if ( m_workqueue.empty() ){
-            m_queuelocker.unlock();
-            continue;
-        }
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
+        T* request = m_scheduler.take( index, m_stop );
         if ( ! request ){
             continue;
         }
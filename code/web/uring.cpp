@@ -0,0 +1,331 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+uring::uring() : m_fd( -1 ), m_flags( 0 ), m_error( NULL ), m_sq_ptr( MAP_FAILED ), m_sq_size( 0 ), m_sq_head( NULL ),
+        m_sq_tail( NULL ), m_sq_flags( NULL ), m_sq_mask( 0 ), m_sq_entries( 0 ), m_sqe_tail( 0 ), m_sqes( ( io_uring_sqe* )MAP_FAILED ),
+        m_cq_ptr( MAP_FAILED ), m_cq_size( 0 ), m_cq_head( NULL ), m_cq_tail( NULL ), m_cq_mask( 0 ), m_cqes( NULL ),
+        m_max_files( 0 ), m_slots( NULL ), m_buf_ring( ( io_uring_buf_ring* )MAP_FAILED ), m_buf_ring_size( 0 ), m_buf_mask( 0 ),
+        m_buffers( ( char* )MAP_FAILED ), m_buffer_size( 0 ){
+}
+
+uring::~uring(){
+    if( m_fd != -1 ){
+        close( m_fd );
+    }
+    if( m_sqes != MAP_FAILED ){
+        munmap( m_sqes, m_sq_entries * sizeof( io_uring_sqe ) );
+    }
+    if( ( m_cq_ptr != MAP_FAILED ) && ( m_cq_ptr != m_sq_ptr ) ){
+        munmap( m_cq_ptr, m_cq_size );
+    }
+    if( m_sq_ptr != MAP_FAILED ){
+        munmap( m_sq_ptr, m_sq_size );
+    }
+    if( m_buf_ring != MAP_FAILED ){
+        munmap( m_buf_ring, m_buf_ring_size );
+    }
+    if( m_buffers != MAP_FAILED ){
+        munmap( m_buffers, ( size_t )( m_buf_mask + 1 ) * m_buffer_size );
+    }
+    delete [] m_slots;
+}
+
+bool uring::init( unsigned entries, bool sqpoll, unsigned max_files, unsigned buffers, unsigned buffer_size ){
+    io_uring_params p;
+    memset( &p, 0, sizeof( p ) );
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    if( sqpoll ){
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000;
+    }
+    else{
+        // 只有本线程提交，完成事件的处理推迟到等待完成时统一进行，减少内核打断事件循环的次数
+        p.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    }
+    m_fd = syscall( __NR_io_uring_setup, entries, &p );
+    if( ( m_fd < 0 ) && ( errno == EINVAL ) && ! sqpoll ){
+        p.flags = IORING_SETUP_CQSIZE;
+        m_fd = syscall( __NR_io_uring_setup, entries, &p );
+    }
+    if( m_fd < 0 ){
+        m_error = "io_uring_setup failed";
+        return false;
+    }
+    m_flags = p.flags;
+    if( ! ( p.features & IORING_FEAT_NODROP ) || ! ( p.features & IORING_FEAT_EXT_ARG ) ){
+        m_error = "kernel lacks IORING_FEAT_NODROP or IORING_FEAT_EXT_ARG";
+        return false;
+    }
+
+    m_sq_size = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof( io_uring_cqe );
+    if( p.features & IORING_FEAT_SINGLE_MMAP ){
+        if( m_cq_size > m_sq_size ){
+            m_sq_size = m_cq_size;
+        }
+    }
+    m_sq_ptr = mmap( NULL, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING );
+    if( m_sq_ptr == MAP_FAILED ){
+        m_error = "cannot map the submission queue";
+        return false;
+    }
+    if( p.features & IORING_FEAT_SINGLE_MMAP ){
+        m_cq_ptr = m_sq_ptr;
+    }
+    else{
+        m_cq_ptr = mmap( NULL, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING );
+        if( m_cq_ptr == MAP_FAILED ){
+            m_error = "cannot map the completion queue";
+            return false;
+        }
+    }
+    m_sq_entries = p.sq_entries;
+    m_sqes = ( io_uring_sqe* )mmap( NULL, m_sq_entries * sizeof( io_uring_sqe ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            m_fd, IORING_OFF_SQES );
+    if( m_sqes == MAP_FAILED ){
+        m_error = "cannot map the submission queue entries";
+        return false;
+    }
+
+    char* sq = ( char* )m_sq_ptr;
+    m_sq_head = ( unsigned* )( sq + p.sq_off.head );
+    m_sq_tail = ( unsigned* )( sq + p.sq_off.tail );
+    m_sq_flags = ( unsigned* )( sq + p.sq_off.flags );
+    m_sq_mask = *( unsigned* )( sq + p.sq_off.ring_mask );
+    m_sqe_tail = *m_sq_tail;
+    // SQE与提交队列中的位置一一对应，不使用间接数组的重排能力
+    unsigned* array = ( unsigned* )( sq + p.sq_off.array );
+    for( unsigned i = 0; i < m_sq_entries; ++i ){
+        array[i] = i;
+    }
+    char* cq = ( char* )m_cq_ptr;
+    m_cq_head = ( unsigned* )( cq + p.cq_off.head );
+    m_cq_tail = ( unsigned* )( cq + p.cq_off.tail );
+    m_cq_mask = *( unsigned* )( cq + p.cq_off.ring_mask );
+    m_cqes = ( io_uring_cqe* )( cq + p.cq_off.cqes );
+
+    if( ! probe() || ! setup_buffers( buffers, buffer_size ) ){
+        return false;
+    }
+
+    // 注册文件表不能超过描述符的上限；注册失败时所有操作都使用普通描述符
+    struct rlimit limit;
+    if( ( getrlimit( RLIMIT_NOFILE, &limit ) == 0 ) && ( limit.rlim_cur < max_files ) ){
+        max_files = limit.rlim_cur;
+    }
+    io_uring_rsrc_register reg;
+    memset( &reg, 0, sizeof( reg ) );
+    reg.nr = max_files;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if( syscall( __NR_io_uring_register, m_fd, IORING_REGISTER_FILES2, &reg, sizeof( reg ) ) == 0 ){
+        m_max_files = max_files;
+        m_slots = new int[ max_files ];
+        for( unsigned i = 0; i < max_files; ++i ){
+            m_slots[i] = -1;
+        }
+    }
+    return true;
+}
+
+// 检查用到的操作是否都受支持。多发接收（6.0）没有单独的探测方法，以同一版本加入的SEND_ZC代替
+bool uring::probe(){
+    static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SPLICE, IORING_OP_POLL_ADD,
+            IORING_OP_FILES_UPDATE, IORING_OP_SEND_ZC };
+    size_t size = sizeof( io_uring_probe ) + 256 * sizeof( io_uring_probe_op );
+    io_uring_probe* pr = ( io_uring_probe* )calloc( 1, size );
+    if( ! pr ){
+        m_error = "out of memory";
+        return false;
+    }
+    bool ok = syscall( __NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, pr, 256 ) == 0;
+    for( size_t i = 0; ok && ( i < sizeof( ops ) / sizeof( ops[0] ) ); ++i ){
+        ok = ( ops[i] <= pr->last_op ) && ( pr->ops[ ops[i] ].flags & IO_URING_OP_SUPPORTED );
+    }
+    free( pr );
+    if( ! ok ){
+        m_error = "kernel lacks multishot recv, splice or files update support";
+    }
+    return ok;
+}
+
+bool uring::setup_buffers( unsigned buffers, unsigned buffer_size ){
+    m_buf_ring_size = buffers * sizeof( io_uring_buf );
+    m_buf_ring = ( io_uring_buf_ring* )mmap( NULL, m_buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    m_buffers = ( char* )mmap( NULL, ( size_t )buffers * buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( ( m_buf_ring == MAP_FAILED ) || ( m_buffers == MAP_FAILED ) ){
+        m_error = "cannot allocate the provided buffers";
+        return false;
+    }
+    io_uring_buf_reg reg;
+    memset( &reg, 0, sizeof( reg ) );
+    reg.ring_addr = ( uint64_t )( uintptr_t )m_buf_ring;
+    reg.ring_entries = buffers;
+    reg.bgid = 0;
+    if( syscall( __NR_io_uring_register, m_fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) != 0 ){
+        m_error = "kernel lacks provided buffer rings";
+        return false;
+    }
+    m_buf_mask = buffers - 1;
+    m_buffer_size = buffer_size;
+    m_buf_ring->tail = 0;
+    for( unsigned i = 0; i < buffers; ++i ){
+        recycle( i );
+    }
+    return true;
+}
+
+void uring::recycle( int bid ){
+    unsigned short tail = m_buf_ring->tail;
+    // 旧版内核头文件的__DECLARE_FLEX_ARRAY在C++中会让bufs偏移8字节，直接把环当作io_uring_buf数组
+    io_uring_buf* buf = ( io_uring_buf* )m_buf_ring + ( tail & m_buf_mask );
+    buf->addr = ( uint64_t )( uintptr_t )buffer( bid );
+    buf->len = m_buffer_size;
+    buf->bid = bid;
+    __atomic_store_n( &m_buf_ring->tail, ( unsigned short )( tail + 1 ), __ATOMIC_RELEASE );
+}
+
+int uring::enter( unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t argsz ){
+    int ret = syscall( __NR_io_uring_enter, m_fd, to_submit, min_complete, flags, arg, argsz );
+    return ( ret < 0 ) ? -errno : ret;
+}
+
+// 把已填好的SQE交给内核，返回尚未被内核取走的数目
+unsigned uring::flush_sq(){
+    __atomic_store_n( m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE );
+    return m_sqe_tail - __atomic_load_n( m_sq_head, __ATOMIC_ACQUIRE );
+}
+
+io_uring_sqe* uring::get_sqe(){
+    while( m_sqe_tail - __atomic_load_n( m_sq_head, __ATOMIC_ACQUIRE ) >= m_sq_entries ){
+        unsigned submit = flush_sq();
+        if( m_flags & IORING_SETUP_SQPOLL ){
+            enter( 0, 0, IORING_ENTER_SQ_WAKEUP | IORING_ENTER_SQ_WAIT, NULL, 0 );
+        }
+        else if( enter( submit, 0, 0, NULL, 0 ) < 0 ){
+            return NULL;
+        }
+    }
+    io_uring_sqe* sqe = &m_sqes[ m_sqe_tail & m_sq_mask ];
+    ++m_sqe_tail;
+    memset( sqe, 0, sizeof( *sqe ) );
+    return sqe;
+}
+
+int uring::submit_and_wait( int timeout_ms ){
+    unsigned submit = flush_sq();
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if( m_flags & IORING_SETUP_SQPOLL ){
+        // 内核轮询线程空闲一段时间后休眠，并设置NEED_WAKEUP，此时需要唤醒它
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        if( __atomic_load_n( m_sq_flags, __ATOMIC_RELAXED ) & IORING_SQ_NEED_WAKEUP ){
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+    }
+    struct __kernel_timespec ts;
+    io_uring_getevents_arg arg;
+    memset( &arg, 0, sizeof( arg ) );
+    arg.sigmask_sz = _NSIG / 8;
+    if( timeout_ms >= 0 ){
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = ( long long )( timeout_ms % 1000 ) * 1000000;
+        arg.ts = ( uint64_t )( uintptr_t )&ts;
+    }
+    return enter( submit, 1, flags, &arg, sizeof( arg ) );
+}
+
+void uring::accept_multishot( int listenfd, uint64_t data ){
+    io_uring_sqe* sqe = get_sqe();
+    if( ! sqe ){
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = data;
+}
+
+void uring::recv_multishot( int fd, uint64_t data ){
+    io_uring_sqe* sqe = get_sqe();
+    if( ! sqe ){
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT | ( fixed( fd ) ? IOSQE_FIXED_FILE : 0 );
+    sqe->buf_group = 0;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = data;
+}
+
+void uring::sendmsg( int fd, const struct msghdr* msg, unsigned flags, uint64_t data, bool link ){
+    io_uring_sqe* sqe = get_sqe();
+    if( ! sqe ){
+        return;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->flags = ( fixed( fd ) ? IOSQE_FIXED_FILE : 0 ) | ( link ? IOSQE_IO_LINK : 0 );
+    sqe->addr = ( uint64_t )( uintptr_t )msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = data;
+}
+
+void uring::splice( int fd_in, int64_t off_in, int fd_out, unsigned len, uint64_t data, bool link ){
+    io_uring_sqe* sqe = get_sqe();
+    if( ! sqe ){
+        return;
+    }
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = fd_out;
+    sqe->flags = ( fixed( fd_out ) ? IOSQE_FIXED_FILE : 0 ) | ( link ? IOSQE_IO_LINK : 0 );
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = ( uint64_t )off_in;
+    sqe->off = ( uint64_t )-1;
+    sqe->len = len;
+    sqe->user_data = data;
+}
+
+void uring::poll_multishot( int fd, unsigned events, uint64_t data ){
+    io_uring_sqe* sqe = get_sqe();
+    if( ! sqe ){
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+    sqe->user_data = data;
+}
+
+bool uring::register_fd( int slot, int fd, bool link ){
+    if( ( slot < 0 ) || ( ( unsigned )slot >= m_max_files ) ){
+        return false;
+    }
+    io_uring_sqe* sqe = get_sqe();
+    if( ! sqe ){
+        return false;
+    }
+    m_slots[ slot ] = fd;
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS | ( link ? IOSQE_IO_LINK : 0 );
+    sqe->addr = ( uint64_t )( uintptr_t )&m_slots[ slot ];
+    sqe->len = 1;
+    sqe->off = slot;
+    sqe->user_data = pack( OP_FILES_UPDATE, slot, 0 );
+    return fd != -1;
+}
@@ -0,0 +1,126 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/**
+ * @brief io_uring实例的最小封装，直接使用系统调用，不依赖liburing
+ * 提交队列中的操作在事件循环的每一轮由一次io_uring_enter统一提交，同时等待完成事件，超时作为参数传入；
+ * 使用SQPOLL时由内核线程轮询提交队列，只在它休眠后才需要唤醒。
+ * 接收使用提供缓冲区环（provided buffer ring）：多发（multishot）接收每次完成时由内核从环中选取一个缓冲区，处理完后归还到环中。
+ * 连接的socket以其描述符为下标登记在注册文件表中，环上的操作使用固定文件，省去每次操作查找和引用描述符的开销。
+ * 只由创建它的线程使用，不是线程安全的
+*/
+class uring{
+public:
+    // 环上操作的类型，与描述符和连接的代数一起编码在user_data中
+    enum OP { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_SPLICE_IN, OP_SPLICE_OUT, OP_POLL, OP_FILES_UPDATE };
+
+    static uint64_t pack( int op, int fd, uint32_t gen ){
+        return ( ( uint64_t )op << 56 ) | ( ( uint64_t )( fd & 0xffffff ) << 32 ) | gen;
+    }
+    static int op_of( uint64_t data ){ return data >> 56; }
+    static int fd_of( uint64_t data ){ return ( data >> 32 ) & 0xffffff; }
+    static uint32_t gen_of( uint64_t data ){ return ( uint32_t )data; }
+
+public:
+    uring();
+    ~uring();
+
+    /**
+     * @brief 创建io_uring实例并检查所需的内核特性
+     * @param entries 提交队列的大小，完成队列是它的4倍
+     * @param sqpoll 是否使用内核线程轮询提交队列
+     * @param max_files 注册文件表的大小，描述符小于它的socket使用固定文件；注册失败时不使用固定文件
+     * @param buffers 提供缓冲区的数目，须为2的幂
+     * @param buffer_size 每个提供缓冲区的大小
+     * @return 内核不支持所需的操作时返回false，调用者应退回epoll
+    */
+    bool init( unsigned entries, bool sqpoll, unsigned max_files, unsigned buffers, unsigned buffer_size );
+    // init失败的原因
+    const char* error() const { return m_error; }
+
+    // 取一个空闲的SQE并清零，提交队列已满时先提交已有的操作
+    io_uring_sqe* get_sqe();
+
+    // 多发accept：每接受一个连接完成一次
+    void accept_multishot( int listenfd, uint64_t data );
+    // 多发接收到提供缓冲区中。fd已登记在注册文件表中时使用固定文件
+    void recv_multishot( int fd, uint64_t data );
+    // 发送msg中的数据。link为true时与下一个操作链接，前一个失败或不完整时后一个被取消
+    void sendmsg( int fd, const struct msghdr* msg, unsigned flags, uint64_t data, bool link );
+    // 从fd_in的off_in处（-1表示管道）移动len字节到fd_out，fd_out为socket时可以使用固定文件
+    void splice( int fd_in, int64_t off_in, int fd_out, unsigned len, uint64_t data, bool link );
+    // 多发poll，fd每次就绪都完成一次
+    void poll_multishot( int fd, unsigned events, uint64_t data );
+    // 把fd登记到注册文件表中下标为fd的位置（fd为-1时清除slot），返回之后的操作是否可以使用固定文件。link同sendmsg
+    bool register_fd( int slot, int fd, bool link );
+
+    // 提交所有排队的操作，并等待至少一个完成事件，timeout_ms为-1时无限期等待。返回-errno
+    int submit_and_wait( int timeout_ms );
+
+    // 依次处理已到达的完成事件
+    template< typename F >
+    unsigned for_each_cqe( F f ){
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n( m_cq_tail, __ATOMIC_ACQUIRE );
+        unsigned count = 0;
+        for( ; head != tail; ++head, ++count ){
+            f( &m_cqes[ head & m_cq_mask ] );
+        }
+        __atomic_store_n( m_cq_head, head, __ATOMIC_RELEASE );
+        return count;
+    }
+
+    // 完成事件选中的提供缓冲区
+    char* buffer( int bid ) const { return m_buffers + ( size_t )bid * m_buffer_size; }
+    // 把处理完的提供缓冲区归还到环中
+    void recycle( int bid );
+
+private:
+    int enter( unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t argsz );
+    unsigned flush_sq();
+    bool probe();
+    bool setup_buffers( unsigned buffers, unsigned buffer_size );
+    // fd是否已登记在注册文件表中
+    bool fixed( int fd ) const { return ( fd >= 0 ) && ( ( unsigned )fd < m_max_files ) && ( m_slots[ fd ] == fd ); }
+
+private:
+    int m_fd;
+    unsigned m_flags;
+    const char* m_error;
+
+    // 提交队列
+    void* m_sq_ptr;
+    size_t m_sq_size;
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned* m_sq_flags;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+    unsigned m_sqe_tail;                // 下一个空闲SQE，m_sqe_tail与*m_sq_tail之间是尚未提交的操作
+    io_uring_sqe* m_sqes;
+
+    // 完成队列
+    void* m_cq_ptr;
+    size_t m_cq_size;
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    io_uring_cqe* m_cqes;
+
+    // 注册文件表的大小，0表示没有注册；m_slots[i]是FILES_UPDATE写入下标i的描述符，须保持到操作执行
+    unsigned m_max_files;
+    int* m_slots;
+
+    // 提供缓冲区环
+    io_uring_buf_ring* m_buf_ring;
+    size_t m_buf_ring_size;
+    unsigned m_buf_mask;
+    char* m_buffers;
+    unsigned m_buffer_size;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <exception>
+
+/**
+ * @brief Chase-Lev工作窃取双端队列（按Lê等人给出的C11内存序版本实现），容量固定
+ * 只有所有者线程可以在底部push和pop（后进先出，缓存更热），其他线程从顶部steal（先进先出）。
+ * 所有者的操作在没有竞争时不需要CAS，只有取最后一个元素时才与窃取者竞争
+ * @tparam T 元素类型，须可平凡复制，通常是指针
+*/
+template< typename T >
+class ws_deque{
+public:
+    static const size_t CACHE_LINE_SIZE = 64;
+    // steal的结果
+    enum STEAL_STATUS { STEAL_OK = 0, STEAL_EMPTY, STEAL_ABORT };
+
+    // capacity向上取整为2的幂
+    explicit ws_deque( size_t capacity ) : m_buffer( NULL ), m_mask( 0 ){
+        size_t size = 2;
+        while( size < capacity ){
+            size <<= 1;
+        }
+        m_buffer = new std::atomic< T >[ size ];
+        m_mask = size - 1;
+        m_top.store( 0, std::memory_order_relaxed );
+        m_bottom.store( 0, std::memory_order_relaxed );
+    }
+    ~ws_deque(){
+        delete [] m_buffer;
+    }
+
+    // 所有者入队，队列满时返回false
+    bool push( const T& data ){
+        int64_t b = m_bottom.load( std::memory_order_relaxed );
+        int64_t t = m_top.load( std::memory_order_acquire );
+        if( b - t > ( int64_t )m_mask ){
+            return false;
+        }
+        m_buffer[ b & m_mask ].store( data, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+        m_bottom.store( b + 1, std::memory_order_relaxed );
+        return true;
+    }
+
+    // 所有者出队，队列为空或最后一个元素被窃取者抢走时返回false
+    bool pop( T& data ){
+        int64_t b = m_bottom.load( std::memory_order_relaxed ) - 1;
+        m_bottom.store( b, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        int64_t t = m_top.load( std::memory_order_relaxed );
+        if( t > b ){
+            m_bottom.store( b + 1, std::memory_order_relaxed );
+            return false;
+        }
+        data = m_buffer[ b & m_mask ].load( std::memory_order_relaxed );
+        if( t == b ){
+            // 只剩一个元素，与窃取者竞争
+            bool won = m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed );
+            m_bottom.store( b + 1, std::memory_order_relaxed );
+            return won;
+        }
+        return true;
+    }
+
+    // 其他线程从顶部窃取，与其他窃取者或所有者竞争失败时返回STEAL_ABORT
+    STEAL_STATUS steal( T& data ){
+        int64_t t = m_top.load( std::memory_order_acquire );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        int64_t b = m_bottom.load( std::memory_order_acquire );
+        if( t >= b ){
+            return STEAL_EMPTY;
+        }
+        data = m_buffer[ t & m_mask ].load( std::memory_order_relaxed );
+        if( ! m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) ){
+            return STEAL_ABORT;
+        }
+        return STEAL_OK;
+    }
+
+private:
+    ws_deque( const ws_deque& );
+    ws_deque& operator=( const ws_deque& );
+
+private:
+    std::atomic< T >* m_buffer;
+    size_t m_mask;
+    // 窃取者修改top，所有者修改bottom，分处不同的缓存行
+    alignas( CACHE_LINE_SIZE ) std::atomic< int64_t > m_top;
+    alignas( CACHE_LINE_SIZE ) std::atomic< int64_t > m_bottom;
+};
+
+#endif